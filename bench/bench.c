@@ -0,0 +1,310 @@
+/*
+ * Simple Dalvik Virtual Machine Implementation
+ *
+ * Copyright (C) 2014 cycheng <createinfinite@yahoo.com.tw>
+ * Copyright (C) 2013 Chun-Yu Wang <wicanr2@gmail.com>
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/*  Benchmark harness (make bench)
+ *
+ *  Every benchmark of the manifest (see benchmarks) is run on both VMs :
+ *  its .dex on dvm/dvm, its .class on jvm/jvm. A few warmup runs first,
+ *  not measured (page cache, CPU frequency), then the measured ones. Each
+ *  run is a new process, its output is thrown away, and the wall time of
+ *  the whole process is taken. The result is JSON on stdout : median,
+ *  mean, standard deviation, min and max in seconds, and ops/sec from the
+ *  median for a benchmark with an ops count (0 : a smoke run, no rate).
+ *  A run failing ends the measure of that benchmark on that VM, a
+ *  benchmark whose file is missing is skipped.
+ *
+ *  When the kernel lets us, the hardware counters of each run (cycles,
+ *  instructions, branch misses, L1d read misses, user space, from exec
+ *  to exit) are read too, and their medians reported with the IPC. If
+ *  not (a container, no PMU), timing only. dvm --perf-counters splits
+ *  them between parse, init and execute.
+ */
+#define BENCH_MAX_REPS 1000
+#define BENCH_LINE_SIZE 1024
+#define BENCH_COUNTERS 4
+
+static const char *bench_counter_names[BENCH_COUNTERS] = {
+    "cycles", "instructions", "branch_misses", "l1d_misses",
+};
+
+static int bench_counters_on = 0;
+
+typedef struct _bench_vm {
+    const char *name;
+    const char *path;
+    const char *suffix;         /* of the files it runs */
+} bench_vm;
+
+static double bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* counter 'c' of 'pid' from its exec on, -1 if the kernel says no */
+static int bench_counter_open(int c, pid_t pid)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    if (c == 0)
+        attr.config = PERF_COUNT_HW_CPU_CYCLES;
+    else if (c == 1)
+        attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+    else if (c == 2)
+        attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+    else {
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = PERF_COUNT_HW_CACHE_L1D | PERF_COUNT_HW_CACHE_OP_READ << 8 |
+                      PERF_COUNT_HW_CACHE_RESULT_MISS << 16;
+    }
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.disabled = 1;
+    attr.enable_on_exec = 1;
+    attr.inherit = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, pid, -1, -1, 0);
+}
+
+/*  run 'vm' on 'file' once, its wall time in seconds, < 0 if it failed ;
+ *  its counters in 'counts' (-1 : not available)
+ */
+static double bench_run(const char *vm, const char *file, int *status, double *counts)
+{
+    int fd[BENCH_COUNTERS], go[2], c;
+    double start;
+    pid_t pid;
+    char ok = 1;
+
+    for (c = 0; c < BENCH_COUNTERS; c++) {
+        fd[c] = -1;
+        counts[c] = -1;
+    }
+    if (pipe(go) != 0)
+        return -1;
+    pid = fork();
+    if (pid < 0)
+        return -1;
+    if (pid == 0) {
+        int null = open("/dev/null", O_RDWR);
+        /* the counters are set up before the exec */
+        close(go[1]);
+        if (read(go[0], &ok, 1) != 1)
+            _exit(127);
+        if (null >= 0) {
+            dup2(null, 0);
+            dup2(null, 1);
+        }
+        execl(vm, vm, file, (char *)NULL);
+        _exit(127);
+    }
+    close(go[0]);
+    for (c = 0; bench_counters_on && c < BENCH_COUNTERS; c++)
+        fd[c] = bench_counter_open(c, pid);
+    start = bench_now();
+    if (write(go[1], &ok, 1) != 1)
+        kill(pid, SIGKILL);
+    close(go[1]);
+    if (waitpid(pid, status, 0) != pid)
+        return -1;
+    start = bench_now() - start;
+    for (c = 0; c < BENCH_COUNTERS; c++) {
+        unsigned long long v;
+        if (fd[c] < 0)
+            continue;
+        if (read(fd[c], &v, sizeof(v)) == sizeof(v))
+            counts[c] = (double)v;
+        close(fd[c]);
+    }
+    if (!WIFEXITED(*status) || WEXITSTATUS(*status) != 0)
+        return -1;
+    return start;
+}
+
+static int bench_by_value(const void *a, const void *b)
+{
+    const double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double bench_median(const double *values, int count)
+{
+    double sorted[BENCH_MAX_REPS];
+
+    memcpy(sorted, values, sizeof(double) * count);
+    qsort(sorted, count, sizeof(double), bench_by_value);
+    return count % 2 ? sorted[count / 2] : (sorted[count / 2 - 1] + sorted[count / 2]) / 2;
+}
+
+static void bench_report(const char *name, const bench_vm *vm, const char *file,
+                         double ops, const double *times, double counts[][BENCH_COUNTERS],
+                         int count, const char *error, int *first)
+{
+    double values[BENCH_MAX_REPS], median[BENCH_COUNTERS], mean = 0, var = 0, min, max;
+    int i, c;
+
+    printf("%s\n    {\"benchmark\": \"%s\", \"vm\": \"%s\", \"file\": \"%s\"",
+           *first ? "" : ",", name, vm->name, file);
+    *first = 0;
+    if (error) {
+        printf(", \"error\": \"%s\"}", error);
+        return;
+    }
+    min = max = times[0];
+    for (i = 0; i < count; i++) {
+        mean += times[i];
+        min = times[i] < min ? times[i] : min;
+        max = times[i] > max ? times[i] : max;
+    }
+    mean /= count;
+    for (i = 0; i < count; i++)
+        var += (times[i] - mean) * (times[i] - mean);
+    var = count > 1 ? var / (count - 1) : 0;
+    median[0] = bench_median(times, count);
+    printf(", \"runs\": %d, \"median\": %.6f, \"mean\": %.6f, \"stddev\": %.6f, "
+           "\"min\": %.6f, \"max\": %.6f", count, median[0], mean, sqrt(var), min, max);
+    if (ops > 0)
+        printf(", \"ops\": %.0f, \"ops_per_sec\": %.1f", ops, median[0] > 0 ? ops / median[0] : 0);
+
+    /* medians of the counters every run had */
+    for (c = 0; c < BENCH_COUNTERS; c++) {
+        median[c] = -1;
+        for (i = 0; i < count && counts[i][c] >= 0; i++)
+            values[i] = counts[i][c];
+        if (i == count)
+            median[c] = bench_median(values, count);
+        if (median[c] >= 0)
+            printf(", \"%s\": %.0f", bench_counter_names[c], median[c]);
+    }
+    if (median[0] > 0 && median[1] >= 0)
+        printf(", \"ipc\": %.3f", median[1] / median[0]);
+    printf("}");
+}
+
+static void usage(const char *prog)
+{
+    printf("%s [options] manifest\n", prog);
+    printf("  --warmup=N     unmeasured runs first (default 2)\n");
+    printf("  --reps=N       measured runs (default 10, at most %d)\n", BENCH_MAX_REPS);
+    printf("  --dvm=PATH     the Dalvik VM (default dvm/dvm)\n");
+    printf("  --jvm=PATH     the Java VM (default jvm/jvm)\n");
+}
+
+int main(int argc, char *argv[])
+{
+    bench_vm vms[2] = {
+        {"dvm", "dvm/dvm", ".dex"},
+        {"jvm", "jvm/jvm", ".class"},
+    };
+    char line[BENCH_LINE_SIZE], dir[BENCH_LINE_SIZE];
+    const char *manifest = NULL;
+    int warmup = 2, reps = 10, first = 1, i;
+    FILE *f;
+
+    for (i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--warmup=", 9) == 0) {
+            warmup = atoi(argv[i] + 9);
+        } else if (strncmp(argv[i], "--reps=", 7) == 0) {
+            reps = atoi(argv[i] + 7);
+        } else if (strncmp(argv[i], "--dvm=", 6) == 0) {
+            vms[0].path = argv[i] + 6;
+        } else if (strncmp(argv[i], "--jvm=", 6) == 0) {
+            vms[1].path = argv[i] + 6;
+        } else if (argv[i][0] == '-') {
+            usage(argv[0]);
+            return 1;
+        } else {
+            manifest = argv[i];
+        }
+    }
+    if (manifest == NULL || warmup < 0 || reps <= 0 || reps > BENCH_MAX_REPS) {
+        usage(argv[0]);
+        return 1;
+    }
+    f = fopen(manifest, "r");
+    if (f == NULL) {
+        printf("Error! cannot open %s\n", manifest);
+        return 1;
+    }
+    /* the files are relative to the manifest */
+    snprintf(dir, sizeof(dir), "%s", manifest);
+    if (strrchr(dir, '/'))
+        strrchr(dir, '/')[1] = '\0';
+    else
+        strcpy(dir, "./");
+
+    /* can we count at all ? */
+    i = bench_counter_open(1, 0);
+    if (i >= 0) {
+        bench_counters_on = 1;
+        close(i);
+    } else {
+        fprintf(stderr, "bench : perf counters unavailable (%s), timing only\n",
+                strerror(errno));
+    }
+
+    printf("{\"warmup\": %d, \"reps\": %d, \"counters\": %s, \"results\": [",
+           warmup, reps, bench_counters_on ? "true" : "false");
+    while (fgets(line, sizeof(line), f)) {
+        char name[256], base[512], file[BENCH_LINE_SIZE + 520];
+        double ops;
+        int v;
+
+        if (line[0] == '#' || sscanf(line, "%255s %lf %511s", name, &ops, base) != 3)
+            continue;
+        for (v = 0; v < 2; v++) {
+            static double times[BENCH_MAX_REPS], counts[BENCH_MAX_REPS][BENCH_COUNTERS];
+            double run_counts[BENCH_COUNTERS];
+            const char *error = NULL;
+            char reason[64];
+            int status = 0, r;
+
+            snprintf(file, sizeof(file), "%s%s%s", dir, base, vms[v].suffix);
+            if (access(file, R_OK) != 0) {
+                printf("%s\n    {\"benchmark\": \"%s\", \"vm\": \"%s\", \"file\": \"%s\", "
+                       "\"skipped\": \"missing\"}", first ? "" : ",", name, vms[v].name, file);
+                first = 0;
+                continue;
+            }
+            fprintf(stderr, "bench : %s on %s\n", name, vms[v].name);
+            for (r = 0; r < warmup + reps && error == NULL; r++) {
+                double t = bench_run(vms[v].path, file, &status, run_counts);
+                if (t < 0) {
+                    if (WIFEXITED(status))
+                        snprintf(reason, sizeof(reason), "exit %d", WEXITSTATUS(status));
+                    else
+                        snprintf(reason, sizeof(reason), "signal %d", WTERMSIG(status));
+                    error = reason;
+                } else if (r >= warmup) {
+                    times[r - warmup] = t;
+                    memcpy(counts[r - warmup], run_counts, sizeof(run_counts));
+                }
+            }
+            bench_report(name, &vms[v], file, ops, times, counts, reps, error, &first);
+        }
+    }
+    printf("\n]}\n");
+    fclose(f);
+    return 0;
+}
@@ -0,0 +1,334 @@
+/*
+ * Simple Dalvik Virtual Machine Implementation
+ *
+ * Copyright (C) 2014 cycheng <createinfinite@yahoo.com.tw>
+ * Copyright (C) 2013 Chun-Yu Wang <wicanr2@gmail.com>
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdint.h>
+#include <unistd.h>
+#include "simple_dvm.h"
+
+/*  Allocation profiler
+ *
+ *  dvm --alloc-profile=FILE accounts every object sdvm_heap_alloc hands
+ *  out (new-instance, new-array, filled-new-array, strings, the objects
+ *  natives create, ...) to its site, the method and dex pc running at
+ *  the time (for a native, its invoke), and to its type descriptor. With
+ *  --alloc-sample=BYTES only one allocation every BYTES is recorded, and
+ *  the counts are estimates : cheaper on allocation heavy programs.
+ *
+ *  The counters belong to the context allocating (ctx->alloc), so threads
+ *  don't share them. There is no GC, the objects of a context all die
+ *  with it (sdvm_heap_free) : its counters are then added to the process
+ *  totals, and what is left at exit is the live heap. FILE gets both, by
+ *  site and by type, the biggest first.
+ */
+#define ALLOC_BUCKETS 1024
+#define ALLOC_NAME_SIZE 512
+
+typedef struct _alloc_site {
+    struct _alloc_site *next;
+    const void *method;         /* the key in a context : method, pc, type */
+    uint pc;
+    const char *type_key;
+    char *site;
+    char *type;
+    u8 objects;
+    u8 bytes;
+    u8 live_objects;            /* totals only */
+    u8 live_bytes;
+} alloc_site;
+
+typedef struct _alloc_table {
+    struct _alloc_table *next;
+    sdvm_context *ctx;
+    alloc_site *buckets[ALLOC_BUCKETS];
+    s8 countdown;               /* bytes to the next sample */
+} alloc_table;
+
+int allocprof_on = 0;
+static char *allocprof_file;
+static pid_t allocprof_pid;
+static s8 allocprof_interval;   /* 0 : every allocation */
+static pthread_mutex_t allocprof_lock = PTHREAD_MUTEX_INITIALIZER;
+static alloc_table *allocprof_tables;           /* of the live contexts */
+static alloc_site *allocprof_totals[ALLOC_BUCKETS];
+
+static unsigned int alloc_hash(const char *a, const char *b)
+{
+    unsigned int h = 5381;
+    while (*a)
+        h = h * 33 + (unsigned char)*a++;
+    while (*b)
+        h = h * 33 + (unsigned char)*b++;
+    return h % ALLOC_BUCKETS;
+}
+
+static alloc_table *alloc_table_get(sdvm_context *ctx)
+{
+    alloc_table *t = ctx->alloc;
+
+    if (t)
+        return t;
+    t = (alloc_table *)calloc(1, sizeof(alloc_table));
+    if (t == NULL) {
+        printf("Error! cannot allocate the allocation profile\n");
+        exit(1);
+    }
+    t->ctx = ctx;
+    t->countdown = allocprof_interval;
+    pthread_mutex_lock(&allocprof_lock);
+    t->next = allocprof_tables;
+    allocprof_tables = t;
+    pthread_mutex_unlock(&allocprof_lock);
+    ctx->alloc = t;
+    return t;
+}
+
+static alloc_site *alloc_site_new(alloc_site **bucket, const char *site, const char *type)
+{
+    alloc_site *s = (alloc_site *)calloc(1, sizeof(alloc_site));
+
+    s->site = strdup(site);
+    s->type = strdup(type);
+    s->next = *bucket;
+    *bucket = s;
+    return s;
+}
+
+/* 'size' bytes of 'type' were just allocated in 'ctx' */
+void allocprof_record(sdvm_context *ctx, size_t size, const char *type)
+{
+    alloc_table *t = alloc_table_get(ctx);
+    simple_dalvik_vm *vm = ctx->run_vm;
+    const void *method = NULL;
+    u8 objects = 1, bytes = size;
+    uint pc = 0;
+    unsigned int h;
+    alloc_site *s;
+
+    if (allocprof_interval) {
+        s8 n;
+        t->countdown -= size;
+        if (t->countdown > 0)
+            return;
+        n = 1 + -t->countdown / allocprof_interval;
+        t->countdown += n * allocprof_interval;
+        bytes = n * allocprof_interval;
+        objects = (bytes + size / 2) / (size ? size : 1);
+    }
+    if (type == NULL)
+        type = "(unknown)";
+    if (vm && vm->depth > 0 && vm->depth <= VM_MAX_FRAMES) {
+        method = vm->frames[vm->depth - 1].method;
+        pc = vm->pc / 2;
+    }
+
+    h = (((uintptr_t)method >> 3) ^ pc ^ ((uintptr_t)type >> 2)) % ALLOC_BUCKETS;
+    for (s = t->buckets[h]; s; s = s->next)
+        if (s->method == method && s->pc == pc && s->type_key == type)
+            break;
+    if (s == NULL) {
+        char site[ALLOC_NAME_SIZE];
+
+        if (method) {
+            const encoded_method *m = (const encoded_method *)method;
+            char name[ALLOC_NAME_SIZE - 16];
+            get_method_full_name(ctx->run_dex, m->method_id, name, sizeof(name));
+            snprintf(site, sizeof(site), "%s+0x%04x", name, pc);
+        } else {
+            /* loading, startup, or too deep to tell */
+            snprintf(site, sizeof(site), "%s", vm && vm->depth > 0 ? "(deep stack)" : "(vm)");
+        }
+        s = alloc_site_new(&t->buckets[h], site, type);
+        s->method = method;
+        s->pc = pc;
+        s->type_key = type;
+    }
+    s->objects += objects;
+    s->bytes += bytes;
+}
+
+/* add the counters of 't' to the totals, call with allocprof_lock held */
+static void alloc_merge(alloc_table *t, int live)
+{
+    alloc_site *s, *m;
+    int i;
+
+    for (i = 0; i < ALLOC_BUCKETS; i++)
+        for (s = t->buckets[i]; s; s = s->next) {
+            const unsigned int h = alloc_hash(s->site, s->type);
+            for (m = allocprof_totals[h]; m; m = m->next)
+                if (strcmp(m->site, s->site) == 0 && strcmp(m->type, s->type) == 0)
+                    break;
+            if (m == NULL)
+                m = alloc_site_new(&allocprof_totals[h], s->site, s->type);
+            m->objects += s->objects;
+            m->bytes += s->bytes;
+            if (live) {
+                m->live_objects += s->objects;
+                m->live_bytes += s->bytes;
+            }
+        }
+}
+
+static void alloc_table_free(alloc_table *t)
+{
+    alloc_site *s;
+    int i;
+
+    for (i = 0; i < ALLOC_BUCKETS; i++)
+        while ((s = t->buckets[i]) != NULL) {
+            t->buckets[i] = s->next;
+            free(s->site);
+            free(s->type);
+            free(s);
+        }
+    free(t);
+}
+
+/* the objects of 'ctx' are going away */
+void allocprof_release(sdvm_context *ctx)
+{
+    alloc_table *t = ctx->alloc, **p;
+
+    pthread_mutex_lock(&allocprof_lock);
+    for (p = &allocprof_tables; *p; p = &(*p)->next)
+        if (*p == t) {
+            *p = t->next;
+            break;
+        }
+    alloc_merge(t, 0);
+    pthread_mutex_unlock(&allocprof_lock);
+    ctx->alloc = NULL;
+    alloc_table_free(t);
+}
+
+/* one line per distinct 'site' (or type) of the totals */
+typedef struct _alloc_row {
+    const char *name;
+    u8 objects, bytes, live_objects, live_bytes;
+} alloc_row;
+
+static int alloc_by_bytes(const void *a, const void *b)
+{
+    const alloc_row *x = (const alloc_row *)a;
+    const alloc_row *y = (const alloc_row *)b;
+
+    if (x->bytes != y->bytes)
+        return x->bytes < y->bytes ? 1 : -1;
+    return strcmp(x->name, y->name);
+}
+
+static void alloc_report(FILE *f, const char *title, int by_type)
+{
+    alloc_row *rows = NULL;
+    size_t count = 0, cap = 0, i, k;
+    alloc_site *s;
+
+    for (i = 0; i < ALLOC_BUCKETS; i++)
+        for (s = allocprof_totals[i]; s; s = s->next) {
+            const char *name = by_type ? s->type : s->site;
+            for (k = 0; k < count; k++)
+                if (strcmp(rows[k].name, name) == 0)
+                    break;
+            if (k == count) {
+                if (count == cap) {
+                    cap = cap ? cap * 2 : 64;
+                    rows = (alloc_row *)realloc(rows, sizeof(alloc_row) * cap);
+                }
+                memset(&rows[count], 0, sizeof(alloc_row));
+                rows[count++].name = name;
+            }
+            rows[k].objects += s->objects;
+            rows[k].bytes += s->bytes;
+            rows[k].live_objects += s->live_objects;
+            rows[k].live_bytes += s->live_bytes;
+        }
+    qsort(rows, count, sizeof(alloc_row), alloc_by_bytes);
+
+    fprintf(f, "\n## %s\n%12s %14s %12s %14s  %s\n", title,
+            "objects", "bytes", "live objects", "live bytes", by_type ? "type" : "site");
+    for (i = 0; i < count; i++)
+        fprintf(f, "%12llu %14llu %12llu %14llu  %s\n",
+                (unsigned long long)rows[i].objects, (unsigned long long)rows[i].bytes,
+                (unsigned long long)rows[i].live_objects,
+                (unsigned long long)rows[i].live_bytes, rows[i].name);
+    free(rows);
+}
+
+static void allocprof_finish(void)
+{
+    u8 objects = 0, bytes = 0, live_objects = 0, live_bytes = 0;
+    size_t chunks = 0, mapped = 0, used = 0;
+    alloc_table *t;
+    alloc_site *s;
+    FILE *f;
+    int i;
+
+    /* a zygote job (fork) must not clobber the file */
+    if (allocprof_pid != getpid())
+        return;
+    allocprof_on = 0;
+    pthread_mutex_lock(&allocprof_lock);
+    for (t = allocprof_tables; t; t = t->next) {
+        sdvm_heap_chunk *c;
+        alloc_merge(t, 1);
+        for (c = t->ctx->heap_chunks; c; c = c->next) {
+            chunks++;
+            mapped += c->size;
+            used += c->used;
+        }
+    }
+    pthread_mutex_unlock(&allocprof_lock);
+    for (i = 0; i < ALLOC_BUCKETS; i++)
+        for (s = allocprof_totals[i]; s; s = s->next) {
+            objects += s->objects;
+            bytes += s->bytes;
+            live_objects += s->live_objects;
+            live_bytes += s->live_bytes;
+        }
+
+    f = fopen(allocprof_file, "w");
+    if (f == NULL) {
+        fprintf(stderr, "Error! cannot write allocation profile %s\n", allocprof_file);
+        return;
+    }
+    if (allocprof_interval)
+        fprintf(f, "# sampled every %lld bytes, counts are estimates\n",
+                (long long)allocprof_interval);
+    fprintf(f, "# allocated : %llu objects, %llu bytes\n",
+            (unsigned long long)objects, (unsigned long long)bytes);
+    fprintf(f, "# live at exit : %llu objects, %llu bytes, "
+            "heap %zu chunks, %zu bytes used of %zu mapped\n",
+            (unsigned long long)live_objects, (unsigned long long)live_bytes,
+            chunks, used, mapped);
+    alloc_report(f, "by site", 0);
+    alloc_report(f, "by type", 1);
+    fclose(f);
+    if (is_verbose())
+        fprintf(stderr, "allocprof : %llu objects, %llu bytes, profile in %s\n",
+                (unsigned long long)objects, (unsigned long long)bytes, allocprof_file);
+}
+
+/*  account allocations from now on, one every 'sample_bytes' (0 : all),
+ *  the profile goes to 'file' at exit
+ */
+int allocprof_start(const char *file, long sample_bytes)
+{
+    if (sample_bytes < 0) {
+        printf("Error! bad allocation sampling interval %ld\n", sample_bytes);
+        return -1;
+    }
+    if (allocprof_file == NULL)
+        atexit(allocprof_finish);
+    free(allocprof_file);
+    allocprof_file = strdup(file);
+    allocprof_pid = getpid();
+    allocprof_interval = sample_bytes;
+    allocprof_on = 1;
+    return 0;
+}
@@ -0,0 +1,329 @@
+/*
+ * Simple Dalvik Virtual Machine Implementation
+ *
+ * Copyright (C) 2014 cycheng <createinfinite@yahoo.com.tw>
+ * Copyright (C) 2013 Chun-Yu Wang <wicanr2@gmail.com>
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include "simple_dvm.h"
+#include "sdvm.h"
+
+/*  Batch runner
+ *
+ *  dvm --batch=MANIFEST runs many independent programs in one process.
+ *  Each line of the manifest is a job :
+ *
+ *      dex_file [entry [input [output]]]
+ *
+ *  with "-" for the defaults (main, no input, our stdout). Blank lines and
+ *  lines starting with '#' are skipped.
+ *
+ *  Each distinct dex file is parsed once (sdvm_dex_open) and shared
+ *  read-only by its jobs, every job runs in a VM instance of its own.
+ *  Jobs are dealt round-robin to per-worker deques : a worker takes its
+ *  own jobs from the back and, once it runs out, steals from the front
+ *  of the others', so long jobs don't leave threads idle. Output for our
+ *  stdout is collected per job and written in one piece when it ends.
+ *  The budget given on the command line (--max-insns, --max-time) applies
+ *  to every job.
+ */
+#define BATCH_MAX_WORKERS 64
+
+typedef struct _batch_job {
+    int dex;            /* index in batch_runner.dex */
+    char *dex_file;
+    char *entry;
+    char *input;        /* NULL : none */
+    char *output;       /* NULL : our stdout */
+    int status;         /* SDVM_xxx, or 1 if input / output failed */
+} batch_job;
+
+typedef struct _batch_deque {
+    pthread_mutex_t lock;
+    int *jobs;
+    int head;           /* thieves take from here */
+    int tail;           /* the owner takes from here */
+} batch_deque;
+
+typedef struct _batch_buffer {
+    char *data;
+    size_t len;
+    size_t cap;
+} batch_buffer;
+
+typedef struct _batch_runner {
+    batch_job *jobs;
+    int job_count;
+    sdvm_dex **dex;
+    int dex_count;
+    batch_deque deque[BATCH_MAX_WORKERS];
+    int workers;
+    pthread_mutex_t out_lock;
+    u8 insn_limit;      /* per job */
+    u8 time_limit_ns;
+} batch_runner;
+
+typedef struct _batch_worker {
+    batch_runner *b;
+    int id;
+    int done;
+    int stolen;
+} batch_worker;
+
+/* next job for worker 'id', its own first, -1 when every deque is empty */
+static int batch_next_job(batch_runner *b, int id, int *stolen)
+{
+    batch_deque *d = &b->deque[id];
+    int job = -1, i;
+
+    pthread_mutex_lock(&d->lock);
+    if (d->head < d->tail)
+        job = d->jobs[--d->tail];
+    pthread_mutex_unlock(&d->lock);
+    if (job >= 0)
+        return job;
+
+    for (i = 1; i < b->workers && job < 0; i++) {
+        d = &b->deque[(id + i) % b->workers];
+        pthread_mutex_lock(&d->lock);
+        if (d->head < d->tail)
+            job = d->jobs[d->head++];
+        pthread_mutex_unlock(&d->lock);
+    }
+    if (job >= 0)
+        (*stolen)++;
+    return job;
+}
+
+static void batch_write_buffer(void *arg, const void *data, size_t len)
+{
+    batch_buffer *buf = (batch_buffer *)arg;
+
+    if (buf->len + len > buf->cap) {
+        buf->cap = (buf->len + len) * 2;
+        buf->data = (char *)realloc(buf->data, buf->cap);
+    }
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+}
+
+static void batch_write_file(void *arg, const void *data, size_t len)
+{
+    fwrite(data, 1, len, (FILE *)arg);
+}
+
+static void batch_run_job(batch_runner *b, batch_job *job)
+{
+    sdvm_vm *vm = sdvm_vm_new(b->dex[job->dex]);
+    batch_buffer buf = {NULL, 0, 0};
+    FILE *out = NULL;
+    int in = -1;
+
+    sdvm_vm_set_budget(vm, b->insn_limit, b->time_limit_ns / 1e9);
+    if (job->input && (in = open(job->input, O_RDONLY | O_CLOEXEC)) < 0) {
+        fprintf(stderr, "Error! job %s : cannot open input %s\n", job->dex_file, job->input);
+        job->status = 1;
+        goto out;
+    }
+    if (job->output && (out = fopen(job->output, "w")) == NULL) {
+        fprintf(stderr, "Error! job %s : cannot create output %s\n", job->dex_file, job->output);
+        job->status = 1;
+        goto out;
+    }
+    /* no input : reads see end of file, not our stdin */
+    if (in < 0)
+        in = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    sdvm_vm_set_input(vm, in);
+    if (out)
+        sdvm_vm_set_output(vm, batch_write_file, out);
+    else
+        sdvm_vm_set_output(vm, batch_write_buffer, &buf);
+
+    job->status = sdvm_run(vm, job->entry);
+
+    if (buf.len > 0) {
+        pthread_mutex_lock(&b->out_lock);
+        output_write(buf.data, buf.len);
+        pthread_mutex_unlock(&b->out_lock);
+    }
+out:
+    if (out)
+        fclose(out);
+    if (in >= 0)
+        close(in);
+    free(buf.data);
+    sdvm_vm_free(vm);
+}
+
+static void *batch_worker_main(void *arg)
+{
+    batch_worker *w = (batch_worker *)arg;
+    int job;
+
+    while ((job = batch_next_job(w->b, w->id, &w->stolen)) >= 0) {
+        batch_run_job(w->b, &w->b->jobs[job]);
+        w->done++;
+    }
+    return NULL;
+}
+
+/* "-" is the default */
+static char *batch_field(char **line)
+{
+    char *field = strtok_r(NULL, " \t\r\n", line);
+    return field == NULL || strcmp(field, "-") == 0 ? NULL : strdup(field);
+}
+
+static int batch_parse(batch_runner *b, const char *manifest)
+{
+    FILE *f = fopen(manifest, "r");
+    char line[1024];
+    int cap = 0;
+
+    if (f == NULL) {
+        fprintf(stderr, "Error! cannot open batch manifest %s\n", manifest);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        batch_job *job;
+        char *save, *dex = strtok_r(line, " \t\r\n", &save);
+
+        if (dex == NULL || dex[0] == '#')
+            continue;
+        if (b->job_count == cap) {
+            cap = cap ? cap * 2 : 64;
+            b->jobs = (batch_job *)realloc(b->jobs, sizeof(batch_job) * cap);
+        }
+        job = &b->jobs[b->job_count++];
+        memset(job, 0, sizeof(batch_job));
+        job->dex_file = strdup(dex);
+        job->entry = batch_field(&save);
+        if (job->entry == NULL)
+            job->entry = strdup("main");
+        job->input = batch_field(&save);
+        job->output = batch_field(&save);
+    }
+    fclose(f);
+    return 0;
+}
+
+/* open every distinct dex file once */
+static int batch_open_dex(batch_runner *b)
+{
+    int i, j;
+
+    b->dex = (sdvm_dex **)calloc(b->job_count, sizeof(sdvm_dex *));
+    for (i = 0; i < b->job_count; i++) {
+        batch_job *job = &b->jobs[i];
+        for (j = 0; j < i; j++)
+            if (strcmp(b->jobs[j].dex_file, job->dex_file) == 0)
+                break;
+        if (j < i) {
+            job->dex = b->jobs[j].dex;
+            continue;
+        }
+        job->dex = b->dex_count;
+        b->dex[b->dex_count] = sdvm_dex_open(job->dex_file);
+        if (b->dex[b->dex_count] == NULL)
+            return -1;
+        b->dex_count++;
+    }
+    return 0;
+}
+
+static double batch_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*  Run the jobs of 'manifest' on 'workers' threads (<= 0 : one per CPU),
+ *  return the number of jobs that failed, or -1.
+ */
+int batch_run(const char *manifest, int workers)
+{
+    batch_runner b;
+    batch_worker w[BATCH_MAX_WORKERS];
+    pthread_t tid[BATCH_MAX_WORKERS];
+    int i, failed = 0;
+    double start;
+
+    memset(&b, 0, sizeof(b));
+    b.insn_limit = sdvm_context_current()->insn_limit;
+    b.time_limit_ns = sdvm_context_current()->time_limit_ns;
+    if (batch_parse(&b, manifest) != 0 || batch_open_dex(&b) != 0)
+        return -1;
+
+    if (workers <= 0)
+        workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (workers > BATCH_MAX_WORKERS)
+        workers = BATCH_MAX_WORKERS;
+    if (workers > b.job_count)
+        workers = b.job_count;
+    if (workers < 1)
+        workers = 1;
+    b.workers = workers;
+    pthread_mutex_init(&b.out_lock, NULL);
+    for (i = 0; i < workers; i++) {
+        pthread_mutex_init(&b.deque[i].lock, NULL);
+        b.deque[i].jobs = (int *)malloc(sizeof(int) * (b.job_count / workers + 1));
+    }
+    /* deal in reverse, so each worker starts with the manifest order */
+    for (i = b.job_count - 1; i >= 0; i--) {
+        batch_deque *d = &b.deque[i % workers];
+        d->jobs[d->tail++] = i;
+    }
+
+    start = batch_now();
+    for (i = 0; i < workers; i++) {
+        w[i].b = &b;
+        w[i].id = i;
+        w[i].done = 0;
+        w[i].stolen = 0;
+    }
+    for (i = 1; i < workers; i++)
+        if (pthread_create(&tid[i], NULL, batch_worker_main, &w[i]) != 0)
+            tid[i] = 0;
+    batch_worker_main(&w[0]);
+    for (i = 1; i < workers; i++)
+        if (tid[i])
+            pthread_join(tid[i], NULL);
+    output_flush();
+
+    for (i = 0; i < b.job_count; i++) {
+        if (b.jobs[i].status != SDVM_OK) {
+            failed++;
+            fprintf(stderr, "batch : job %d (%s %s) failed : %s\n", i,
+                    b.jobs[i].dex_file, b.jobs[i].entry,
+                    b.jobs[i].status == 1 ? "input / output" :
+                    sdvm_strerror(b.jobs[i].status));
+        }
+    }
+    if (is_verbose()) {
+        for (i = 0; i < workers; i++)
+            fprintf(stderr, "batch : worker %d ran %d jobs, %d stolen\n",
+                    i, w[i].done, w[i].stolen);
+        fprintf(stderr, "batch : %d jobs, %d dex, %d workers, %d failed, %.3f s\n",
+                b.job_count, b.dex_count, workers, failed, batch_now() - start);
+    }
+
+    for (i = 0; i < b.dex_count; i++)
+        sdvm_dex_close(b.dex[i]);
+    for (i = 0; i < workers; i++)
+        free(b.deque[i].jobs);
+    for (i = 0; i < b.job_count; i++) {
+        free(b.jobs[i].dex_file);
+        free(b.jobs[i].entry);
+        free(b.jobs[i].input);
+        free(b.jobs[i].output);
+    }
+    free(b.jobs);
+    free(b.dex);
+    return failed;
+}
@@ -0,0 +1,587 @@
+/*
+ * Simple Dalvik Virtual Machine Implementation
+ *
+ * Copyright (C) 2014 cycheng <createinfinite@yahoo.com.tw>
+ * Copyright (C) 2013 Chun-Yu Wang <wicanr2@gmail.com>
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "simple_dvm.h"
+
+/*  Boot image : the heap after class initialization
+ *
+ *  With --boot-image=FILE, a run that finds no usable FILE initializes the
+ *  main class as usual, then writes a snapshot of the heap, the static
+ *  fields and the class states to FILE. Later runs of the same dex (same
+ *  checksum and signature, anything else rewrites the image) map the
+ *  snapshot and start main right away, since its classes are already
+ *  initialized.
+ *
+ *  The image is relocatable : every heap object is walked, and each
+ *  pointer it holds (clazz, String / StringBuilder value, multi dim array
+ *  slots, object instance fields) is stored as an offset, with a
+ *  relocation entry saying what it is relative to :
+ *    BOOT_RELOC_HEAP  : the snapshot heap itself
+ *    BOOT_RELOC_CLASS : an index in dex->class_data_item
+ *    BOOT_RELOC_DEX   : an offset in the mapped dex (const strings)
+ *  Buffers outside the heap (StringBuilder storage) are copied into the
+ *  snapshot heap. On load the heap is mapped MAP_PRIVATE below 4GB and the
+ *  relocations applied in place.
+ *
+ *  <clinit> that printed or read stdin can't be replayed from a snapshot,
+ *  so no image is written for those programs.
+ *
+ *    boot_header
+ *    boot_class[classDefsSize]
+ *    boot_root[]    : static fields, undefined class statics, interned strings
+ *    boot_reloc[]
+ *    heap           : page aligned, so it can be mapped directly
+ */
+#define BOOT_MAGIC      "sdvmboot"
+#define BOOT_VERSION    1
+#define BOOT_PAGE       4096
+#define BOOT_LAYOUT     (sizeof(sdvm_obj) | sizeof(string_object) << 8 | \
+                         sizeof(string_builder_object) << 16 | sizeof(void *) << 24)
+
+#define BOOT_RELOC_HEAP     0
+#define BOOT_RELOC_CLASS    1
+#define BOOT_RELOC_DEX      2
+
+typedef struct _boot_header {
+    u1 magic[8];
+    u4 version;
+    u4 layout;
+    u1 checksum[4];     /* of the dex */
+    u1 signature[20];   /* of the dex */
+    u4 file_size;       /* of the dex */
+    u4 class_count;
+    u4 root_count;
+    u4 reloc_count;
+    u4 heap_off;        /* file offset */
+    u4 heap_size;
+} boot_header;
+
+typedef struct _boot_class {
+    u4 state;
+    u4 sdata_count;     /* its static fields, in boot_root */
+} boot_class;
+
+typedef struct _boot_root {
+    u4 obj;             /* heap offset + 1, 0 : NULL */
+    u4 type;            /* static_data_value_type */
+} boot_root;
+
+typedef struct _boot_reloc {
+    u4 offset;          /* of a pointer in the heap */
+    u4 kind;            /* BOOT_RELOC_xxx, the pointer holds the offset / index */
+} boot_reloc;
+
+/* a buffer outside the heap, copied into the snapshot */
+typedef struct _boot_foreign {
+    const u1 *addr;
+    size_t size;
+    u4 off;
+} boot_foreign;
+
+typedef struct _boot_writer {
+    DexFileFormat *dex;
+    sdvm_heap_chunk **chunks;
+    u4 *chunk_off;
+    int chunk_count;
+    boot_foreign *foreign;
+    int foreign_count;
+    int foreign_cap;
+    boot_reloc *relocs;
+    u4 reloc_count;
+    u4 reloc_cap;
+    u1 *heap;
+    u4 heap_size;
+    int failed;
+} boot_writer;
+
+/*  The file name and state are per context. Load and save are attempted
+ *  once per context, e.g. not again in a zygote job.
+ */
+void boot_image_init(const char *file)
+{
+    sdvm_context_current()->boot_file = file;
+}
+
+static size_t align_boot(size_t size, size_t align)
+{
+    return (size + align - 1) & ~(align - 1);
+}
+
+/* where 'p' lands in the snapshot heap, FALSE if it isn't in the sdvm heap */
+static int boot_heap_offset(boot_writer *w, const u1 *p, u4 *off)
+{
+    int i;
+
+    for (i = 0; i < w->chunk_count; i++) {
+        const sdvm_heap_chunk *c = w->chunks[i];
+        if (p >= c->base && p <= c->base + c->used) {
+            *off = w->chunk_off[i] + (p - c->base);
+            return TRUE;
+        }
+    }
+    for (i = 0; i < w->foreign_count; i++) {
+        const boot_foreign *f = &w->foreign[i];
+        if (p >= f->addr && p <= f->addr + f->size) {
+            *off = f->off + (p - f->addr);
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+static int boot_in_heap(boot_writer *w, const u1 *p)
+{
+    int i;
+
+    for (i = 0; i < w->chunk_count; i++)
+        if (p >= w->chunks[i]->base && p <= w->chunks[i]->base + w->chunks[i]->used)
+            return TRUE;
+    return FALSE;
+}
+
+static int boot_in_dex(boot_writer *w, const u1 *p)
+{
+    return p >= w->dex->map_base && p <= w->dex->map_base + w->dex->map_size;
+}
+
+/* remember a buffer outside the heap, it is copied in the second pass */
+static void boot_add_foreign(boot_writer *w, const void *addr, size_t size)
+{
+    int i;
+
+    if (addr == NULL || boot_in_heap(w, addr) || boot_in_dex(w, addr))
+        return;
+    for (i = 0; i < w->foreign_count; i++) {
+        if (w->foreign[i].addr == addr) {
+            if (w->foreign[i].size < size)
+                w->foreign[i].size = size;
+            return;
+        }
+    }
+    if (w->foreign_count == w->foreign_cap) {
+        w->foreign_cap = w->foreign_cap ? w->foreign_cap * 2 : 16;
+        w->foreign = realloc(w->foreign, sizeof(boot_foreign) * w->foreign_cap);
+    }
+    w->foreign[w->foreign_count].addr = addr;
+    w->foreign[w->foreign_count].size = size;
+    w->foreign_count++;
+}
+
+static void boot_add_reloc(boot_writer *w, u4 offset, u4 kind)
+{
+    if (w->reloc_count == w->reloc_cap) {
+        w->reloc_cap = w->reloc_cap ? w->reloc_cap * 2 : 256;
+        w->relocs = realloc(w->relocs, sizeof(boot_reloc) * w->reloc_cap);
+    }
+    w->relocs[w->reloc_count].offset = offset;
+    w->relocs[w->reloc_count].kind = kind;
+    w->reloc_count++;
+}
+
+/*  Rewrite the pointer at 'field' of the object at snapshot offset 'base'
+ *  (an object of 'size' bytes) as an offset or index, and record it.
+ */
+static void boot_pointer(boot_writer *w, u4 base, size_t size, size_t field)
+{
+    const u1 *dex_base = w->dex->map_base;
+    const class_data_item *classes = w->dex->class_data_item;
+    u1 *slot = w->heap + base + field;
+    u1 *p;
+    u8 value;
+    u4 off;
+
+    if (field + sizeof(void *) > size)
+        return;     /* not really this kind of object */
+    memcpy(&p, slot, sizeof(void *));
+    if (p == NULL)
+        return;
+
+    if (boot_heap_offset(w, p, &off)) {
+        value = off;
+        boot_add_reloc(w, base + field, BOOT_RELOC_HEAP);
+    } else if (boot_in_dex(w, p)) {
+        value = p - dex_base;
+        boot_add_reloc(w, base + field, BOOT_RELOC_DEX);
+    } else if (classes && (class_data_item *)p >= classes &&
+               (class_data_item *)p < classes + w->dex->header.classDefsSize &&
+               ((u1 *)p - (u1 *)classes) % sizeof(class_data_item) == 0) {
+        value = (class_data_item *)p - classes;
+        boot_add_reloc(w, base + field, BOOT_RELOC_CLASS);
+    } else {
+        if (is_verbose())
+            printf("boot image : cannot relocate %p (heap offset 0x%x)\n",
+                   p, base + (u4)field);
+        w->failed = TRUE;
+        return;
+    }
+    memcpy(slot, &value, sizeof(value));
+}
+
+/* first pass : find the buffers outside the heap */
+static void boot_scan_object(void *arg, sdvm_heap_chunk *chunk, u1 *obj, size_t size)
+{
+    boot_writer *w = (boot_writer *)arg;
+    const sdvm_obj *o = (const sdvm_obj *)obj;
+
+    if ((uintptr_t)o->other_data == ICT_STRING_OBJ && size >= sizeof(string_object)) {
+        const string_object *s = (const string_object *)obj;
+        boot_add_foreign(w, s->value, (size_t)s->count << s->coder);
+    } else if ((uintptr_t)o->other_data == ICT_STRING_BUILDER_OBJ &&
+               size >= sizeof(string_builder_object)) {
+        const string_builder_object *sb = (const string_builder_object *)obj;
+        boot_add_foreign(w, sb->value, (size_t)sb->capacity << sb->coder);
+    }
+}
+
+/* second pass : rewrite every pointer of the copied object */
+static void boot_copy_object(void *arg, sdvm_heap_chunk *chunk, u1 *obj, size_t size)
+{
+    boot_writer *w = (boot_writer *)arg;
+    const sdvm_obj *o = (const sdvm_obj *)obj;
+    u4 base;
+    uint i;
+
+    boot_heap_offset(w, obj, &base);
+    boot_pointer(w, base, size, offsetof(sdvm_obj, clazz));
+
+    switch ((uintptr_t)o->other_data) {
+    case ICT_STRING_OBJ:
+        boot_pointer(w, base, size, offsetof(string_object, value));
+        break;
+    case ICT_STRING_BUILDER_OBJ:
+        boot_pointer(w, base, size, offsetof(string_builder_object, value));
+        /* the buffer now lives in the snapshot, it must not be freed */
+        if (size >= sizeof(string_builder_object))
+            ((string_builder_object *)(w->heap + base))->shared = 1;
+        break;
+    case ICT_MULTI_DIM_ARRAY_OBJ:
+        if (size < sizeof(multi_dim_array_object))
+            break;
+        for (i = 0; i < ((multi_dim_array_object *)obj)->count; i++)
+            boot_pointer(w, base, size,
+                         offsetof(multi_dim_array_object, array) + i * sizeof(void *));
+        break;
+    case 0: {
+        /* an instance, its object fields along the class chain */
+        const class_data_item *clazz;
+        for (clazz = o->clazz; clazz; clazz = clazz->super_class) {
+            for (i = 0; i < clazz->instance_fields_size; i++) {
+                const encoded_field *f = &clazz->instance_fields[i];
+                if (get_field_type(w->dex, f->field_id) == VALUE_SDVM_OBJ)
+                    boot_pointer(w, base, size, f->offset);
+            }
+        }
+        break;
+    }
+    default:
+        break;  /* arrays of primitives, undefined class statics */
+    }
+}
+
+static void boot_add_root(boot_writer *w, boot_root *root, const sdvm_obj *obj, u4 type)
+{
+    u4 off;
+
+    root->type = type;
+    root->obj = 0;
+    if (obj == NULL)
+        return;
+    if (!boot_heap_offset(w, (const u1 *)obj, &off)) {
+        w->failed = TRUE;
+        return;
+    }
+    root->obj = off + 1;
+}
+
+static int boot_write_file(const char *path, boot_header *h, const void *tables,
+                           size_t tables_size, const u1 *heap)
+{
+    char tmp[1040];
+    const u1 *zero;
+    int fd, ok;
+
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return -1;
+    zero = calloc(1, h->heap_off);
+    ok = zero != NULL &&
+         write(fd, h, sizeof(boot_header)) == sizeof(boot_header) &&
+         write(fd, tables, tables_size) == tables_size &&
+         write(fd, zero, h->heap_off - sizeof(boot_header) - tables_size) ==
+             h->heap_off - sizeof(boot_header) - tables_size &&
+         write(fd, heap, h->heap_size) == h->heap_size;
+    free((void *)zero);
+    /* write aside and rename, so a concurrent run never maps half an image */
+    if (close(fd) != 0 || !ok || rename(tmp, path) != 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/* snapshot the heap and statics, return 0 on success */
+int boot_image_save(DexFileFormat *dex)
+{
+    sdvm_context *ctx = sdvm_context_current();
+    const u4 class_count = dex->header.classDefsSize;
+    const u4 undef_count = dex->undef_sdata ?
+                           dex->header.fieldIdsSize - dex->undef_id_start : 0;
+    boot_writer w;
+    boot_header h;
+    boot_class *classes;
+    boot_root *roots;
+    sdvm_heap_chunk *c;
+    size_t tables_size;
+    u4 root_count, r, i, j, pos;
+    int ret = -1;
+
+    if (ctx->boot_file == NULL || ctx->boot_loaded || ctx->boot_save_tried)
+        return -1;
+    ctx->boot_save_tried = 1;
+    if (output_written() > 0 || input_started()) {
+        printf("Warning! class initialization did I/O, not writing boot image %s\n",
+               ctx->boot_file);
+        return -1;
+    }
+
+    memset(&w, 0, sizeof(w));
+    w.dex = dex;
+    for (c = sdvm_heap_chunks(); c; c = c->next)
+        w.chunk_count++;
+    w.chunks = malloc(sizeof(sdvm_heap_chunk *) * (w.chunk_count + 1));
+    w.chunk_off = malloc(sizeof(u4) * (w.chunk_count + 1));
+    pos = 0;
+    for (i = 0, c = sdvm_heap_chunks(); c; c = c->next, i++) {
+        w.chunks[i] = c;
+        w.chunk_off[i] = pos;
+        pos = align_boot(pos + c->used, 8);
+    }
+    sdvm_heap_walk(boot_scan_object, &w);
+    for (i = 0; i < w.foreign_count; i++) {
+        w.foreign[i].off = pos;
+        pos = align_boot(pos + w.foreign[i].size, 8);
+    }
+    w.heap_size = pos;
+
+    /* copy the heap as is, then fix the pointers of the copy */
+    w.heap = calloc(1, w.heap_size + 1);
+    for (i = 0; i < w.chunk_count; i++)
+        memcpy(w.heap + w.chunk_off[i], w.chunks[i]->base, w.chunks[i]->used);
+    for (i = 0; i < w.foreign_count; i++)
+        memcpy(w.heap + w.foreign[i].off, w.foreign[i].addr, w.foreign[i].size);
+    sdvm_heap_walk(boot_copy_object, &w);
+
+    /* class states and roots */
+    root_count = undef_count + dex->header.stringIdsSize;
+    for (i = 0; i < class_count; i++)
+        if (dex->class_data_item[i].state >= CLASS_LOADED)
+            root_count += dex->class_data_item[i].static_fields_size;
+    tables_size = sizeof(boot_class) * class_count + sizeof(boot_root) * root_count +
+                  sizeof(boot_reloc) * w.reloc_count;
+    classes = calloc(1, tables_size + 1);
+    roots = (boot_root *)(classes + class_count);
+    r = 0;
+    for (i = 0; i < class_count; i++) {
+        const class_data_item *clazz = &dex->class_data_item[i];
+        if (clazz->state == CLASS_INITIALIZING)
+            w.failed = TRUE;
+        if (clazz->state < CLASS_LOADED)
+            continue;
+        classes[i].state = clazz->state;
+        classes[i].sdata_count = clazz->static_fields_size;
+        for (j = 0; j < clazz->static_fields_size; j++, r++)
+            boot_add_root(&w, &roots[r], clazz->sdata[j].obj, clazz->sdata[j].type);
+    }
+    for (i = 0; i < undef_count; i++, r++)
+        boot_add_root(&w, &roots[r], dex->undef_sdata[i].obj, dex->undef_sdata[i].type);
+    for (i = 0; i < dex->header.stringIdsSize; i++, r++)
+        boot_add_root(&w, &roots[r], (sdvm_obj *)dex->string_obj[i], VALUE_STRING);
+    memcpy(roots + root_count, w.relocs, sizeof(boot_reloc) * w.reloc_count);
+
+    if (w.failed) {
+        printf("Warning! cannot snapshot the heap, not writing boot image %s\n",
+               ctx->boot_file);
+    } else {
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, BOOT_MAGIC, sizeof(h.magic));
+        h.version = BOOT_VERSION;
+        h.layout = BOOT_LAYOUT;
+        memcpy(h.checksum, dex->header.checksum, sizeof(h.checksum));
+        memcpy(h.signature, dex->header.signature, sizeof(h.signature));
+        h.file_size = dex->header.fileSize;
+        h.class_count = class_count;
+        h.root_count = root_count;
+        h.reloc_count = w.reloc_count;
+        h.heap_off = align_boot(sizeof(h) + tables_size, BOOT_PAGE);
+        h.heap_size = w.heap_size;
+        ret = boot_write_file(ctx->boot_file, &h, classes, tables_size, w.heap);
+        if (ret != 0)
+            printf("Warning! cannot write boot image %s\n", ctx->boot_file);
+        else if (is_verbose())
+            printf("boot image : wrote %s (heap %u bytes, %u relocations)\n",
+                   ctx->boot_file, h.heap_size, h.reloc_count);
+    }
+
+    free(classes);
+    free(w.heap);
+    free(w.relocs);
+    free(w.foreign);
+    free(w.chunks);
+    free(w.chunk_off);
+    return ret;
+}
+
+static int boot_check(DexFileFormat *dex, const boot_header *h, size_t size)
+{
+    const u4 undef_count = dex->undef_sdata ?
+                           dex->header.fieldIdsSize - dex->undef_id_start : 0;
+    const u8 tables = sizeof(boot_class) * (u8)h->class_count +
+                      sizeof(boot_root) * (u8)h->root_count +
+                      sizeof(boot_reloc) * (u8)h->reloc_count;
+
+    if (memcmp(h->magic, BOOT_MAGIC, sizeof(h->magic)) != 0 ||
+        h->version != BOOT_VERSION || h->layout != BOOT_LAYOUT)
+        return FALSE;
+    /* the key : a boot image belongs to exactly one dex */
+    if (memcmp(h->checksum, dex->header.checksum, sizeof(h->checksum)) != 0 ||
+        memcmp(h->signature, dex->header.signature, sizeof(h->signature)) != 0 ||
+        h->file_size != dex->header.fileSize ||
+        h->class_count != dex->header.classDefsSize ||
+        h->root_count < undef_count + dex->header.stringIdsSize)
+        return FALSE;
+    return sizeof(boot_header) + tables <= h->heap_off &&
+           h->heap_off % BOOT_PAGE == 0 &&
+           (u8)h->heap_off + h->heap_size == size;
+}
+
+/* map the snapshot in place of class initialization, return 0 on success */
+int boot_image_load(DexFileFormat *dex)
+{
+    sdvm_context *ctx = sdvm_context_current();
+    const u4 undef_count = dex->undef_sdata ?
+                           dex->header.fieldIdsSize - dex->undef_id_start : 0;
+    struct stat st;
+    boot_header *h;
+    boot_class *classes;
+    boot_root *roots;
+    boot_reloc *relocs;
+    u1 *file, *heap = MAP_FAILED;
+    u4 i, j, r;
+    int fd;
+
+    if (ctx->boot_file == NULL || ctx->boot_load_tried)
+        return -1;
+    ctx->boot_load_tried = 1;
+    fd = open(ctx->boot_file, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &st) < 0 || st.st_size < sizeof(boot_header) ||
+        (file = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    h = (boot_header *)file;
+    if (!boot_check(dex, h, st.st_size)) {
+        if (is_verbose())
+            printf("boot image : %s is stale, rebuilding it\n", ctx->boot_file);
+        goto fail;
+    }
+#ifdef MAP_32BIT
+    if (h->heap_size > 0)
+        heap = mmap(NULL, h->heap_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_32BIT, fd, h->heap_off);
+#endif
+    if (heap == MAP_FAILED || ((u8)heap >> 32) != 0)
+        goto fail;
+
+    classes = (boot_class *)(file + sizeof(boot_header));
+    roots = (boot_root *)(classes + h->class_count);
+    relocs = (boot_reloc *)(roots + h->root_count);
+
+    /* check everything first, so a bad image leaves nothing half restored */
+    for (i = 0; i < h->reloc_count; i++) {
+        u8 value;
+        if ((u8)relocs[i].offset + sizeof(void *) > h->heap_size)
+            goto fail;
+        memcpy(&value, heap + relocs[i].offset, sizeof(value));
+        if ((relocs[i].kind == BOOT_RELOC_HEAP && value > h->heap_size) ||
+            (relocs[i].kind == BOOT_RELOC_CLASS && value >= h->class_count) ||
+            (relocs[i].kind == BOOT_RELOC_DEX && value > dex->map_size) ||
+            relocs[i].kind > BOOT_RELOC_DEX)
+            goto fail;
+    }
+    for (i = 0, r = 0; i < h->class_count; i++) {
+        if (classes[i].state == CLASS_UNLOADED)
+            continue;
+        if (classes[i].state < CLASS_LOADED || classes[i].state > CLASS_INITIALIZED ||
+            link_class(dex, i)->static_fields_size != classes[i].sdata_count)
+            goto fail;
+        r += classes[i].sdata_count;
+    }
+    if (r + undef_count + dex->header.stringIdsSize != h->root_count)
+        goto fail;
+    for (i = 0; i < h->root_count; i++)
+        if (roots[i].obj > h->heap_size)
+            goto fail;
+
+    for (i = 0; i < h->reloc_count; i++) {
+        u1 *slot = heap + relocs[i].offset;
+        u8 value;
+        void *p;
+        memcpy(&value, slot, sizeof(value));
+        if (relocs[i].kind == BOOT_RELOC_HEAP)
+            p = heap + value;
+        else if (relocs[i].kind == BOOT_RELOC_CLASS)
+            p = &dex->class_data_item[value];
+        else
+            p = dex->map_base + value;
+        memcpy(slot, &p, sizeof(p));
+    }
+
+#define BOOT_OBJ(root) ((root)->obj ? (sdvm_obj *)(heap + (root)->obj - 1) : NULL)
+    for (i = 0, r = 0; i < h->class_count; i++) {
+        class_data_item *clazz = &dex->class_data_item[i];
+        if (classes[i].state == CLASS_UNLOADED)
+            continue;
+        clazz->sdata = NULL;
+        if (classes[i].sdata_count > 0)
+            clazz->sdata = malloc(sizeof(static_field_data) * classes[i].sdata_count);
+        for (j = 0; j < classes[i].sdata_count; j++, r++) {
+            clazz->sdata[j].obj = BOOT_OBJ(&roots[r]);
+            clazz->sdata[j].type = roots[r].type;
+        }
+        clazz->state = classes[i].state;
+    }
+    for (i = 0; i < undef_count; i++, r++)
+        dex->undef_sdata[i].obj = BOOT_OBJ(&roots[r]);
+    for (i = 0; i < dex->header.stringIdsSize; i++, r++)
+        dex->string_obj[i] = (string_object *)BOOT_OBJ(&roots[r]);
+#undef BOOT_OBJ
+
+    if (is_verbose())
+        printf("boot image : loaded %s (heap %u bytes at %p)\n",
+               ctx->boot_file, h->heap_size, heap);
+    munmap(file, st.st_size);
+    close(fd);
+    ctx->boot_loaded = 1;
+    return 0;
+
+fail:
+    if (heap != MAP_FAILED)
+        munmap(heap, h->heap_size);
+    munmap(file, st.st_size);
+    close(fd);
+    return -1;
+}
@@ -0,0 +1,109 @@
+/*
+ * Simple Dalvik Virtual Machine Implementation
+ *
+ * Copyright (C) 2014 cycheng <createinfinite@yahoo.com.tw>
+ * Copyright (C) 2013 Chun-Yu Wang <wicanr2@gmail.com>
+ */
+
+#define _GNU_SOURCE
+#include <time.h>
+#include "simple_dvm.h"
+
+/*  Execution budget
+ *
+ *  runMethod takes one unit out of vm->budget per instruction it
+ *  dispatches, given in slices of BUDGET_SLICE. That decrement is also how
+ *  instructions are counted : what a slice used goes to ctx->insn_used
+ *  and ctx->stats.insns when the slice runs out, or when budget_sync is
+ *  called (the end of a run, before reading the counters), so dispatch
+ *  costs one decrement and one test.
+ *
+ *  When a slice runs out, budget_expired checks the context's instruction
+ *  and time limits and calls its preempt_fn, if any (e.g. to yield or to
+ *  enforce a policy of its own). Over the limit, or if preempt_fn says so,
+ *  the run is aborted : a report with the guest stack goes to stderr, and
+ *  we longjmp to ctx->abort_jmp, or exit with BUDGET_ABORTED without one.
+ */
+#define BUDGET_SLICE 10000
+
+static u8 budget_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u8)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* a new run in 'ctx' starts with nothing used */
+void budget_start(sdvm_context *ctx)
+{
+    ctx->insn_used = 0;
+    ctx->start_ns = budget_now_ns();
+}
+
+/* the guest stack, innermost first */
+void print_frames(FILE *f, DexFileFormat *dex, simple_dalvik_vm *vm)
+{
+    int i = vm->depth < VM_MAX_FRAMES ? vm->depth : VM_MAX_FRAMES;
+
+    if (vm->depth > VM_MAX_FRAMES)
+        fprintf(f, "    ... %d frames not kept\n", vm->depth - VM_MAX_FRAMES);
+    while (--i >= 0) {
+        const vm_frame *frame = &vm->frames[i];
+        const method_id_item *id = get_method_item(dex, frame->method->method_id);
+        const uint pc = i == vm->depth - 1 ? vm->pc : frame->pc;
+
+        fprintf(f, "    at %s.%s (pc 0x%04x)\n",
+                get_type_item_name(dex, id->class_idx),
+                get_string_data(dex, id->name_idx), pc / 2);
+    }
+}
+
+static void budget_abort(DexFileFormat *dex, simple_dalvik_vm *vm, const char *why)
+{
+    sdvm_context *ctx = sdvm_context_current();
+
+    output_flush();
+    fprintf(stderr, "Error! %s : %llu instructions, %.3f s\n", why,
+            (unsigned long long)ctx->insn_used,
+            (budget_now_ns() - ctx->start_ns) / 1e9);
+    print_frames(stderr, dex, vm);
+    vm->depth = 0;
+    if (ctx->abort_jmp)
+        longjmp(*ctx->abort_jmp, 1);
+    exit(BUDGET_ABORTED);
+}
+
+/* what the slice of 'vm' used so far goes to the counters of 'ctx' */
+void budget_sync(sdvm_context *ctx, simple_dalvik_vm *vm)
+{
+    u8 used;
+
+    if (vm == NULL || vm->budget >= vm->slice)
+        return;
+    used = vm->slice - vm->budget;
+    ctx->insn_used += used;
+    ctx->stats.insns += used;
+    vm->slice = vm->budget;
+}
+
+/* the slice is used up : account for it, check the limits, start the next */
+void budget_expired(DexFileFormat *dex, simple_dalvik_vm *vm)
+{
+    sdvm_context *ctx = sdvm_context_current();
+    s8 slice = BUDGET_SLICE;
+
+    if (ctx->start_ns == 0)
+        budget_start(ctx);
+    budget_sync(ctx, vm);
+    if (ctx->insn_limit) {
+        if (ctx->insn_used >= ctx->insn_limit)
+            budget_abort(dex, vm, "instruction budget exhausted");
+        if (ctx->insn_limit - ctx->insn_used < slice)
+            slice = ctx->insn_limit - ctx->insn_used;
+    }
+    if (ctx->time_limit_ns && budget_now_ns() - ctx->start_ns >= ctx->time_limit_ns)
+        budget_abort(dex, vm, "time budget exhausted");
+    if (ctx->preempt_fn && ctx->preempt_fn(ctx->preempt_arg, ctx->insn_used))
+        budget_abort(dex, vm, "run preempted");
+    vm->budget = vm->slice = slice;
+}
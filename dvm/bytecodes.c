@@ -16,9 +16,9 @@ static int find_const_string(DexFileFormat *dex, char *entry)
 {
     int i = 0;
     for (i = 0; i < dex->header.stringIdsSize; i++) {
-        if (memcmp(dex->string_data_item[i].data, entry, strlen(entry)) == 0) {
+        if (strncmp(get_string_data(dex, i), entry, strlen(entry)) == 0) {
             if (is_verbose())
-                printf("find %s in dex->string_data_item[%d]\n", entry, i);
+                printf("find %s in string_id %d\n", entry, i);
             return i;
         }
     }
@@ -545,18 +545,23 @@ static int op_const_wide_high16(DexFileFormat *dex, simple_dalvik_vm *vm, u1 *pt
  * Puts reference to a string constant identified by string_id into vx.
  * 1A08 0000 - const-string v8, "" // string@0000
  * Puts reference to string@0000 (entry #0 in the string table) into v8.
+ *
+ * The String object is created on first use and interned, so the same
+ * string_id always gives the same reference.
  */
 static int op_const_string(DexFileFormat *dex, simple_dalvik_vm *vm, u1 *ptr, int *pc)
 {
     int reg_idx_vx = 0;
     int string_id = 0;
+    string_object *str = NULL;
     reg_idx_vx = ptr[*pc + 1];
     string_id = ((ptr[*pc + 3] << 8) | ptr[*pc + 2]);
+    str = get_const_string_object(dex, string_id);
 
     if (is_verbose())
-        printf("const-string v%d, string_id 0x%04x\n",
-               reg_idx_vx , string_id);
-    store_to_reg(vm, reg_idx_vx, (unsigned char *) &string_id);
+        printf("const-string v%d, string_id 0x%04x (obj %p)\n",
+               reg_idx_vx , string_id, str);
+    store_to_reg(vm, reg_idx_vx, (unsigned char *) &str);
     *pc = *pc + 4;
     return 0;
 }
@@ -606,20 +611,22 @@ static int op_new_instance(DexFileFormat *dex, simple_dalvik_vm *vm, u1 *ptr, in
 
     type_item = get_type_item(dex, type_id);
     clazz = get_class_data_by_typeid(dex, type_id);
+    init_class(dex, vm, clazz);
     //assert(clazz);
     sdvm_obj *obj;
+    internal_class_type ict = 0;
     if (clazz) {
         class_inst_size = clazz->class_inst_size;
     } else {
         /* currently, we don't support java framework class, just allocate an
-           sdvm_obj */
-        class_inst_size = sizeof(sdvm_obj);
+           sdvm_obj, or the internal layout if java_lib implements one */
+        class_inst_size = get_java_lang_class_inst_size(
+                              get_type_item_name(dex, type_id), &ict);
     }
-    obj = (sdvm_obj *)malloc(class_inst_size);
-    memset(obj, 0, class_inst_size);
+    obj = (sdvm_obj *)sdvm_heap_alloc(class_inst_size, get_type_item_name(dex, type_id));
 
     obj->ref_count = 1;
-    obj->other_data = NULL;
+    obj->other_data = (void *)(u8)ict;
     obj->clazz = clazz;
 
     if (is_verbose()) {
@@ -682,8 +689,7 @@ static int op_new_array(DexFileFormat *dex, simple_dalvik_vm *vm, u1 *ptr, int *
 
     /* we may allocate additional 4 bytes, but its fine */
     const uint total_size = sizeof(new_array_object) + elem_size * num_elem;
-    array_obj = (new_array_object *)malloc(total_size);
-    memset(array_obj, 0, total_size);
+    array_obj = (new_array_object *)sdvm_heap_alloc(total_size, type_name);
 
     array_obj->obj.clazz = clazz;
     array_obj->obj.other_data = (void *)ICT_NEW_ARRAY_OBJ;
@@ -732,8 +738,7 @@ static int op_filled_new_array(DexFileFormat *dex, simple_dalvik_vm *vm, u1 *ptr
 
     op_utils_invoke_35c_parse(dex, ptr, pc, &vm->p);
 
-    new_filled_array *ary = (new_filled_array *)malloc(sizeof(new_filled_array));
-    memset(ary, 0, sizeof(new_filled_array));
+    new_filled_array *ary = (new_filled_array *)sdvm_heap_alloc(sizeof(new_filled_array), "[I");
 
     ary->count = vm->p.reg_count;
     ary->obj.clazz = NULL;  /* this is sdvm internal class */
@@ -1184,6 +1189,8 @@ static int op_utils_invoke(char *name, DexFileFormat *dex, simple_dalvik_vm *vm,
 
         if (m != 0 && type_class != 0 && p->reg_count <= 5) {
             class_data_item *clazz = get_class_data_by_typeid(dex, m->class_idx);
+            if (clazz && strcmp(name, "invoke-static") == 0)
+                init_class(dex, vm, clazz);
             if (proto_item != 0)
                 proto_type_list = get_proto_type_list(dex, m->proto_idx);
             if (proto_type_list != 0 && proto_type_list->size > 0) {
@@ -1556,6 +1563,7 @@ static int op_sget(DexFileFormat *dex, simple_dalvik_vm *vm, u1 *ptr, int *pc) {
     int vx = ptr[*pc + 1];
     u2 field_id = *(u2 *)&ptr[*pc + 2];
     int value = 0;
+    init_class_by_fieldid(dex, vm, field_id);
     static_field_data *field_data = get_static_field_data_by_fieldid(dex, field_id);
 
     assert(field_data && field_data->type == VALUE_INT);
@@ -1590,12 +1598,13 @@ static int op_sget_object(DexFileFormat *dex, simple_dalvik_vm *vm, u1 *ptr, int
         printf("sget-object v%d, field 0x%04x, %s (v%d = field_0x%x)\n",
                reg_idx_vx, field_id, get_field_name(dex, field_id), reg_idx_vx, field_id);
     }
+    init_class_by_fieldid(dex, vm, field_id);
     sdvm_obj *obj = get_static_obj_by_fieldid(dex, field_id);
 
     assert(((u8)obj >> 32) == 0);
     /*  we store object ptr to dalvik 32-bit register
-     *  Note! In 64-bit linux, this ptr is 64-bit, but if the ptr comes from
-     *  malloc, its high 32 bit = 0x0
+     *  Note! In 64-bit linux, this ptr is 64-bit, but objects come from
+     *  sdvm_heap_alloc, so its high 32 bit = 0x0
      */
     store_to_reg(vm, reg_idx_vx, (unsigned char *) &obj);
 
@@ -1616,6 +1625,7 @@ static int op_sget_char(DexFileFormat *dex, simple_dalvik_vm *vm, u1 *ptr, int *
     u2 field_id = *(u2 *)&ptr[*pc + 2];
     uint value = 0;
     //load_reg_to(vm, vx, (u1 *)&value);
+    init_class_by_fieldid(dex, vm, field_id);
     static_field_data *field_data = get_static_field_data_by_fieldid(dex, field_id);
 
     assert(field_data && field_data->type == VALUE_CHAR);
@@ -1643,6 +1653,7 @@ static int op_sget_char(DexFileFormat *dex, simple_dalvik_vm *vm, u1 *ptr, int *
 static int op_sput(DexFileFormat *dex, simple_dalvik_vm *vm, u1 *ptr, int *pc) {
     int vx = ptr[*pc + 1];
     u2 field_id = *(u2 *)&ptr[*pc + 2];
+    init_class_by_fieldid(dex, vm, field_id);
     static_field_data *field_data = get_static_field_data_by_fieldid(dex, field_id);
 
     uint value;
@@ -1681,6 +1692,7 @@ static int op_sput_object(DexFileFormat *dex, simple_dalvik_vm *vm, u1 *ptr, int
                reg_idx_vx, dst_field_id, get_field_name(dex, dst_field_id));
     }
 
+    init_class_by_fieldid(dex, vm, dst_field_id);
     static_field_data * dst_field_data = get_static_field_data_by_fieldid(dex, dst_field_id);
     sdvm_obj *dst_obj = dst_field_data->obj;
 
@@ -1729,6 +1741,7 @@ static int op_sput_boolean(DexFileFormat *dex, simple_dalvik_vm *vm, u1 *ptr, in
     u2 field_id = *(u2 *)&ptr[*pc + 2];
     uint bool_value = 0;
     load_reg_to(vm, vx, (u1 *)&bool_value);
+    init_class_by_fieldid(dex, vm, field_id);
     static_field_data *field_data = get_static_field_data_by_fieldid(dex, field_id);
 
     assert(field_data &&
@@ -1764,6 +1777,7 @@ static int op_sput_char(DexFileFormat *dex, simple_dalvik_vm *vm, u1 *ptr, int *
     uint char_value = 0;
     load_reg_to(vm, vx, (u1 *)&char_value);
 
+    init_class_by_fieldid(dex, vm, field_id);
     static_field_data *field_data = get_static_field_data_by_fieldid(dex, field_id);
 
     assert(field_data && field_data->type == VALUE_CHAR);
@@ -2282,6 +2296,15 @@ static size_t byteCode_size = sizeof(byteCodes) / sizeof(byteCode);
 
  */
 
+const char *opcode_name(u1 op)
+{
+    int i = 0;
+    for (i = 0; i < byteCode_size; i++)
+        if (op == byteCodes[i].opCode)
+            return byteCodes[i].name;
+    return NULL;
+}
+
 static opCodeFunc findOpCodeFunc(unsigned char op)
 {
     int i = 0;
@@ -2291,104 +2314,203 @@ static opCodeFunc findOpCodeFunc(unsigned char op)
     return 0;
 }
 
+static void unknown_opcode(simple_dalvik_vm *vm, u1 opCode)
+{
+    printRegs(vm);
+    printf("Unknow OpCode =%02x \n", opCode);
+}
+
+/* run the handler of 'opCode' at vm->pc, charged one budget unit */
+static inline void dispatch(DexFileFormat *dex, simple_dalvik_vm *vm, u1 *ptr,
+                            u1 opCode, opCodeFunc func)
+{
+#ifdef SDVM_OPSTATS
+    opcode_stats *st = vm->opstats;
+    u8 start, charged;
+#endif
+
+    if (--vm->budget < 0)
+        budget_expired(dex, vm);
+#ifdef SDVM_OPSTATS
+    opstats_enter(st, opCode);
+    charged = st->charged;
+    start = opstats_clock();
+    func(dex, vm, ptr, &vm->pc);
+    opstats_leave(st, opCode, opstats_clock() - start, charged);
+#else
+    func(dex, vm, ptr, &vm->pc);
+#endif
+}
+
+/* the loop of runMethod with --trace, kept apart so the other one has no test */
+static void run_traced(DexFileFormat *dex, simple_dalvik_vm *vm, encoded_method *m,
+                       trace_state *trace)
+{
+    u1 *ptr = (u1 *) m->code_item.insns;
+
+    while (vm->pc < m->code_item.insns_size * sizeof(ushort)) {
+        const u1 opCode = ptr[vm->pc];
+        const opCodeFunc func = findOpCodeFunc(opCode);
+
+        trace_insn(trace, dex, m, vm->pc, opCode);
+        if (func == 0) {
+            unknown_opcode(vm, opCode);
+            break;
+        }
+        dispatch(dex, vm, ptr, opCode, func);
+        if (trace->flags & TRACE_FLAG_REGS)
+            trace_regs(trace, vm);
+    }
+}
+
+/*  The methods being run are kept on a shadow stack (vm->frames), for
+ *  reports and profilers. Every instruction is charged one unit of the
+ *  execution budget, which also counts them for the statistics, see
+ *  budget.c. Whether the context is traced is checked once per call, a
+ *  traced run has a loop of its own.
+ */
 void runMethod(DexFileFormat *dex, simple_dalvik_vm *vm, encoded_method *m)
 {
     u1 *ptr = (u1 *) m->code_item.insns;
-    unsigned char opCode = 0;
-    opCodeFunc func = 0;
+    sdvm_context *ctx = sdvm_context_current();
+    trace_state *trace = ctx->trace;
+    const u8 began = timeline_on ? stats_now_ns() : 0;
 
+#ifdef SDVM_OPSTATS
+    opstats_get(vm);
+#endif
+    if (callgraph_on)
+        callgraph_enter(dex, vm, m);
+    if (vm->depth > 0 && vm->depth <= VM_MAX_FRAMES)
+        vm->frames[vm->depth - 1].pc = vm->pc;
+    if (vm->depth < VM_MAX_FRAMES)
+        vm->frames[vm->depth].method = m;
+    vm->depth++;
     vm->pc = 0;
-    while (1) {
-        if (vm->pc >= m->code_item.insns_size * sizeof(ushort))
-            break;
-        opCode = ptr[vm->pc];
-        func = findOpCodeFunc(opCode);
-        if (func != 0) {
-            func(dex, vm, ptr, &vm->pc);
-        } else {
-            printRegs(vm);
-            printf("Unknow OpCode =%02x \n", opCode);
-            break;
+    ctx->stats.invokes++;
+
+    if (trace) {
+        run_traced(dex, vm, m, trace);
+    } else {
+        while (vm->pc < m->code_item.insns_size * sizeof(ushort)) {
+            const u1 opCode = ptr[vm->pc];
+            const opCodeFunc func = findOpCodeFunc(opCode);
+
+            if (func == 0) {
+                unknown_opcode(vm, opCode);
+                break;
+            }
+            dispatch(dex, vm, ptr, opCode, func);
         }
     }
+    vm->depth--;
+    if (callgraph_on)
+        callgraph_leave();
+    if (began)
+        timeline_method(dex, m, began);
 }
 
-void simple_dvm_startup(DexFileFormat *dex, simple_dalvik_vm *vm, char *entry)
+/* find the direct method 'entry' and its class, NULL if there is none */
+static encoded_method *find_entry_method(DexFileFormat *dex, char *entry,
+                                         class_data_item **entry_clazz)
 {
-    int i = 0, j = 0;
+    int i = 0;
     int method_name_idx = -1;
     int method_idx = -1;
-    int class_idx = -1;
+    class_data_item *clazz = NULL;
     int direct_method_index = -1;
 
     method_name_idx = find_const_string(dex, entry);
 
     if (method_name_idx < 0) {
         printf("no method %s in dex\n", entry);
-        return;
+        return NULL;
     }
 
     for (i = 0 ; i < dex->header.methodIdsSize; i++)
         if (dex->method_id_item[i].name_idx == method_name_idx) {
-            int cls_id = dex->method_id_item[i].class_idx;
             method_idx = i;
+            clazz = get_class_data_by_typeid(dex, dex->method_id_item[i].class_idx);
 
-            for (j = 0; j < dex->header.classDefsSize; j++) {
-                if (dex->class_def_item[j].class_idx == cls_id) {
-                    class_idx = j;
-                    break;
-                }
-            }
-
-            if (is_verbose() > 2)
+            if (is_verbose() > 2 && clazz)
                 printf("find %s in class_defs[%d], method_id = %d\n",
-                       entry, class_idx, method_idx);
+                       entry, (int)(clazz - dex->class_data_item), method_idx);
             break;
         }
 
-    for (i = 0; i < dex->class_data_item[class_idx].direct_methods_size; ++i) {
-      if (dex->class_data_item[class_idx].direct_methods[i].method_id == method_idx) {
+    for (i = 0; clazz && i < clazz->direct_methods_size; ++i) {
+      if (clazz->direct_methods[i].method_id == method_idx) {
         if (is_verbose() > 2) {
-          printf("find method %d in class of class_id[%d]\n", i, class_idx);
+          printf("find method %d in class_defs[%d]\n", i,
+                 (int)(clazz - dex->class_data_item));
         }
         direct_method_index = i;
         break;
       }
     }
 
-    if (class_idx < 0 || method_idx < 0 || direct_method_index < 0) {
+    if (clazz == NULL || method_idx < 0 || direct_method_index < 0) {
         printf("no method %s in dex\n", entry);
-        return;
+        return NULL;
     }
 
-    encoded_method *m =
-        &dex->class_data_item[class_idx].direct_methods[direct_method_index];
+    *entry_clazz = clazz;
+    return &clazz->direct_methods[direct_method_index];
+}
+
+/*  Link every class and initialize the class of 'entry', without running
+ *  it, e.g. before the zygote forks jobs off.
+ */
+void simple_dvm_preload(DexFileFormat *dex, simple_dalvik_vm *vm, char *entry)
+{
+    class_data_item *clazz = NULL;
+    u8 t = stats_now_ns();
+
+    link_classes(dex);
+    stats_lap(STATS_LINK, t);
+    boot_image_load(dex);
+    if (find_entry_method(dex, entry, &clazz) == NULL)
+        return;
+    memset(vm , 0, sizeof(simple_dalvik_vm));
+    init_class(dex, vm, clazz);
+    budget_sync(sdvm_context_current(), vm);
+    boot_image_save(dex);
+}
+
+/*  run the direct method 'entry', return -1 if there is none ; a run over
+ *  budget exits, unless the caller set an abort_jmp */
+int simple_dvm_startup(DexFileFormat *dex, simple_dalvik_vm *vm, char *entry)
+{
+    class_data_item *clazz = NULL;
+    encoded_method *m;
+
+    /* with a boot image, the classes it saw come back initialized */
+    boot_image_load(dex);
+    m = find_entry_method(dex, entry, &clazz);
+    if (m == NULL)
+        return -1;
 
     if (is_verbose() > 2)
         printf("encoded_method method_id = %d, insns_size = %d\n",
                m->method_id, m->code_item.insns_size);
 
     memset(vm , 0, sizeof(simple_dalvik_vm));
-
-    /* exec static class initialization first */
-    {
-        int i, j;
-        for (i = 0; i < dex->header.classDefsSize; i++) {
-            for (j = 0; j < dex->class_data_item[i].direct_methods_size; j++) {
-                encoded_method *static_init = &dex->class_data_item[i].direct_methods[j];
-
-                if ((static_init->access_flags & ACC_STATIC) &&
-                    (static_init->access_flags & ACC_CONSTRUCTOR))
-                {
-                    if (is_verbose()) {
-                        //printf("0x%x\n", static_init->access_flags & (ACC_STATIC | ACC_CONSTRUCTOR));
-                        printf("Execute static class (0x%x) initialization\n",
-                               dex->class_data_item[i].clazz_def->class_idx);
-                    }
-                    runMethod(dex, vm, static_init);
-                }
-            }
-        }
-    }
+    sdvm_context_current()->run_dex = dex;
+    sdvm_context_current()->run_vm = vm;
+
+    /*  classes are initialized on first use, the main class is the first
+     *  one used */
+    budget_start(sdvm_context_current());
+    stats_run_begin(sdvm_context_current());
+    perfctr_phase(PERFCTR_INIT);
+    init_class(dex, vm, clazz);
+    boot_image_save(dex);
+    perfctr_phase(PERFCTR_EXECUTE);
     runMethod(dex, vm, m);
+    perfctr_phase(-1);
+    stats_run_end(sdvm_context_current());
+#ifdef SDVM_OPSTATS
+    opstats_end(vm);
+#endif
+    return 0;
 }
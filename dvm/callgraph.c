@@ -0,0 +1,343 @@
+/*
+ * Simple Dalvik Virtual Machine Implementation
+ *
+ * Copyright (C) 2014 cycheng <createinfinite@yahoo.com.tw>
+ * Copyright (C) 2013 Chun-Yu Wang <wicanr2@gmail.com>
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include "simple_dvm.h"
+
+/*  Call graph profiler
+ *
+ *  dvm --callgraph=FILE times every guest method (runMethod) and every
+ *  native (invoke_java_lang_library) exactly : calls, inclusive and
+ *  exclusive time, and the caller -> callee edges. At exit FILE gets them
+ *  in callgrind format (kcachegrind, qcachegrind, gprof2dot, ...), with
+ *  the class as file and "Lpkg/Class;.name(params)ret" as function, and
+ *  the methods with the most exclusive time are listed on stderr.
+ *
+ *  Each thread counts in tables of its own, so threads don't wait on each
+ *  other. Names are resolved when a method is first seen, so the tables
+ *  don't depend on the dex being around at exit, and the tables of all
+ *  threads are merged by name then. A run aborted by the budget leaves
+ *  its calls open, they are dropped when the next run starts, or end at
+ *  exit.
+ */
+#define CALLGRAPH_BUCKETS 1024
+#define CALLGRAPH_DEPTH 1024    /* deeper calls are not timed */
+
+typedef struct _callgraph_node callgraph_node;
+
+typedef struct _callgraph_edge {
+    struct _callgraph_edge *next;
+    callgraph_node *callee;
+    u8 calls;
+    u8 inclusive;
+} callgraph_edge;
+
+struct _callgraph_node {
+    callgraph_node *next;       /* in the bucket */
+    const void *key;            /* encoded_method, java_lang_method */
+    char *clazz;
+    char *name;                 /* unique, the key of the merge */
+    u8 calls;
+    u8 inclusive;               /* outermost activations only */
+    u8 exclusive;
+    int active;                 /* activations on the stack */
+    callgraph_edge *edges;
+    callgraph_node *merged;     /* at exit */
+};
+
+typedef struct _callgraph_call {
+    callgraph_node *node;
+    u8 start;
+    u8 children;                /* time in the calls it made */
+} callgraph_call;
+
+typedef struct _callgraph_table {
+    struct _callgraph_table *next;
+    callgraph_node *buckets[CALLGRAPH_BUCKETS];
+    callgraph_call stack[CALLGRAPH_DEPTH];
+    int depth;                  /* may pass CALLGRAPH_DEPTH */
+} callgraph_table;
+
+int callgraph_on = 0;
+static char *callgraph_file;
+static pid_t callgraph_pid;
+static pthread_mutex_t callgraph_lock = PTHREAD_MUTEX_INITIALIZER;
+static callgraph_table *callgraph_tables;
+static __thread callgraph_table *callgraph_mine = NULL;
+
+static u8 callgraph_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u8)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned int callgraph_hash_key(const void *key)
+{
+    return ((uintptr_t)key >> 3) % CALLGRAPH_BUCKETS;
+}
+
+static unsigned int callgraph_hash_name(const char *name)
+{
+    unsigned int h = 5381;
+    while (*name)
+        h = h * 33 + (unsigned char)*name++;
+    return h % CALLGRAPH_BUCKETS;
+}
+
+static callgraph_table *callgraph_table_get(void)
+{
+    callgraph_table *t = callgraph_mine;
+
+    if (t)
+        return t;
+    t = (callgraph_table *)calloc(1, sizeof(callgraph_table));
+    if (t == NULL) {
+        printf("Error! cannot allocate the call graph\n");
+        exit(1);
+    }
+    pthread_mutex_lock(&callgraph_lock);
+    t->next = callgraph_tables;
+    callgraph_tables = t;
+    pthread_mutex_unlock(&callgraph_lock);
+    callgraph_mine = t;
+    return t;
+}
+
+static callgraph_node *callgraph_node_new(callgraph_node **bucket, const void *key,
+                                          const char *clazz, const char *name)
+{
+    callgraph_node *n = (callgraph_node *)calloc(1, sizeof(callgraph_node));
+
+    n->key = key;
+    n->clazz = strdup(clazz);
+    n->name = strdup(name);
+    n->next = *bucket;
+    *bucket = n;
+    return n;
+}
+
+static void callgraph_push(callgraph_table *t, callgraph_node *node)
+{
+    if (t->depth < CALLGRAPH_DEPTH) {
+        callgraph_call *c = &t->stack[t->depth];
+        c->node = node;
+        c->children = 0;
+        node->active++;
+        c->start = callgraph_now();
+    }
+    t->depth++;
+}
+
+/* guest method 'm' starts, at the top of 'vm' if vm->depth is 0 */
+void callgraph_enter(DexFileFormat *dex, simple_dalvik_vm *vm, encoded_method *m)
+{
+    callgraph_table *t = callgraph_table_get();
+    callgraph_node *node;
+    unsigned int h = callgraph_hash_key(m);
+
+    /* calls left open by an aborted run */
+    if (vm->depth == 0) {
+        while (t->depth > 0)
+            if (--t->depth < CALLGRAPH_DEPTH)
+                t->stack[t->depth].node->active--;
+    }
+    for (node = t->buckets[h]; node; node = node->next)
+        if (node->key == m)
+            break;
+    if (node == NULL) {
+        const method_id_item *id = get_method_item(dex, m->method_id);
+        char name[1024];
+
+        get_method_full_name(dex, m->method_id, name, sizeof(name));
+        node = callgraph_node_new(&t->buckets[h], m,
+                                  get_type_item_name(dex, id->class_idx), name);
+    }
+    callgraph_push(t, node);
+}
+
+/* native 'clazz'.'method' starts, 'key' tells it from the others */
+void callgraph_enter_native(const void *key, const char *clazz, const char *method)
+{
+    callgraph_table *t = callgraph_table_get();
+    callgraph_node *node;
+    unsigned int h = callgraph_hash_key(key);
+
+    for (node = t->buckets[h]; node; node = node->next)
+        if (node->key == key)
+            break;
+    if (node == NULL) {
+        char name[1024];
+        snprintf(name, sizeof(name), "%s.%s", clazz, method);
+        node = callgraph_node_new(&t->buckets[h], key, clazz, name);
+    }
+    callgraph_push(t, node);
+}
+
+static void callgraph_pop(callgraph_table *t)
+{
+    callgraph_call *c, *caller;
+    callgraph_node *node;
+    callgraph_edge *e;
+    u8 elapsed;
+
+    if (--t->depth >= CALLGRAPH_DEPTH)
+        return;
+    c = &t->stack[t->depth];
+    node = c->node;
+    elapsed = callgraph_now() - c->start;
+    node->calls++;
+    node->exclusive += elapsed - c->children;
+    if (--node->active == 0)
+        node->inclusive += elapsed;
+    if (t->depth == 0)
+        return;
+
+    caller = &t->stack[t->depth - 1];
+    caller->children += elapsed;
+    for (e = caller->node->edges; e; e = e->next)
+        if (e->callee == node)
+            break;
+    if (e == NULL) {
+        e = (callgraph_edge *)calloc(1, sizeof(callgraph_edge));
+        e->callee = node;
+        e->next = caller->node->edges;
+        caller->node->edges = e;
+    }
+    e->calls++;
+    e->inclusive += elapsed;
+}
+
+/* the innermost method or native returns */
+void callgraph_leave(void)
+{
+    callgraph_table *t = callgraph_mine;
+
+    if (t && t->depth > 0)
+        callgraph_pop(t);
+}
+
+/* the node named like 'n' in 'merged', created if needed */
+static callgraph_node *callgraph_merged(callgraph_node **merged, callgraph_node *n)
+{
+    const unsigned int h = callgraph_hash_name(n->name);
+    callgraph_node *m;
+
+    for (m = merged[h]; m; m = m->next)
+        if (strcmp(m->name, n->name) == 0)
+            return m;
+    return callgraph_node_new(&merged[h], NULL, n->clazz, n->name);
+}
+
+static int callgraph_by_exclusive(const void *a, const void *b)
+{
+    const callgraph_node *x = *(const callgraph_node **)a;
+    const callgraph_node *y = *(const callgraph_node **)b;
+
+    if (x->exclusive != y->exclusive)
+        return x->exclusive < y->exclusive ? 1 : -1;
+    return strcmp(x->name, y->name);
+}
+
+static void callgraph_finish(void)
+{
+    callgraph_node *merged[CALLGRAPH_BUCKETS], *n, **all;
+    callgraph_table *t;
+    callgraph_edge *e, *me;
+    size_t count = 0, i;
+    u8 total = 0;
+    FILE *f;
+
+    /* a zygote job (fork) must not clobber the file */
+    if (callgraph_pid != getpid())
+        return;
+    callgraph_on = 0;
+    memset(merged, 0, sizeof(merged));
+    pthread_mutex_lock(&callgraph_lock);
+    /* calls still open (exit on the budget) end now */
+    for (t = callgraph_tables; t; t = t->next)
+        while (t->depth > 0)
+            callgraph_pop(t);
+    for (t = callgraph_tables; t; t = t->next)
+        for (i = 0; i < CALLGRAPH_BUCKETS; i++)
+            for (n = t->buckets[i]; n; n = n->next)
+                n->merged = callgraph_merged(merged, n);
+    for (t = callgraph_tables; t; t = t->next)
+        for (i = 0; i < CALLGRAPH_BUCKETS; i++)
+            for (n = t->buckets[i]; n; n = n->next) {
+                n->merged->calls += n->calls;
+                n->merged->inclusive += n->inclusive;
+                n->merged->exclusive += n->exclusive;
+                total += n->exclusive;
+                for (e = n->edges; e; e = e->next) {
+                    for (me = n->merged->edges; me; me = me->next)
+                        if (me->callee == e->callee->merged)
+                            break;
+                    if (me == NULL) {
+                        me = (callgraph_edge *)calloc(1, sizeof(callgraph_edge));
+                        me->callee = e->callee->merged;
+                        me->next = n->merged->edges;
+                        n->merged->edges = me;
+                    }
+                    me->calls += e->calls;
+                    me->inclusive += e->inclusive;
+                }
+            }
+    pthread_mutex_unlock(&callgraph_lock);
+
+    for (i = 0; i < CALLGRAPH_BUCKETS; i++)
+        for (n = merged[i]; n; n = n->next)
+            count++;
+    all = (callgraph_node **)malloc(sizeof(callgraph_node *) * (count + 1));
+    count = 0;
+    for (i = 0; i < CALLGRAPH_BUCKETS; i++)
+        for (n = merged[i]; n; n = n->next)
+            all[count++] = n;
+    qsort(all, count, sizeof(callgraph_node *), callgraph_by_exclusive);
+
+    f = fopen(callgraph_file, "w");
+    if (f == NULL) {
+        fprintf(stderr, "Error! cannot write call graph %s\n", callgraph_file);
+    } else {
+        fprintf(f, "# callgrind format\nversion: 1\ncreator: simple-dvm\n");
+        fprintf(f, "positions: line\nevents: ns\nsummary: %llu\n",
+                (unsigned long long)total);
+        for (i = 0; i < count; i++) {
+            n = all[i];
+            fprintf(f, "\nfl=%s\nfn=%s\n0 %llu\n", n->clazz, n->name,
+                    (unsigned long long)n->exclusive);
+            for (e = n->edges; e; e = e->next)
+                fprintf(f, "cfl=%s\ncfn=%s\ncalls=%llu 0\n0 %llu\n",
+                        e->callee->clazz, e->callee->name,
+                        (unsigned long long)e->calls, (unsigned long long)e->inclusive);
+        }
+        fclose(f);
+    }
+
+    fprintf(stderr, "%12s %14s %14s  %s\n", "calls", "inclusive ns", "exclusive ns", "method");
+    for (i = 0; i < count && i < 20; i++)
+        fprintf(stderr, "%12llu %14llu %14llu  %s\n", (unsigned long long)all[i]->calls,
+                (unsigned long long)all[i]->inclusive,
+                (unsigned long long)all[i]->exclusive, all[i]->name);
+    free(all);
+}
+
+/* time every call from now on, the call graph goes to 'file' at exit */
+int callgraph_start(const char *file)
+{
+    if (callgraph_file == NULL)
+        atexit(callgraph_finish);
+    free(callgraph_file);
+    callgraph_file = strdup(file);
+    callgraph_pid = getpid();
+    callgraph_on = 1;
+    return 0;
+}
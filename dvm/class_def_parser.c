@@ -39,10 +39,8 @@ static void parse_encoded_method(unsigned char *buf, encoded_method *method)
         printf("      - registers_size = %d\n", method->code_item.registers_size);
         printf("      - insns_size = %d\n", method->code_item.insns_size);
     }
-    method->code_item.insns = malloc(sizeof(ushort) * method->code_item.insns_size);
-    memcpy(method->code_item.insns, buf + offset,
-           sizeof(ushort) * method->code_item.insns_size);
-    offset += sizeof(ushort) * method->code_item.insns_size;
+    /* the code stays in the mapped dex file */
+    method->code_item.insns = (ushort *)(buf + offset);
 }
 
 const uint OBJ_BASE_SIZE = sizeof(sdvm_obj);
@@ -162,7 +160,8 @@ int parse_static_data_item(unsigned char *buf, int static_data_offset,
     offset += size;
     assert(len);
 
-    printf("    offset = 0x%x, len = %d\n", static_data_offset, len);
+    if (is_verbose() > 3)
+        printf("    offset = 0x%x, len = %d\n", static_data_offset, len);
     for (j = 0; j < len; ++j) {
         int data = 0;
         /* read 1 byte */
@@ -170,7 +169,7 @@ int parse_static_data_item(unsigned char *buf, int static_data_offset,
         ++offset;
         int valueType = data & 0x1F;
         int valueArgument = data >> 5;
-        sdata[j].obj = create_sdvm_obj();
+        sdata[j].obj = create_sdvm_obj("(static field)");
         sdata[j].obj->ref_count = 1;
         long *val = (long *)(&sdata[j].obj->other_data);
         switch(valueType){
@@ -231,6 +230,14 @@ int parse_static_data_item(unsigned char *buf, int static_data_offset,
     return len;
 }
 
+/* type_id -> class_defs index, or -1 for classes of other dex */
+static int get_class_index(DexFileFormat *dex, const uint type_id)
+{
+    if (dex->class_index == NULL || type_id >= dex->header.typeIdsSize)
+        return -1;
+    return dex->class_index[type_id];
+}
+
 static void parse_class_data_item(DexFileFormat *dex,
                                   unsigned char *buf, int offset, int index)
 {
@@ -243,15 +250,17 @@ static void parse_class_data_item(DexFileFormat *dex,
     int virtual_methods_size = 0;
     const uint super_clsid = dex->class_def_item[index].superclass_idx;
     const uint my_clsid = dex->class_def_item[index].class_idx;
-    const char *super_name = dex->string_data_item[dex->type_id_item[super_clsid].descriptor_idx].data;
-    const char *my_name = dex->string_data_item[dex->type_id_item[my_clsid].descriptor_idx].data;
+    const char *super_name = get_type_item_name(dex, super_clsid);
+    const char *my_name = get_type_item_name(dex, my_clsid);
     class_data_item *super_clazz = NULL;
 
-    if (NO_INDEX != super_clsid)
-        super_clazz = get_class_data_by_typeid_in_range(dex, super_clsid, index);
+    /* link my super class first, it may come later in the file */
+    if (NO_INDEX != super_clsid && get_class_index(dex, super_clsid) >= 0)
+        super_clazz = link_class(dex, get_class_index(dex, super_clsid));
 
-    dex->class_data_item[index].clazz_def = &dex->class_def_item[index];
     dex->class_data_item[index].super_class = super_clazz;
+    if (dex->class_def_item[index].class_data_off == 0)
+        return;     /* e.g. a marker interface, nothing else to load */
     i = offset;
 
     static_fields_size = get_uleb128_len(buf, i, &size);
@@ -380,6 +389,12 @@ static void parse_class_data_item(DexFileFormat *dex,
             load_encoded_method(buf, i, virtual_methods_size, &size);
         i += size;
     }
+}
+
+/* create the static field objects of class_defs[index], with their initial values */
+static void parse_static_data(DexFileFormat *dex, unsigned char *buf, int index)
+{
+    int static_fields_size = dex->class_data_item[index].static_fields_size;
 
     // load static data :
 #if 0
@@ -421,7 +436,7 @@ static void parse_class_data_item(DexFileFormat *dex,
 
         if (static_values_off > 0) {
             actual_init_count = parse_static_data_item(buf, static_values_off, sdata);
-        } else {
+        } else if (is_verbose() > 3) {
             printf("    (None Value)\n");
         }
 
@@ -435,7 +450,7 @@ static void parse_class_data_item(DexFileFormat *dex,
             sdata[j].type = get_field_type(dex, field_id);
 
             //if (sdata[j].type == VALUE_SDVM_OBJ) {
-            sdata[j].obj = create_sdvm_obj();
+            sdata[j].obj = create_sdvm_obj("(static field)");
             sdata[j].obj->ref_count = 1;
             sdata[j].obj->clazz = &dex->class_data_item[index];
             //}
@@ -483,6 +498,45 @@ static void parse_class_data_item(DexFileFormat *dex,
     }
 }
 
+/*  static objects of the undefined classes, field ids from undef_id_start
+ *  on, allocated in the current heap
+ */
+void create_undef_sdata(DexFileFormat *dex)
+{
+    int j;
+    const int undef_num = dex->header.fieldIdsSize - dex->undef_id_start;
+    const int undef_start = dex->undef_id_start;
+
+    dex->undef_sdata = (static_field_data *)
+        malloc(sizeof(static_field_data) * undef_num);
+    memset(dex->undef_sdata, 0, sizeof(static_field_data) * undef_num);
+
+    if (is_verbose()) {
+        printf("  - undef class static objects : \n");
+    }
+    for (j = 0; j < undef_num; j++) {
+        undef_static_obj *undef_obj = (undef_static_obj *)
+            sdvm_heap_alloc(sizeof(undef_static_obj), "(framework static field)");
+
+        dex->undef_sdata[j].obj = (sdvm_obj *)undef_obj;
+        undef_obj->obj.ref_count = 1;
+        undef_obj->obj.other_data = (void *)ICT_UNDEF_STATIC_OBJ;
+        undef_obj->field_id = undef_start + j;
+
+        if (is_verbose()) {
+            printf("    . field_id %d, obj %p \n",
+                   undef_obj->field_id, undef_obj);
+        }
+    }
+}
+
+/*  Class loading is lazy : parse_class_defs only records the class_defs,
+ *  a class's fields and methods are parsed (and its layout computed) by
+ *  link_class, and its static values created by load_class, the first time
+ *  something asks for it through get_class_data_by_typeid /
+ *  get_class_data_by_fieldid. A class may also arrive linked from an image,
+ *  see image.c. <clinit> is run separately by init_class, see utils.c.
+ */
 void parse_class_defs(DexFileFormat *dex, unsigned char *buf, int offset)
 {
     int i = 0;
@@ -490,15 +544,15 @@ void parse_class_defs(DexFileFormat *dex, unsigned char *buf, int offset)
         printf("parse class defs offset = %04x\n", (unsigned int)(offset + sizeof(DexHeader)));
     if (dex->header.classDefsSize <= 0)
         return;
-    dex->class_def_item = malloc(
-                              sizeof(class_def_item) * dex->header.classDefsSize);
-    dex->class_data_item = malloc(
-                               sizeof(class_data_item) * dex->header.classDefsSize);
+    dex->class_def_item = (class_def_item *)(buf + offset);
+    dex->class_data_item = calloc(dex->header.classDefsSize, sizeof(class_data_item));
+
+    /* type_id -> class_defs index, -1 for classes of other dex */
+    dex->class_index = malloc(sizeof(int) * dex->header.typeIdsSize);
+    for (i = 0 ; i < dex->header.typeIdsSize; i++)
+        dex->class_index[i] = -1;
 
     for (i = 0 ; i < dex->header.classDefsSize; i++) {
-        memcpy(&dex->class_def_item[i],
-               buf + i * sizeof(class_def_item) + offset,
-               sizeof(class_def_item));
         if (is_verbose() > 3) {
             printf("  - class_defs[%d], cls_id = %d, super_cls_id = %d, data_off = 0x%04x, source_file_idx = %d\n",
                    i,
@@ -507,8 +561,9 @@ void parse_class_defs(DexFileFormat *dex, unsigned char *buf, int offset)
                    dex->class_def_item[i].class_data_off,
                    dex->class_def_item[i].source_file_idx);
         }
-        parse_class_data_item(dex, buf,
-                              dex->class_def_item[i].class_data_off - sizeof(DexHeader), i);
+        dex->class_data_item[i].clazz_def = &dex->class_def_item[i];
+        dex->class_data_item[i].state = CLASS_UNLOADED;
+        dex->class_index[dex->class_def_item[i].class_idx] = i;
     }
 
     /*  handle those undefined class, e.g. Ljava/lang/Class; ..
@@ -534,32 +589,8 @@ void parse_class_defs(DexFileFormat *dex, unsigned char *buf, int offset)
 
         /* ok, we have undefined class items */
         if (iter < dex->header.fieldIdsSize) {
-            int j;
-            const int undef_num = dex->header.fieldIdsSize - iter;
-            const int undef_start = iter;
-
-            dex->undef_id_start = undef_start;
-            dex->undef_sdata = (static_field_data *)
-                malloc(sizeof(static_field_data) * undef_num);
-            memset(dex->undef_sdata, 0, sizeof(static_field_data) * undef_num);
-
-            if (is_verbose()) {
-                printf("  - undef class static objects : \n");
-            }
-            for (j = 0; j < undef_num; j++) {
-                undef_static_obj *undef_obj = (undef_static_obj *)
-                    malloc(sizeof(undef_static_obj));
-
-                dex->undef_sdata[j].obj = (sdvm_obj *)undef_obj;
-                undef_obj->obj.ref_count = 1;
-                undef_obj->obj.other_data = (void *)ICT_UNDEF_STATIC_OBJ;
-                undef_obj->field_id = undef_start + j;
-
-                if (is_verbose()) {
-                    printf("    . field_id %d, obj %p \n",
-                           undef_obj->field_id, undef_obj);
-                }
-            }
+            dex->undef_id_start = iter;
+            create_undef_sdata(dex);
 #if 0
             const int undef_start = iter;
             int undef_num = 1;
@@ -595,34 +626,198 @@ void parse_class_defs(DexFileFormat *dex, unsigned char *buf, int offset)
     }
 }
 
-class_data_item *get_class_data_by_fieldid(DexFileFormat *dex, const int fieldid) {
-    int iter;
-    field_id_item *field = get_field_item(dex, fieldid);
+/*  Verification
+ *
+ *  Before anything runs, every class_def is decoded and checked : indices
+ *  in range, offsets inside the file, and code items that fit both the
+ *  file and our 32 registers. This walks every class's data, so it runs
+ *  on the thread pool, one class per item; load_class later trusts it.
+ */
+#define VERIFY_MAX_REGS (sizeof(((simple_dalvik_vm *)0)->regs) / sizeof(simple_dvm_register))
 
-    for (iter = 0; iter < dex->header.classDefsSize; iter++)
-        if (field->class_idx == dex->class_def_item[iter].class_idx)
-            return &dex->class_data_item[iter];
-    return NULL;
+typedef struct _verify_state {
+    DexFileFormat *dex;
+    volatile int errors;
+} verify_state;
+
+static void verify_error(verify_state *v, int index, const char *what, uint value)
+{
+    DexFileFormat *dex = v->dex;
+
+    __sync_fetch_and_add(&v->errors, 1);
+    printf("Error! class_defs[%d] (%s) : bad %s (0x%x)\n", index,
+           dex->class_def_item[index].class_idx < dex->header.typeIdsSize ?
+           get_type_item_name(dex, dex->class_def_item[index].class_idx) : "?",
+           what, value);
 }
 
-class_data_item *get_class_data_by_typeid(DexFileFormat *dex, const int type_id) {
-    int iter;
+/* read an uleb128 at *off, FALSE when it runs past the end of the file */
+static int verify_uleb128(DexFileFormat *dex, uint *off, uint *value)
+{
+    int size = 0;
+    if (*off >= dex->map_size)
+        return FALSE;
+    *value = get_uleb128_len(dex->map_base, *off, &size);
+    *off += size;
+    return *off <= dex->map_size;
+}
 
-    for (iter = 0; iter < dex->header.classDefsSize; iter++)
-        if (type_id == dex->class_def_item[iter].class_idx)
-            return &dex->class_data_item[iter];
-    return NULL;
+static int verify_code_item(verify_state *v, int index, uint code_off)
+{
+    DexFileFormat *dex = v->dex;
+    code_item code;
+
+    if (code_off == 0)
+        return TRUE;    /* abstract or native */
+    if (code_off + 16 > dex->map_size || (code_off & 3)) {
+        verify_error(v, index, "code_off", code_off);
+        return FALSE;
+    }
+    memcpy(&code.registers_size, dex->map_base + code_off, sizeof(ushort));
+    memcpy(&code.ins_size, dex->map_base + code_off + 2, sizeof(ushort));
+    memcpy(&code.insns_size, dex->map_base + code_off + 12, sizeof(uint));
+    if (code.registers_size > VERIFY_MAX_REGS) {
+        verify_error(v, index, "registers_size", code.registers_size);
+        return FALSE;
+    }
+    if (code.ins_size > code.registers_size) {
+        verify_error(v, index, "ins_size", code.ins_size);
+        return FALSE;
+    }
+    if ((u8)code_off + 16 + (u8)code.insns_size * 2 > dex->map_size) {
+        verify_error(v, index, "insns_size", code.insns_size);
+        return FALSE;
+    }
+    return TRUE;
 }
 
-class_data_item *get_class_data_by_typeid_in_range(DexFileFormat *dex, const int type_id,
-                                                   const uint max_count)
+static void verify_class_def(void *arg, int index)
 {
-    int iter;
-    assert(dex->header.classDefsSize > max_count);
-    for (iter = 0; iter < max_count; iter++)
-        if (type_id == dex->class_def_item[iter].class_idx)
-            return &dex->class_data_item[iter];
-    return NULL;
+    verify_state *v = (verify_state *)arg;
+    DexFileFormat *dex = v->dex;
+    const class_def_item *def = &dex->class_def_item[index];
+    uint sizes[4], off, i, k, idx, value;
+
+    if (def->class_idx >= dex->header.typeIdsSize) {
+        verify_error(v, index, "class_idx", def->class_idx);
+        return;
+    }
+    if (def->superclass_idx != NO_INDEX && def->superclass_idx >= dex->header.typeIdsSize) {
+        verify_error(v, index, "superclass_idx", def->superclass_idx);
+        return;
+    }
+    if (def->static_values_off >= dex->map_size) {
+        verify_error(v, index, "static_values_off", def->static_values_off);
+        return;
+    }
+    if (def->class_data_off == 0)
+        return;
+    if (def->class_data_off >= dex->map_size) {
+        verify_error(v, index, "class_data_off", def->class_data_off);
+        return;
+    }
+
+    off = def->class_data_off;
+    for (i = 0; i < 4; i++) {
+        if (!verify_uleb128(dex, &off, &sizes[i])) {
+            verify_error(v, index, "class_data_item", off);
+            return;
+        }
+    }
+    /* static & instance fields : field_idx_diff, access_flags */
+    for (k = 0; k < 2; k++) {
+        idx = 0;
+        for (i = 0; i < sizes[k]; i++) {
+            if (!verify_uleb128(dex, &off, &value) ||
+                (idx += value) >= dex->header.fieldIdsSize) {
+                verify_error(v, index, "field_idx", idx);
+                return;
+            }
+            verify_uleb128(dex, &off, &value);
+        }
+    }
+    /* direct & virtual methods : method_idx_diff, access_flags, code_off */
+    for (k = 2; k < 4; k++) {
+        idx = 0;
+        for (i = 0; i < sizes[k]; i++) {
+            if (!verify_uleb128(dex, &off, &value) ||
+                (idx += value) >= dex->header.methodIdsSize) {
+                verify_error(v, index, "method_idx", idx);
+                return;
+            }
+            verify_uleb128(dex, &off, &value);
+            if (!verify_uleb128(dex, &off, &value)) {
+                verify_error(v, index, "class_data_item", off);
+                return;
+            }
+            if (!verify_code_item(v, index, value))
+                return;
+        }
+    }
+}
+
+/* return the number of broken class_defs */
+int verify_class_defs(DexFileFormat *dex)
+{
+    verify_state v;
+
+    v.dex = dex;
+    v.errors = 0;
+    thread_pool_for(dex->header.classDefsSize, verify_class_def, &v);
+    return v.errors;
+}
+
+/* parse class_defs[index]'s fields and methods and compute its layout */
+class_data_item *link_class(DexFileFormat *dex, const int index)
+{
+    class_data_item *clazz = &dex->class_data_item[index];
+
+    if (clazz->state == CLASS_UNLOADED) {
+        /* set first, so a class referring to itself doesn't recurse */
+        clazz->state = CLASS_LINKED;
+        if (is_verbose() > 2)
+            printf("load class %s (class_defs[%d])\n",
+                   get_type_item_name(dex, clazz->clazz_def->class_idx), index);
+        parse_class_data_item(dex, dex->map_base + sizeof(DexHeader),
+                              clazz->clazz_def->class_data_off - sizeof(DexHeader),
+                              index);
+    }
+    return clazz;
+}
+
+/* link every class, e.g. before they are written to an image */
+void link_classes(DexFileFormat *dex)
+{
+    int i;
+    for (i = 0; i < dex->header.classDefsSize; i++)
+        link_class(dex, i);
+}
+
+/* link class_defs[index] and create its static data, if not done yet */
+class_data_item *load_class(DexFileFormat *dex, const int index)
+{
+    class_data_item *clazz = link_class(dex, index);
+
+    if (clazz->state == CLASS_LINKED) {
+        clazz->state = CLASS_LOADED;
+        /* sget may resolve a field through the super class */
+        if (clazz->super_class)
+            load_class(dex, clazz->super_class - dex->class_data_item);
+        parse_static_data(dex, dex->map_base + sizeof(DexHeader), index);
+    }
+    return clazz;
+}
+
+class_data_item *get_class_data_by_fieldid(DexFileFormat *dex, const int fieldid) {
+    field_id_item *field = get_field_item(dex, fieldid);
+    return get_class_data_by_typeid(dex, field->class_idx);
+}
+
+class_data_item *get_class_data_by_typeid(DexFileFormat *dex, const int type_id) {
+    const int index = type_id < 0 ? -1 : get_class_index(dex, type_id);
+    if (index < 0)
+        return NULL;
+    return load_class(dex, index);
 }
 
 
@@ -0,0 +1,49 @@
+/*
+ * Simple Dalvik Virtual Machine Implementation
+ *
+ * Copyright (C) 2014 cycheng <createinfinite@yahoo.com.tw>
+ * Copyright (C) 2013 Chun-Yu Wang <wicanr2@gmail.com>
+ */
+
+#include "simple_dvm.h"
+
+/*  Per-instance state
+ *
+ *  What a VM instance changes as it runs (trace level, heap, guest stdin
+ *  and stdout, image settings) lives in an sdvm_context rather than in
+ *  globals, so several instances can share a process (see sdvm.c). Each
+ *  thread works on its current context : the library switches to an
+ *  instance's context around every call into it, the command line tool
+ *  never switches and runs in the default one.
+ */
+static sdvm_context default_context;
+static __thread sdvm_context *current = NULL;
+
+sdvm_context *sdvm_context_current(void)
+{
+    return current ? current : &default_context;
+}
+
+/* make 'ctx' (NULL : the default) current, return the previous one */
+sdvm_context *sdvm_context_switch(sdvm_context *ctx)
+{
+    sdvm_context *prev = current;
+    current = ctx;
+    return prev;
+}
+
+void sdvm_context_init(sdvm_context *ctx)
+{
+    memset(ctx, 0, sizeof(sdvm_context));
+}
+
+/*  release the heap and stdin buffers, every object of 'ctx' goes away ;
+ *  its counters are kept for the process totals
+ */
+void sdvm_context_free(sdvm_context *ctx)
+{
+    trace_close(ctx);
+    stats_release(ctx);
+    sdvm_heap_free(ctx);
+    input_free(ctx);
+}
@@ -4,6 +4,11 @@
  * Copyright (C) 2013 Chun-Yu Wang <wicanr2@gmail.com>
  */
 
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "simple_dvm.h"
 
 /* Print Dex File Format */
@@ -54,62 +59,174 @@ void printDexFile(DexFileFormat *dex)
     printDexHeader(&dex->header);
 }
 
-/* Parse Dex File */
+/*  Parse Dex File
+ *
+ *  The file is mapped read-only and stays mapped for the VM's lifetime :
+ *  id tables, type lists, code items and string data are referenced in
+ *  place instead of being copied, so processes running the same dex share
+ *  its physical pages.
+ */
 int parseDexFile(char *file, DexFileFormat *dex)
 {
-    FILE *fp = 0;
+    unsigned char *map = 0;
     unsigned char *buf = 0;
-    size_t read_count;
+    struct stat st;
+    int fd;
+    u8 t;
 
-    fp = fopen(file, "rb");
-    if (fp == 0) {
+    fd = open(file, O_RDONLY);
+    if (fd < 0) {
         printf("Open file %s failed\n", file);
         return -1;
     }
-    memset(dex, 0, sizeof(dex));
-    read_count = fread(&dex->header, sizeof(DexHeader), 1, fp);
-    if (read_count != 1) {
-        printf("Reading dex header error (expect : %d, actual : %zd)\n",
-               1, read_count);
+    memset(dex, 0, sizeof(DexFileFormat));
+    if (fstat(fd, &st) < 0 || st.st_size < sizeof(DexHeader)) {
+        printf("Reading dex header error (file size : %lld)\n",
+               (long long)st.st_size);
+        close(fd);
         return -1;
     }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        printf("Mapping dex file %s failed\n", file);
+        return -1;
+    }
+    memcpy(&dex->header, map, sizeof(DexHeader));
+    if (dex->header.fileSize > st.st_size) {
+        printf("Reading whole dex file error (expect : %d, actual : %lld)\n",
+               dex->header.fileSize, (long long)st.st_size);
+        munmap(map, st.st_size);
+        return -1;
+    }
+    dex->map_base = map;
+    dex->map_size = st.st_size;
 
     /* NOTE! So buf doesn't contain dex header, so the all kind of offset value
      * should minus sizeof(DexHeader)
      */
-    buf = (unsigned char *) malloc(
-              sizeof(u1) * (dex->header.fileSize - sizeof(DexHeader)));
-
-    /* read all value into buf */
-    read_count = fread(buf, (dex->header.fileSize - sizeof(DexHeader)), 1, fp);
-    if (read_count != 1) {
-        printf("Reading whole dex file error (expect : %d, actual : %zd)\n",
-               1, read_count);
-        return -1;
-    }
-
-    fclose(fp);
+    buf = map + sizeof(DexHeader);
 
+    t = stats_now_ns();
     parse_map_list(dex, buf, dex->header.mapOff - sizeof(DexHeader));
+    t = stats_lap(STATS_MAP_LIST, t);
     parse_string_ids(dex, buf, dex->header.stringIdsOff - sizeof(DexHeader));
+    t = stats_lap(STATS_STRING_IDS, t);
     parse_type_ids(dex, buf, dex->header.typeIdsOff - sizeof(DexHeader));
+    t = stats_lap(STATS_TYPE_IDS, t);
     parse_proto_ids(dex, buf, dex->header.protoIdsOff - sizeof(DexHeader));
+    t = stats_lap(STATS_PROTO_IDS, t);
     parse_field_ids(dex, buf, dex->header.fieldIdsOff - sizeof(DexHeader));
+    t = stats_lap(STATS_FIELD_IDS, t);
     parse_method_ids(dex, buf, dex->header.methodIdsOff - sizeof(DexHeader));
+    t = stats_lap(STATS_METHOD_IDS, t);
     parse_class_defs(dex, buf, dex->header.classDefsOff - sizeof(DexHeader));
+    t = stats_lap(STATS_CLASS_DEFS, t);
+
+    /*  a valid image of this dex has everything verified and linked already,
+     *  otherwise verify the file and try to write an image for next time */
+    if (image_load(dex) != 0) {
+        t = stats_lap(STATS_IMAGE, t);
+        if (verify_class_defs(dex) > 0) {
+            printf("Error! %s failed verification\n", file);
+            freeDexFile(dex);
+            return -1;
+        }
+        /*  resolving strings is lazy, but when we have threads to spare,
+         *  doing it all up front is cheaper than faulting them in later */
+        if (thread_pool_size() > 1)
+            resolve_string_data(dex);
+        t = stats_lap(STATS_VERIFY, t);
+        image_save(dex);
+    }
+    stats_lap(STATS_IMAGE, t);
 
     if (dex->header.dataSize > 0) {
         assert(dex->header.dataSize == dex->header.fileSize - dex->header.dataOff);
-        dex->data = malloc(sizeof(u1) * dex->header.dataSize);
-        memcpy(dex->data, buf + dex->header.dataOff - sizeof(DexHeader),
-               sizeof(u1) * dex->header.dataSize);
+        dex->data = map + dex->header.dataOff;
 
         if (is_verbose() > 3) {
-            printf("copy data part, offset = 0x%x, size = %d\n",
+            printf("data part, offset = 0x%x, size = %d\n",
                    dex->header.dataOff, dex->header.dataSize);
         }
     }
-
-    free(buf);
     return 0;
 }
+
+/*  Make 'inst' a separate instance of 'dex', which must be fully linked.
+ *
+ *  Once every class is linked, the mapping and the id, string and code
+ *  tables are only read, so 'inst' shares them with 'dex'. What running
+ *  code changes is private to 'inst' : class states, static values and
+ *  interned strings, which are created in the current heap.
+ */
+void copyDexFile(DexFileFormat *inst, const DexFileFormat *dex)
+{
+    const int count = dex->header.classDefsSize;
+    int i;
+
+    *inst = *dex;
+    inst->instance_of = dex;
+    inst->class_data_item = NULL;
+    if (count > 0) {
+        inst->class_data_item = malloc(sizeof(class_data_item) * count);
+        memcpy(inst->class_data_item, dex->class_data_item,
+               sizeof(class_data_item) * count);
+    }
+    for (i = 0; i < count; i++) {
+        class_data_item *clazz = &inst->class_data_item[i];
+
+        assert(clazz->state >= CLASS_LINKED);
+        clazz->state = CLASS_LINKED;
+        clazz->sdata = NULL;
+        if (clazz->super_class)
+            clazz->super_class = inst->class_data_item +
+                                 (clazz->super_class - dex->class_data_item);
+    }
+    inst->string_obj = calloc(dex->header.stringIdsSize, sizeof(string_object *));
+    inst->undef_sdata = NULL;
+    if (dex->undef_sdata)
+        create_undef_sdata(inst);
+}
+
+/* a table that came from the image is freed with it */
+static void free_dex_table(DexFileFormat *dex, void *table)
+{
+    if ((u1 *)table < dex->image_base ||
+        (u1 *)table >= dex->image_base + dex->image_size)
+        free(table);
+}
+
+/*  Release what parseDexFile or copyDexFile allocated. The objects live in
+ *  the heap of the context that created them, not here.
+ */
+void freeDexFile(DexFileFormat *dex)
+{
+    int i;
+
+    for (i = 0; dex->class_data_item && i < dex->header.classDefsSize; i++) {
+        class_data_item *clazz = &dex->class_data_item[i];
+
+        free(clazz->sdata);
+        if (dex->instance_of)
+            continue;
+        free_dex_table(dex, clazz->static_fields);
+        free_dex_table(dex, clazz->instance_fields);
+        free_dex_table(dex, clazz->direct_methods);
+        free_dex_table(dex, clazz->virtual_methods);
+    }
+    free(dex->class_data_item);
+    free(dex->string_obj);
+    free(dex->undef_sdata);
+    if (dex->instance_of == NULL) {
+        free_dex_table(dex, dex->string_data_item);
+        free(dex->proto_type_list);
+        free(dex->class_index);
+        free(dex->map_list.map_item);
+        if (dex->image_base)
+            munmap(dex->image_base, dex->image_size);
+        if (dex->map_base)
+            munmap(dex->map_base, dex->map_size);
+    }
+    memset(dex, 0, sizeof(DexFileFormat));
+}
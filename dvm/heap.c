@@ -0,0 +1,180 @@
+/*
+ * Simple Dalvik Virtual Machine Implementation
+ *
+ * Copyright (C) 2014 cycheng <createinfinite@yahoo.com.tw>
+ * Copyright (C) 2013 Chun-Yu Wang <wicanr2@gmail.com>
+ */
+
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include "simple_dvm.h"
+
+/*  sdvm heap
+ *
+ *  Dalvik registers are 32-bit, and we store object references directly in
+ *  them, so every guest object must live below 4GB. malloc() only guarantees
+ *  that for non-PIE executables (brk heap), so the heap is carved out of
+ *  MAP_32BIT chunks with a simple bump pointer. There is no GC, objects are
+ *  only freed all at once, with their VM instance. Every allocation can be
+ *  accounted to its site and type, see allocprof.c.
+ */
+#define HEAP_CHUNK_SIZE     (1024 * 1024)
+#define HEAP_LARGE_OBJ_SIZE (HEAP_CHUNK_SIZE / 4)
+#define HEAP_ALIGN          8
+
+/*  Every chunk (and every large object) is recorded, with a bitmap of the
+ *  addresses where an object starts, so the heap can be walked object by
+ *  object, e.g. to snapshot it (see boot_image.c). The chunk list belongs
+ *  to the current context, and goes away with it (sdvm_heap_free).
+ */
+static void *heap_map(size_t size, u1 *mapped)
+{
+#ifdef MAP_32BIT
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+    *mapped = 1;
+    if (p != MAP_FAILED)
+        return p;
+#endif
+    /* fallback, works as long as malloc hands out low addresses */
+    *mapped = 0;
+    return calloc(1, size);
+}
+
+static sdvm_heap_chunk *heap_new_chunk(sdvm_context *ctx, size_t size)
+{
+    sdvm_heap_chunk *c = (sdvm_heap_chunk *)malloc(sizeof(sdvm_heap_chunk));
+
+    if (c == NULL)
+        return NULL;
+    c->base = (u1 *)heap_map(size, &c->mapped);
+    c->starts = (u1 *)calloc(size / HEAP_ALIGN / 8 + 1, 1);
+    if (c->base == NULL || c->starts == NULL)
+        return NULL;
+    c->size = size;
+    c->used = 0;
+    c->next = ctx->heap_chunks;
+    ctx->heap_chunks = c;
+    return c;
+}
+
+void *sdvm_heap_alloc(size_t size, const char *type)
+{
+    sdvm_context *ctx = sdvm_context_current();
+    sdvm_heap_chunk *c = ctx->heap_cur;
+    void *p = NULL;
+    size_t bit;
+
+    size = (size + HEAP_ALIGN - 1) & ~(size_t)(HEAP_ALIGN - 1);
+    if (size >= HEAP_LARGE_OBJ_SIZE || c == NULL || size > c->size - c->used) {
+        /* no collector : the heap grows instead, the timeline shows it */
+        const u8 start = timeline_on ? stats_now_ns() : 0;
+        if (size >= HEAP_LARGE_OBJ_SIZE)
+            c = heap_new_chunk(ctx, size);
+        else
+            c = ctx->heap_cur = heap_new_chunk(ctx, HEAP_CHUNK_SIZE);
+        if (start)
+            timeline_span("heap", "heap grow", start, stats_now_ns());
+    }
+
+    if (c == NULL) {
+        printf("Error! sdvm heap out of memory (request %zu bytes)\n", size);
+        abort();
+    }
+    p = c->base + c->used;
+    bit = c->used / HEAP_ALIGN;
+    c->starts[bit / 8] |= 1 << (bit % 8);
+    c->used += size;
+    assert(((u8)p >> 32) == 0);
+    ctx->stats.alloc_objects++;
+    ctx->stats.alloc_bytes += size;
+    if (allocprof_on)
+        allocprof_record(ctx, size, type);
+    return p;
+}
+
+sdvm_heap_chunk *sdvm_heap_chunks(void)
+{
+    return sdvm_context_current()->heap_chunks;
+}
+
+/* call fn on every object allocated so far, with its (aligned) size */
+void sdvm_heap_walk(sdvm_heap_visit fn, void *arg)
+{
+    sdvm_heap_chunk *c;
+
+    for (c = sdvm_heap_chunks(); c; c = c->next) {
+        size_t off = 0;
+        while (off < c->used) {
+            size_t end = off + HEAP_ALIGN;
+            while (end < c->used &&
+                   !(c->starts[end / HEAP_ALIGN / 8] & (1 << (end / HEAP_ALIGN % 8))))
+                end += HEAP_ALIGN;
+            fn(arg, c, c->base + off, end - off);
+            off = end;
+        }
+    }
+}
+
+/*  Buffers of the current context, outside the heap because they grow
+ *  (StringBuilder values) : freed one by one when their owner drops them,
+ *  or all with the heap when a String still points into them.
+ */
+void *sdvm_buffer_alloc(size_t size)
+{
+    sdvm_context *ctx = sdvm_context_current();
+    sdvm_buffer *b = (sdvm_buffer *)malloc(sizeof(sdvm_buffer) + size);
+
+    if (b == NULL) {
+        printf("Error! out of memory (buffer of %zu bytes)\n", size);
+        abort();
+    }
+    b->prev = NULL;
+    b->next = ctx->buffers;
+    if (b->next)
+        b->next->prev = b;
+    ctx->buffers = b;
+    return b + 1;
+}
+
+void sdvm_buffer_free(void *p)
+{
+    sdvm_context *ctx = sdvm_context_current();
+    sdvm_buffer *b;
+
+    if (p == NULL)
+        return;
+    b = (sdvm_buffer *)p - 1;
+    if (b->prev)
+        b->prev->next = b->next;
+    else
+        ctx->buffers = b->next;
+    if (b->next)
+        b->next->prev = b->prev;
+    free(b);
+}
+
+/* give back every chunk and buffer of 'ctx' */
+void sdvm_heap_free(sdvm_context *ctx)
+{
+    sdvm_heap_chunk *c = ctx->heap_chunks;
+
+    if (ctx->alloc)
+        allocprof_release(ctx);
+    while (ctx->buffers) {
+        sdvm_buffer *next = ctx->buffers->next;
+        free(ctx->buffers);
+        ctx->buffers = next;
+    }
+    while (c) {
+        sdvm_heap_chunk *next = c->next;
+        if (c->mapped)
+            munmap(c->base, c->size);
+        else
+            free(c->base);
+        free(c->starts);
+        free(c);
+        c = next;
+    }
+    ctx->heap_chunks = ctx->heap_cur = NULL;
+}
@@ -0,0 +1,407 @@
+/*
+ * Simple Dalvik Virtual Machine Implementation
+ *
+ * Copyright (C) 2014 cycheng <createinfinite@yahoo.com.tw>
+ * Copyright (C) 2013 Chun-Yu Wang <wicanr2@gmail.com>
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "simple_dvm.h"
+
+/*  Pre-linked image cache
+ *
+ *  With an image cache directory (--image-cache=DIR), the first run of a
+ *  dex links every class and writes the result to DIR/<signature>.img :
+ *  the resolved string records, and for each class its layout and its
+ *  field and method tables. Later runs of the same dex (same checksum and
+ *  signature) map the image and use the tables in place, skipping
+ *  verification and linking. Static values are still created when a class
+ *  is first used, see load_class.
+ *
+ *  The image is mapped MAP_PRIVATE : the only pointers it holds are the
+ *  code pointers of encoded_method, stored as dex file offsets and fixed
+ *  up on load, so untouched pages stay shared with the page cache.
+ *
+ *    image_header
+ *    string_data_item[stringIdsSize]
+ *    image_class[classDefsSize]
+ *    encoded_field / encoded_method tables
+ */
+#define IMAGE_MAGIC     "sdvmimg"
+#define IMAGE_VERSION   1
+#define IMAGE_ALIGN     8
+/* the image holds raw structs, refuse one written by a different build */
+#define IMAGE_LAYOUT    (sizeof(string_data_item) | sizeof(encoded_field) << 8 | \
+                         sizeof(encoded_method) << 16 | sizeof(void *) << 24)
+
+typedef struct _image_header {
+    u1 magic[8];
+    u4 version;
+    u4 layout;
+    u1 checksum[4];     /* of the dex */
+    u1 signature[20];   /* of the dex */
+    u4 file_size;       /* of the dex */
+    u4 string_count;
+    u4 class_count;
+    u4 strings_off;
+    u4 classes_off;
+    u4 image_size;
+} image_header;
+
+typedef struct _image_class {
+    u4  static_fields_size;
+    u4  instance_fields_size;
+    u4  direct_methods_size;
+    u4  virtual_methods_size;
+    u4  class_inst_size;
+    int super_index;    /* class_defs index, or -1 */
+    /* offsets in the image, 0 : no table */
+    u4  static_fields_off;
+    u4  instance_fields_off;
+    u4  direct_methods_off;
+    u4  virtual_methods_off;
+} image_class;
+
+void image_init(const char *dir)
+{
+    sdvm_context_current()->image_dir = dir;
+}
+
+static void image_path(DexFileFormat *dex, char *path, size_t size)
+{
+    int i, n;
+
+    n = snprintf(path, size, "%s/", sdvm_context_current()->image_dir);
+    for (i = 0; i < 20 && n + 2 < size; i++)
+        n += snprintf(path + n, size - n, "%02x", dex->header.signature[i]);
+    snprintf(path + n, size - n, ".img");
+}
+
+static u4 align_image(u4 size)
+{
+    return (size + IMAGE_ALIGN - 1) & ~(IMAGE_ALIGN - 1);
+}
+
+/* a table at offset 'off' of 'count' items, NULL if it is empty */
+static void *image_table(u1 *image, u4 off, u4 count)
+{
+    return count ? image + off : NULL;
+}
+
+/* check that a table lies inside the image */
+static int image_table_ok(u4 image_size, u4 off, u4 count, size_t item_size)
+{
+    if (count == 0)
+        return TRUE;
+    return off >= sizeof(image_header) && off <= image_size &&
+           (u8)count * item_size <= image_size - off;
+}
+
+/* resolved strings must end with their NUL inside the dex */
+static int image_strings_ok(DexFileFormat *dex, u1 *image, u4 off, u4 count)
+{
+    const string_data_item *s = (const string_data_item *)(image + off);
+    u4 i;
+
+    for (i = 0; i < count; i++) {
+        if (s[i].data_off &&
+            (s[i].data_off >= dex->map_size ||
+             s[i].byte_size >= dex->map_size - s[i].data_off ||
+             dex->map_base[s[i].data_off + s[i].byte_size] != '\0'))
+            return FALSE;
+    }
+    return TRUE;
+}
+
+static int image_fields_ok(DexFileFormat *dex, u1 *image, u4 image_size,
+                           u4 off, u4 count)
+{
+    encoded_field *f = (encoded_field *)(image + off);
+    u4 i;
+
+    if (!image_table_ok(image_size, off, count, sizeof(encoded_field)))
+        return FALSE;
+    for (i = 0; i < count; i++) {
+        if (f[i].field_id >= dex->header.fieldIdsSize)
+            return FALSE;
+    }
+    return TRUE;
+}
+
+static int image_methods_ok(DexFileFormat *dex, u1 *image, u4 image_size,
+                            u4 off, u4 count)
+{
+    encoded_method *m = (encoded_method *)(image + off);
+    u4 i;
+
+    if (!image_table_ok(image_size, off, count, sizeof(encoded_method)))
+        return FALSE;
+    for (i = 0; i < count; i++) {
+        uintptr_t insns = (uintptr_t)m[i].code_item.insns;
+        if (m[i].code_off &&
+            (insns >= dex->map_size ||
+             (u8)m[i].code_item.insns_size * 2 > dex->map_size - insns))
+            return FALSE;
+    }
+    return TRUE;
+}
+
+/* code pointers are stored as offsets in the dex, see image_save */
+static void image_fix_methods(DexFileFormat *dex, encoded_method *m, u4 count)
+{
+    u4 i;
+
+    for (i = 0; i < count; i++) {
+        if (m[i].code_off)
+            m[i].code_item.insns = (ushort *)
+                (dex->map_base + (uintptr_t)m[i].code_item.insns);
+    }
+}
+
+static int image_check(DexFileFormat *dex, u1 *image, size_t size)
+{
+    const image_header *h = (const image_header *)image;
+    const image_class *ic;
+    u4 i;
+
+    if (size < sizeof(image_header) ||
+        memcmp(h->magic, IMAGE_MAGIC, sizeof(h->magic)) != 0 ||
+        h->version != IMAGE_VERSION || h->layout != IMAGE_LAYOUT ||
+        h->image_size != size)
+        return FALSE;
+    /* the key : an image belongs to exactly one dex */
+    if (memcmp(h->checksum, dex->header.checksum, sizeof(h->checksum)) != 0 ||
+        memcmp(h->signature, dex->header.signature, sizeof(h->signature)) != 0 ||
+        h->file_size != dex->header.fileSize ||
+        h->string_count != dex->header.stringIdsSize ||
+        h->class_count != dex->header.classDefsSize)
+        return FALSE;
+    if (!image_table_ok(size, h->strings_off, h->string_count, sizeof(string_data_item)) ||
+        !image_table_ok(size, h->classes_off, h->class_count, sizeof(image_class)) ||
+        !image_strings_ok(dex, image, h->strings_off, h->string_count))
+        return FALSE;
+
+    ic = (const image_class *)(image + h->classes_off);
+    for (i = 0; i < h->class_count; i++, ic++) {
+        if (ic->super_index < -1 || ic->super_index >= (int)h->class_count ||
+            !image_fields_ok(dex, image, size, ic->static_fields_off,
+                             ic->static_fields_size) ||
+            !image_fields_ok(dex, image, size, ic->instance_fields_off,
+                             ic->instance_fields_size) ||
+            !image_methods_ok(dex, image, size, ic->direct_methods_off,
+                              ic->direct_methods_size) ||
+            !image_methods_ok(dex, image, size, ic->virtual_methods_off,
+                              ic->virtual_methods_size))
+            return FALSE;
+    }
+    return TRUE;
+}
+
+/* return 0 if the dex was set up from its image */
+int image_load(DexFileFormat *dex)
+{
+    char path[1024];
+    struct stat st;
+    image_header *h;
+    image_class *ic;
+    u1 *image;
+    u4 i;
+    int fd;
+
+    if (sdvm_context_current()->image_dir == NULL)
+        return -1;
+    image_path(dex, path, sizeof(path));
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        if (is_verbose())
+            printf("image : no image %s\n", path);
+        return -1;
+    }
+    if (fstat(fd, &st) < 0 || st.st_size < sizeof(image_header)) {
+        close(fd);
+        return -1;
+    }
+    image = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED)
+        return -1;
+    if (!image_check(dex, image, st.st_size)) {
+        printf("Warning! ignoring stale or broken image %s\n", path);
+        munmap(image, st.st_size);
+        return -1;
+    }
+
+    h = (image_header *)image;
+    dex->image_base = image;
+    dex->image_size = st.st_size;
+    free(dex->string_data_item);
+    dex->string_data_item = (string_data_item *)(image + h->strings_off);
+
+    ic = (image_class *)(image + h->classes_off);
+    for (i = 0; i < h->class_count; i++, ic++) {
+        class_data_item *clazz = &dex->class_data_item[i];
+
+        clazz->static_fields_size = ic->static_fields_size;
+        clazz->instance_fields_size = ic->instance_fields_size;
+        clazz->direct_methods_size = ic->direct_methods_size;
+        clazz->virtual_methods_size = ic->virtual_methods_size;
+        clazz->static_fields = image_table(image, ic->static_fields_off,
+                                           ic->static_fields_size);
+        clazz->instance_fields = image_table(image, ic->instance_fields_off,
+                                             ic->instance_fields_size);
+        clazz->direct_methods = image_table(image, ic->direct_methods_off,
+                                            ic->direct_methods_size);
+        clazz->virtual_methods = image_table(image, ic->virtual_methods_off,
+                                             ic->virtual_methods_size);
+        image_fix_methods(dex, clazz->direct_methods, clazz->direct_methods_size);
+        image_fix_methods(dex, clazz->virtual_methods, clazz->virtual_methods_size);
+        clazz->class_inst_size = ic->class_inst_size;
+        clazz->super_class = ic->super_index >= 0 ?
+                             &dex->class_data_item[ic->super_index] : NULL;
+        clazz->state = CLASS_LINKED;
+    }
+
+    if (is_verbose())
+        printf("image : loaded %s (%lld bytes)\n", path, (long long)st.st_size);
+    return 0;
+}
+
+/* copy a table into the image at *pos, return its offset (0 if empty) */
+static u4 image_put(u1 *image, u4 *pos, const void *table, size_t size)
+{
+    const u4 off = *pos;
+
+    if (size == 0)
+        return 0;
+    memcpy(image + off, table, size);
+    *pos = align_image(off + size);
+    return off;
+}
+
+static u4 image_put_methods(DexFileFormat *dex, u1 *image, u4 *pos,
+                            const encoded_method *methods, u4 count)
+{
+    const u4 off = image_put(image, pos, methods, sizeof(encoded_method) * count);
+    encoded_method *m = (encoded_method *)(image + off);
+    u4 i;
+
+    for (i = 0; i < count; i++) {
+        if (m[i].code_off)
+            m[i].code_item.insns = (ushort *)(uintptr_t)
+                ((u1 *)m[i].code_item.insns - dex->map_base);
+    }
+    return off;
+}
+
+static int image_write(const char *path, const u1 *image, size_t size)
+{
+    char tmp[1040];
+    int fd;
+
+    /* write aside and rename, so a concurrent run never maps half an image */
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return -1;
+    while (size > 0) {
+        ssize_t n = write(fd, image, size);
+        if (n <= 0) {
+            close(fd);
+            unlink(tmp);
+            return -1;
+        }
+        image += n;
+        size -= n;
+    }
+    if (close(fd) != 0 || rename(tmp, path) != 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/* link everything and write the image, return 0 on success */
+int image_save(DexFileFormat *dex)
+{
+    const u4 class_count = dex->header.classDefsSize;
+    char path[1024];
+    image_header *h;
+    image_class *ic;
+    u1 *image;
+    u4 size, pos, i;
+    int ret;
+
+    if (sdvm_context_current()->image_dir == NULL)
+        return -1;
+    link_classes(dex);
+    resolve_string_data(dex);
+
+    size = align_image(sizeof(image_header));
+    size += align_image(sizeof(string_data_item) * dex->header.stringIdsSize);
+    size += align_image(sizeof(image_class) * class_count);
+    for (i = 0; i < class_count; i++) {
+        const class_data_item *clazz = &dex->class_data_item[i];
+        size += align_image(sizeof(encoded_field) * clazz->static_fields_size);
+        size += align_image(sizeof(encoded_field) * clazz->instance_fields_size);
+        size += align_image(sizeof(encoded_method) * clazz->direct_methods_size);
+        size += align_image(sizeof(encoded_method) * clazz->virtual_methods_size);
+    }
+
+    image = (u1 *)calloc(1, size);
+    if (image == NULL)
+        return -1;
+    h = (image_header *)image;
+    memcpy(h->magic, IMAGE_MAGIC, sizeof(h->magic));
+    h->version = IMAGE_VERSION;
+    h->layout = IMAGE_LAYOUT;
+    memcpy(h->checksum, dex->header.checksum, sizeof(h->checksum));
+    memcpy(h->signature, dex->header.signature, sizeof(h->signature));
+    h->file_size = dex->header.fileSize;
+    h->string_count = dex->header.stringIdsSize;
+    h->class_count = class_count;
+    h->image_size = size;
+
+    pos = align_image(sizeof(image_header));
+    h->strings_off = pos;
+    pos = align_image(pos + sizeof(string_data_item) * h->string_count);
+    memcpy(image + h->strings_off, dex->string_data_item,
+           sizeof(string_data_item) * h->string_count);
+    h->classes_off = pos;
+    pos = align_image(pos + sizeof(image_class) * class_count);
+
+    ic = (image_class *)(image + h->classes_off);
+    for (i = 0; i < class_count; i++, ic++) {
+        const class_data_item *clazz = &dex->class_data_item[i];
+
+        ic->static_fields_size = clazz->static_fields_size;
+        ic->instance_fields_size = clazz->instance_fields_size;
+        ic->direct_methods_size = clazz->direct_methods_size;
+        ic->virtual_methods_size = clazz->virtual_methods_size;
+        ic->class_inst_size = clazz->class_inst_size;
+        ic->super_index = clazz->super_class ?
+                          (int)(clazz->super_class - dex->class_data_item) : -1;
+        ic->static_fields_off = image_put(image, &pos, clazz->static_fields,
+            sizeof(encoded_field) * clazz->static_fields_size);
+        ic->instance_fields_off = image_put(image, &pos, clazz->instance_fields,
+            sizeof(encoded_field) * clazz->instance_fields_size);
+        ic->direct_methods_off = image_put_methods(dex, image, &pos,
+            clazz->direct_methods, clazz->direct_methods_size);
+        ic->virtual_methods_off = image_put_methods(dex, image, &pos,
+            clazz->virtual_methods, clazz->virtual_methods_size);
+    }
+    assert(pos == size);
+
+    image_path(dex, path, sizeof(path));
+    ret = image_write(path, image, size);
+    free(image);
+    if (ret != 0)
+        printf("Warning! cannot write image %s\n", path);
+    else if (is_verbose())
+        printf("image : wrote %s (%u bytes)\n", path, size);
+    return ret;
+}
@@ -0,0 +1,139 @@
+/*
+ * Simple Dalvik Virtual Machine Implementation
+ *
+ * Copyright (C) 2014 cycheng <createinfinite@yahoo.com.tw>
+ * Copyright (C) 2013 Chun-Yu Wang <wicanr2@gmail.com>
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <unistd.h>
+#include "simple_dvm.h"
+
+/*  Guest standard input, for BufferedReader.readLine
+ *
+ *  fd 0 is read into large chunks, and each line becomes a String whose
+ *  value points right into the chunk, so reading a line costs no copy and
+ *  no malloc. Since there is no GC, a chunk is never reused : once it is
+ *  full, a new one is started and the unfinished line is moved over. Lines
+ *  with non-ASCII bytes are decoded into their own UTF-16 string.
+ */
+#define INPUT_CHUNK_SIZE (256 * 1024)
+
+/* start a new chunk, keeping the unfinished line [pos, end) */
+static void input_new_chunk(input_state *in)
+{
+    const size_t pending = in->end - in->pos;
+    size_t size = INPUT_CHUNK_SIZE;
+    input_chunk *chunk;
+
+    while (size < pending * 2)
+        size *= 2;
+    chunk = (input_chunk *)malloc(sizeof(input_chunk) + size);
+    if (chunk == NULL) {
+        printf("Error! out of memory for stdin buffer\n");
+        abort();
+    }
+    if (pending)
+        memcpy(chunk->data, in->chunk + in->pos, pending);
+    chunk->next = in->chunks;
+    in->chunks = chunk;
+    in->chunk = chunk->data;
+    in->size = size;
+    in->pos = 0;
+    in->end = pending;
+}
+
+/* read more data, return 0 at end of input */
+static int input_fill(input_state *in)
+{
+    ssize_t n;
+
+    if (in->eof)
+        return 0;
+    if (in->chunk == NULL || in->end == in->size)
+        input_new_chunk(in);
+    do {
+        n = read(in->fd, in->chunk + in->end, in->size - in->end);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) {
+        in->eof = 1;
+        return 0;
+    }
+    in->end += n;
+    return 1;
+}
+
+static string_object *input_make_line(const char *line, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        if ((u1)line[i] >= 0x80)
+            return new_string_object_from_utf8(line, len);
+    return new_string_object_ref(line, len, STRING_CODER_LATIN1);
+}
+
+/*  Read one line, without its terminator ('\n', '\r' or "\r\n").
+ *  Return NULL at end of input, like BufferedReader.readLine.
+ */
+string_object *input_read_line(void)
+{
+    input_state *in = &sdvm_context_current()->in;
+    size_t scanned = 0;    /* bytes after pos known to hold no terminator */
+
+    for (;;) {
+        const char *line, *p = NULL;
+
+        if (in->skip_lf && in->pos < in->end) {
+            in->skip_lf = 0;
+            if (in->chunk[in->pos] == '\n')
+                in->pos++;
+        }
+
+        line = in->chunk + in->pos;
+        if (in->pos + scanned < in->end) {
+            const size_t left = in->end - in->pos - scanned;
+            const char *lf = memchr(line + scanned, '\n', left);
+            const char *cr = memchr(line + scanned, '\r',
+                                    lf ? (size_t)(lf - line - scanned) : left);
+            p = cr ? cr : lf;
+        }
+        if (p) {
+            in->pos = p - in->chunk + 1;
+            if (*p == '\r')
+                in->skip_lf = 1;
+            return input_make_line(line, p - line);
+        }
+
+        /* no terminator yet, read more (the line may move to a new chunk) */
+        scanned = in->end - in->pos;
+        if (!input_fill(in)) {
+            if (in->pos == in->end)
+                return NULL;
+            /* last line without a terminator */
+            line = in->chunk + in->pos;
+            in->pos = in->end;
+            return input_make_line(line, in->end - (line - in->chunk));
+        }
+    }
+}
+
+/* has the guest read from stdin yet */
+int input_started(void)
+{
+    return sdvm_context_current()->in.chunk != NULL;
+}
+
+/* free the stdin chunks of 'ctx', the lines read go with them */
+void input_free(sdvm_context *ctx)
+{
+    input_chunk *c = ctx->in.chunks;
+
+    while (c) {
+        input_chunk *next = c->next;
+        free(c);
+        c = next;
+    }
+    memset(&ctx->in, 0, sizeof(input_state));
+}
@@ -5,6 +5,7 @@
  * Copyright (C) 2013 Chun-Yu Wang <wicanr2@gmail.com>
  */
 #include <stdio.h>
+#include <limits.h>
 #include <time.h>
 #include <sys/time.h>
 #include "java_lib.h"
@@ -45,35 +46,17 @@ int java_io_input_stream_reader_init(DexFileFormat *dex, simple_dalvik_vm *vm, c
     return 0;
 }
 
+/* java.io.BufferedReader.readLine, we only read from System.in */
 int java_io_buffered_reader(DexFileFormat *dex, simple_dalvik_vm *vm, char *type) {
-    char *str = NULL;
-    /* %m : http://blog.markloiseau.com/2012/02/two-safer-alternatives-to-scanf/
-     *  => str = malloc(..), so we have to free 'str' by our self
-     */
-    int status = scanf("%ms", &str);
-
-    if (status != 1) {
-        printf("Warning! scanf encounter error\n");
-    }
-
-    sdvm_obj *obj = create_sdvm_obj();
-    obj->ref_count = 1;
-    //load_reg_to(vm, vm->p.reg_idx[0], (u1 *)&obj);
-    //*((long *)&obj->other_data) = val;
-    obj->other_data = str;
+    string_object *obj = input_read_line();
 
-    assert(sizeof(long) == 8);
-    assert(sizeof(obj->other_data) == 8);
-    assert(((u8)obj >> 32) == 0);
-
-    /* save the object reference to result */
+    /* save the object reference (or null at end of stream) to result */
     store_to_bottom_half_result(vm, (u1 *)&obj);
 
     if (is_verbose())
-        printf("    call java_io_buffered_reader (%s), read string = %s\n"
-               "    store obj (%p) to result, other_data = %p\n",
-               type, str, obj, obj->other_data);
-
+        printf("    call java_io_buffered_reader (%s), read %d chars\n"
+               "    store obj (%p) to result\n",
+               type, obj ? (int)obj->count : -1, obj);
     return 0;
 }
 
@@ -83,24 +66,67 @@ int java_lang_exception_print_stack_trace(DexFileFormat *dex, simple_dalvik_vm *
     return 0;
 }
 
-int java_lang_long_valueof(DexFileFormat *dex, simple_dalvik_vm *vm, char *type) {
-    sdvm_obj *obj = NULL;
-    sdvm_obj *newobj = create_sdvm_obj();
+/*  parse the String in register 'reg', 0 on a malformed number or null
+ *  (readLine at the end of input) ; the warning goes to stderr, out of
+ *  the way of the guest's stdout
+ */
+static s8 parse_string_arg(simple_dalvik_vm *vm, int reg, s8 min, s8 max)
+{
+    string_object *obj = NULL;
+    char small[256], *text = small;
+    s8 val = 0;
+    uint size;
+
+    load_reg_to(vm, reg, (u1 *)&obj);
+    if (obj == NULL) {
+        fprintf(stderr, "Warning! NumberFormatException : null\n");
+        return 0;
+    }
+    assert(is_string_object(&obj->obj));
+    if (string_object_parse_long(obj, min, max, &val))
+        return val;
+
+    size = string_object_utf8_size(obj);
+    if (size > sizeof(small))
+        text = (char *)malloc(size);
+    string_object_to_utf8(obj, text);
+    fprintf(stderr, "Warning! NumberFormatException : %.*s\n", (int)size, text);
+    if (text != small)
+        free(text);
+    return 0;
+}
 
-    load_reg_to(vm, vm->p.reg_idx[0], (u1 *)&obj);
+int java_lang_long_valueof(DexFileFormat *dex, simple_dalvik_vm *vm, char *type) {
+    sdvm_obj *newobj = create_sdvm_obj("Ljava/lang/Long;");
+    s8 val = parse_string_arg(vm, vm->p.reg_idx[0], LLONG_MIN, LLONG_MAX);
 
-    char *str = (char *)obj->other_data;
-    long val = strtol(str, NULL, 10);
     newobj->ref_count = 1;
-    *(long *)&newobj->other_data = val;
+    *(s8 *)&newobj->other_data = val;
 
-    //store_long_to_result(vm, (u1 *)&val);
     /* save the object reference to result */
     store_to_bottom_half_result(vm, (u1 *)&newobj);
 
     if (is_verbose())
-        printf("    call java_lang_long_valueof (%s), val = %p, store obj (%p) to result\n",
-               type, newobj->other_data, newobj);
+        printf("    call java_lang_long_valueof (%s), val = %lld, store obj (%p) to result\n",
+               type, val, newobj);
+    return 0;
+}
+
+int java_lang_long_parse_long(DexFileFormat *dex, simple_dalvik_vm *vm, char *type) {
+    s8 val = parse_string_arg(vm, vm->p.reg_idx[0], LLONG_MIN, LLONG_MAX);
+
+    store_long_to_result(vm, (u1 *)&val);
+    if (is_verbose())
+        printf("    call java.lang.Long.parseLong (%s), val = %lld\n", type, val);
+    return 0;
+}
+
+int java_lang_integer_parse_int(DexFileFormat *dex, simple_dalvik_vm *vm, char *type) {
+    int val = (int)parse_string_arg(vm, vm->p.reg_idx[0], INT_MIN, INT_MAX);
+
+    store_to_bottom_half_result(vm, (u1 *)&val);
+    if (is_verbose())
+        printf("    call java.lang.Integer.parseInt (%s), val = %d\n", type, val);
     return 0;
 }
 
@@ -174,8 +200,7 @@ int java_lang_reflect_array_new_instance(DexFileFormat *dex, simple_dalvik_vm *v
     {
         total_size = sizeof(multi_dim_array_object) + sizeof(void *) * num_elem;
 
-        mul_dim_ary_obj = (multi_dim_array_object *)malloc(total_size);
-        memset(mul_dim_ary_obj, 0, total_size);
+        mul_dim_ary_obj = (multi_dim_array_object *)sdvm_heap_alloc(total_size, "[[I");
 
         mul_dim_ary_obj->count = num_elem;
         mul_dim_ary_obj->elem_size = sizeof(void *);
@@ -199,8 +224,7 @@ int java_lang_reflect_array_new_instance(DexFileFormat *dex, simple_dalvik_vm *v
         const int each_1d_total_size = sizeof(new_array_object) + each_1d_size;
 
         for (int j = 0; j < num_elem; j++) {
-            new_array_object *ary_obj = (new_array_object *)malloc(each_1d_total_size);
-            memset(ary_obj, 0, each_1d_total_size);
+            new_array_object *ary_obj = (new_array_object *)sdvm_heap_alloc(each_1d_total_size, "[I");
 
             ary_obj->count = each_1d_num_elem;
             ary_obj->elem_size = elem_size;
@@ -229,26 +253,21 @@ int java_lang_reflect_array_new_instance(DexFileFormat *dex, simple_dalvik_vm *v
  *      move-result v5
  */
 int java_lang_string_char_at(DexFileFormat *dex, simple_dalvik_vm *vm, char *type) {
-    int string_id;
+    string_object *str = NULL;
     int index;
 
-    load_reg_to(vm, vm->p.reg_idx[0], (u1 *)&string_id);
+    load_reg_to(vm, vm->p.reg_idx[0], (u1 *)&str);
     load_reg_to(vm, vm->p.reg_idx[1], (u1 *)&index);
+    assert(is_string_object(&str->obj));
 
-    /* If we hit this assertion, means the string is not const-string, it is
-     * actually a string object, we may need to define an internal string class
-     * to handle it */
-    assert(string_id < dex->header.stringIdsSize);
-
-    const char *str = dex->string_data_item[string_id].data;
-    int val = str[index];
+    int val = string_object_char_at(str, index);
 
     store_to_bottom_half_result(vm, (u1 *)&val);
 
     if (is_verbose()) {
         printf("    call java.lang.String.charAt\n"
-               "    string_id %d, index %d = %c\n",
-               string_id, index, (char)val);
+               "    string %p, index %d = %c\n",
+               str, index, (char)val);
     }
     return 0;
 }
@@ -256,118 +275,325 @@ int java_lang_string_char_at(DexFileFormat *dex, simple_dalvik_vm *vm, char *typ
 /* e.g. invoke-virtual {v8, v9}, Ljava/lang/String;.compareTo:(Ljava/lang/String;)I // method@0027
  */
 int java_lang_string_compare_to(DexFileFormat *dex, simple_dalvik_vm *vm, char *type) {
-    int string_id_1;
-    int string_id_2;
-
-    load_reg_to(vm, vm->p.reg_idx[0], (u1 *)&string_id_1);
-    load_reg_to(vm, vm->p.reg_idx[1], (u1 *)&string_id_2);
+    string_object *str_1 = NULL;
+    string_object *str_2 = NULL;
 
-    /* If we hit this assertion, means the string is not const-string, it is
-     * actually a string object, we may need to define an internal string class
-     * to handle it */
-    assert(string_id_1 < dex->header.stringIdsSize);
-    assert(string_id_2 < dex->header.stringIdsSize);
+    load_reg_to(vm, vm->p.reg_idx[0], (u1 *)&str_1);
+    load_reg_to(vm, vm->p.reg_idx[1], (u1 *)&str_2);
+    assert(is_string_object(&str_1->obj));
+    assert(is_string_object(&str_2->obj));
 
     /* http://www.tutorialspoint.com/java/java_string_compareto.htm */
-    const char *str_1 = dex->string_data_item[string_id_1].data;
-    const char *str_2 = dex->string_data_item[string_id_2].data;
-
-    int val = strcmp(str_1, str_2);
+    int val = string_object_compare_to(str_1, str_2);
     store_to_bottom_half_result(vm, (u1 *)&val);
 
     if (is_verbose()) {
         printf("    call java.lang.String.compareTo\n"
-               "    str_id 1 = 0x%x, str_id 2 = 0x%x, result = %d\n",
-               string_id_1, string_id_2, val);
+               "    str 1 = %p, str 2 = %p, result = %d\n",
+               str_1, str_2, val);
     }
 
     return 0;
 }
 
-/* java.io.PrintStream.println */
-static char buf[1024];
-static int buf_ptr = 0;
-static int use_buf = 0;
-int java_io_print_stream_println(DexFileFormat *dex, simple_dalvik_vm *vm, char *type)
+/* e.g. invoke-virtual {v0, v1}, Ljava/lang/String;.equals:(Ljava/lang/Object;)Z */
+int java_lang_string_equals(DexFileFormat *dex, simple_dalvik_vm *vm, char *type) {
+    string_object *str = NULL;
+    sdvm_obj *other = NULL;
+    int val = FALSE;
+
+    load_reg_to(vm, vm->p.reg_idx[0], (u1 *)&str);
+    load_reg_to(vm, vm->p.reg_idx[1], (u1 *)&other);
+    assert(is_string_object(&str->obj));
+
+    if (is_string_object(other))
+        val = string_object_equals(str, (string_object *)other);
+    store_to_bottom_half_result(vm, (u1 *)&val);
+
+    if (is_verbose()) {
+        printf("    call java.lang.String.equals\n"
+               "    str = %p, other = %p, result = %d\n", str, other, val);
+    }
+    return 0;
+}
+
+int java_lang_string_length(DexFileFormat *dex, simple_dalvik_vm *vm, char *type) {
+    string_object *str = NULL;
+
+    load_reg_to(vm, vm->p.reg_idx[0], (u1 *)&str);
+    assert(is_string_object(&str->obj));
+
+    int val = str->count;
+    store_to_bottom_half_result(vm, (u1 *)&val);
+
+    if (is_verbose())
+        printf("    call java.lang.String.length, str = %p, length = %d\n", str, val);
+    return 0;
+}
+
+int java_lang_string_hash_code(DexFileFormat *dex, simple_dalvik_vm *vm, char *type) {
+    string_object *str = NULL;
+
+    load_reg_to(vm, vm->p.reg_idx[0], (u1 *)&str);
+    assert(is_string_object(&str->obj));
+
+    int val = string_object_hash_code(str);
+    store_to_bottom_half_result(vm, (u1 *)&val);
+
+    if (is_verbose())
+        printf("    call java.lang.String.hashCode, str = %p, hash = %d\n", str, val);
+    return 0;
+}
+
+/*  Format a primitive argument the way String.valueOf does, the value
+ *  starts at register p->reg_idx[idx] (wide values take two).
+ *  'C' is left to the caller, it is a UTF-16 unit rather than text.
+ */
+static int format_primitive_arg(simple_dalvik_vm *vm, const char *type, int idx,
+                                char *out)
 {
     invoke_parameters *p = &vm->p;
-    int i = 0;
-    int string_id = 0;
+
+    switch (type[0]) {
+    case 'Z': {
+        int b = 0;
+        load_reg_to(vm, p->reg_idx[idx], (u1 *)&b);
+        strcpy(out, b ? "true" : "false");
+        return b ? 4 : 5;
+    }
+    case 'J': {
+        s8 val = 0;
+        load_reg_to_long(vm, p->reg_idx[idx], (u1 *)&val + 4);
+        load_reg_to_long(vm, p->reg_idx[idx + 1], (u1 *)&val);
+        return format_long(val, out);
+    }
+    case 'D': {
+        double val = 0;
+        load_reg_to_double(vm, p->reg_idx[idx], (u1 *)&val + 4);
+        load_reg_to_double(vm, p->reg_idx[idx + 1], (u1 *)&val);
+        return format_double(val, out);
+    }
+    case 'F': {
+        float val = 0;
+        load_reg_to(vm, p->reg_idx[idx], (u1 *)&val);
+        return format_float(val, out);
+    }
+    default: {
+        /* I, S, B */
+        int val = 0;
+        load_reg_to(vm, p->reg_idx[idx], (u1 *)&val);
+        return format_int(val, out);
+    }
+    }
+}
+
+/* write a UTF-16 unit as UTF-8 */
+static void print_char(ushort ch)
+{
+    u1 out[3];
+    int len;
+
+    if (ch < 0x80) {
+        out[0] = ch;
+        len = 1;
+    } else if (ch < 0x800) {
+        out[0] = 0xc0 | (ch >> 6);
+        out[1] = 0x80 | (ch & 0x3f);
+        len = 2;
+    } else {
+        out[0] = 0xe0 | (ch >> 12);
+        out[1] = 0x80 | ((ch >> 6) & 0x3f);
+        out[2] = 0x80 | (ch & 0x3f);
+        len = 3;
+    }
+    output_write(out, len);
+}
+
+/* java.lang.String.valueOf, static
+ *  e.g. invoke-static {v0, v1}, Ljava/lang/String;.valueOf:(D)Ljava/lang/String;
+ */
+int java_lang_string_value_of(DexFileFormat *dex, simple_dalvik_vm *vm, char *type)
+{
+    invoke_parameters *p = &vm->p;
+    string_object *str = NULL;
+    char num[NUM_FORMAT_BUF_SIZE];
+
+    assert(type != 0);
+    if (type[0] == 'L' || type[0] == '[') {
+        sdvm_obj *obj = NULL;
+        load_reg_to(vm, p->reg_idx[0], (u1 *)&obj);
+        if (obj == NULL)
+            str = new_string_object_from_utf8("null", 4);
+        else if (is_string_object(obj))
+            str = (string_object *)obj;
+        else
+            printf("Warning! String.valueOf(%s) is not supported\n", type);
+    } else if (type[0] == 'C') {
+        int ch = 0;
+        ushort unit;
+        load_reg_to(vm, p->reg_idx[0], (u1 *)&ch);
+        unit = (ushort)ch;
+        str = new_string_object(&unit, 1, STRING_CODER_UTF16);
+    } else {
+        int len = format_primitive_arg(vm, type, 0, num);
+        str = new_string_object(num, len, STRING_CODER_LATIN1);
+    }
+
     if (is_verbose())
-        printf("    call java.io.PrintStream.println\n");
-
-    load_reg_to(vm, p->reg_idx[1], (unsigned char *) &string_id);
-    if (use_buf == 1) {
-        printf("%s\n", buf);
-        use_buf = 0;
-        memset(buf, 0, 1024);
-        buf_ptr = 0;
+        printf("    call java.lang.String.valueOf (%s), obj %p\n", type, str);
+    store_to_bottom_half_result(vm, (u1 *)&str);
+    return 0;
+}
+
+/* java.io.PrintStream.print / println */
+static int print_stream_print(simple_dalvik_vm *vm, char *type, int newline)
+{
+    invoke_parameters *p = &vm->p;
+    char num[NUM_FORMAT_BUF_SIZE];
+
+    if (type == 0) {
+        /* println() */
+    } else if (type[0] == 'L' || type[0] == '[') {
+        sdvm_obj *obj = NULL;
+        load_reg_to(vm, p->reg_idx[1], (unsigned char *) &obj);
+        if (obj == NULL)
+            output_write("null", 4);
+        else if (is_string_object(obj))
+            print_string_object((string_object *)obj);
+    } else if (type[0] == 'C') {
+        int ch = 0;
+        load_reg_to(vm, p->reg_idx[1], (u1 *)&ch);
+        print_char((ushort)ch);
     } else {
-        printf("%s\n", get_string_data(dex, string_id));
+        int len = format_primitive_arg(vm, type, 1, num);
+        output_write(num, len);
     }
+    if (newline)
+        output_write("\n", 1);
     return 0;
 }
 
+int java_io_print_stream_println(DexFileFormat *dex, simple_dalvik_vm *vm, char *type)
+{
+    if (is_verbose())
+        printf("    call java.io.PrintStream.println (%s)\n", type);
+    return print_stream_print(vm, type, TRUE);
+}
+
+int java_io_print_stream_print(DexFileFormat *dex, simple_dalvik_vm *vm, char *type)
+{
+    if (is_verbose())
+        printf("    call java.io.PrintStream.print (%s)\n", type);
+    return print_stream_print(vm, type, FALSE);
+}
+
 int java_io_print_stream_flush(DexFileFormat *dex, simple_dalvik_vm *vm, char *type) {
     if (is_verbose())
         printf("    call java.io.PrintStream.flush\n");
 
-    fflush(stdout);
+    output_flush();
     return 0;
 }
 
-/* java.lang.StringBuilder.<init> */
+/* java.lang.StringBuilder.<init>
+ *  new-instance already allocated a string_builder_object for us (see
+ *  class_table), here we only set up its buffer.
+ *  e.g. invoke-direct {v0}, Ljava/lang/StringBuilder;.<init>:()V
+ *       invoke-direct {v0, v1}, Ljava/lang/StringBuilder;.<init>:(Ljava/lang/String;)V
+ */
 int java_lang_string_builder_init(DexFileFormat *dex, simple_dalvik_vm *vm, char *type)
 {
     invoke_parameters *p = &vm->p;
+    string_builder_object *sb = NULL;
+
+    load_reg_to(vm, p->reg_idx[0], (u1 *)&sb);
+    assert(sb->obj.other_data == (void *)ICT_STRING_BUILDER_OBJ);
+
+    if (type != 0 && strcmp(type, "I") == 0) {
+        int capacity = 0;
+        load_reg_to(vm, p->reg_idx[1], (u1 *)&capacity);
+        string_builder_init(sb, capacity > 0 ? capacity : 0);
+    } else if (type != 0) {
+        string_object *str = NULL;
+        load_reg_to(vm, p->reg_idx[1], (u1 *)&str);
+        assert(is_string_object(&str->obj));
+        string_builder_init(sb, str->count + 16);
+        string_builder_append_string(sb, str);
+    } else {
+        string_builder_init(sb, 16);
+    }
+
     if (is_verbose())
-        printf("    call java.lang.StringBuilder.<init>\n");
-    memset(buf, 0, 1024);
-    buf_ptr = 0;
+        printf("    call java.lang.StringBuilder.<init> (%s), obj %p\n", type, sb);
     return 0;
 }
 
 int java_lang_string_builder_append(DexFileFormat *dex, simple_dalvik_vm *vm, char *type)
 {
     invoke_parameters *p = &vm->p;
+    string_builder_object *sb = NULL;
+    char num[NUM_FORMAT_BUF_SIZE];
+
     if (is_verbose())
-        printf("    call java.lang.StringBuilder.append\n");
+        printf("    call java.lang.StringBuilder.append (%s)\n", type);
 
     assert(p->reg_count == 2 || p->reg_count == 3);
+    load_reg_to(vm, p->reg_idx[0], (u1 *)&sb);
+    assert(sb->obj.other_data == (void *)ICT_STRING_BUILDER_OBJ);
 
     if (type != 0) {
-        if (strcmp(type, "Ljava/lang/String;") == 0) {
-            int string_id = 0;
-            load_reg_to(vm, p->reg_idx[1], (unsigned char *) &string_id);
-            buf_ptr += snprintf(buf + buf_ptr, 1024, "%s", get_string_data(dex, string_id));
+        if (type[0] == 'L' || type[0] == '[') {
+            sdvm_obj *obj = NULL;
+            load_reg_to(vm, p->reg_idx[1], (unsigned char *) &obj);
+            if (obj == NULL)
+                string_builder_append_latin1(sb, "null", 4);
+            else if (is_string_object(obj))
+                string_builder_append_string(sb, (string_object *)obj);
+            else
+                printf("Warning! StringBuilder.append(%s) is not supported\n", type);
+
+        } else if (strcmp(type, "C") == 0) {
+            int ch = 0;
+            load_reg_to(vm, p->reg_idx[1], (u1 *)&ch);
+            string_builder_append_char(sb, (ushort)ch);
 
         } else {
-            int val[2] = {0, 0};
+            int len = format_primitive_arg(vm, type, 1, num);
+            string_builder_append_latin1(sb, num, len);
+        }
+    }
 
-            if (p->reg_count == 2) {
-                load_reg_to(vm, p->reg_idx[1], (u1 *) &val[0]);
-                buf_ptr += snprintf(buf + buf_ptr, 1024, "%d", val[0]);
+    /* append() returns this */
+    store_to_bottom_half_result(vm, (u1 *)&sb);
+    return 0;
+}
 
-            } else {
-                load_reg_to_long(vm, p->reg_idx[1], (u1 *) &val[1]);
-                load_reg_to_long(vm, p->reg_idx[2], (u1 *) &val[0]);
-                buf_ptr += snprintf(buf + buf_ptr, 1024, "%lld", *(u8 *)&val);
-            }
+int java_lang_string_builder_length(DexFileFormat *dex, simple_dalvik_vm *vm, char *type)
+{
+    string_builder_object *sb = NULL;
 
-            /*if (strcmp(type, "I") == 0) {
-                buf_ptr += snprintf(buf + buf_ptr, 1024, "%d", string_id);
-            }*/
-        }
-    }
+    load_reg_to(vm, vm->p.reg_idx[0], (u1 *)&sb);
+    assert(sb->obj.other_data == (void *)ICT_STRING_BUILDER_OBJ);
+
+    int val = sb->count;
+    store_to_bottom_half_result(vm, (u1 *)&val);
+
+    if (is_verbose())
+        printf("    call java.lang.StringBuilder.length, obj %p, length = %d\n", sb, val);
     return 0;
 }
 
 int java_lang_string_builder_to_string(DexFileFormat *dex, simple_dalvik_vm *vm, char *type)
 {
-    invoke_parameters *p = &vm->p;
+    string_builder_object *sb = NULL;
+
+    load_reg_to(vm, vm->p.reg_idx[0], (u1 *)&sb);
+    assert(sb->obj.other_data == (void *)ICT_STRING_BUILDER_OBJ);
+
+    string_object *str = string_builder_to_string(sb);
     if (is_verbose())
-        printf("    call java.lang.StringBuilder.toString\n");
-    use_buf = 1;
+        printf("    call java.lang.StringBuilder.toString (obj %p -> %p)\n", sb, str);
+    store_to_bottom_half_result(vm, (u1 *)&str);
     return 0;
 }
 
@@ -396,22 +622,48 @@ static java_lang_method method_table[] = {
     {"Ljava/io/BufferedReader;",  "readLine", java_io_buffered_reader},
     {"Ljava/io/InputStreamReader;","<init>",  java_io_input_stream_reader_init},
     {"Ljava/io/PrintStream;",     "println",  java_io_print_stream_println},
-    {"Ljava/io/PrintStream;",     "print",    java_io_print_stream_println},
+    {"Ljava/io/PrintStream;",     "print",    java_io_print_stream_print},
     {"Ljava/io/PrintStream;",     "flush",    java_io_print_stream_flush},
     {"Ljava/lang/Exception;",     "printStackTrace", java_lang_exception_print_stack_trace },
+    {"Ljava/lang/Integer;",       "parseInt", java_lang_integer_parse_int},
+    {"Ljava/lang/Long;",          "parseLong",java_lang_long_parse_long},
     {"Ljava/lang/Long;",          "valueOf",  java_lang_long_valueof},
     {"Ljava/lang/Long;",          "longValue",java_lang_long_long_value},
     {"Ljava/lang/reflect/Array;", "newInstance", java_lang_reflect_array_new_instance },
     {"Ljava/lang/String;",        "charAt",   java_lang_string_char_at },
     {"Ljava/lang/String;",        "compareTo",java_lang_string_compare_to },
+    {"Ljava/lang/String;",        "equals",   java_lang_string_equals },
+    {"Ljava/lang/String;",        "hashCode", java_lang_string_hash_code },
+    {"Ljava/lang/String;",        "length",   java_lang_string_length },
+    {"Ljava/lang/String;",        "valueOf",  java_lang_string_value_of },
     {"Ljava/lang/StringBuilder;", "<init>",   java_lang_string_builder_init},
     {"Ljava/lang/StringBuilder;", "append",   java_lang_string_builder_append},
+    {"Ljava/lang/StringBuilder;", "length",   java_lang_string_builder_length},
     {"Ljava/lang/StringBuilder;", "toString", java_lang_string_builder_to_string},
     {"Ljava/lang/System;",        "currentTimeMillis",      java_lang_system_currenttimemillis}
 };
 
 static int java_lang_method_size = sizeof(method_table) / sizeof(java_lang_method);
 
+/* framework classes which need more than a bare sdvm_obj on new-instance */
+static java_lang_class class_table[] = {
+    {"Ljava/lang/StringBuilder;", sizeof(string_builder_object), ICT_STRING_BUILDER_OBJ}
+};
+
+static int java_lang_class_size = sizeof(class_table) / sizeof(java_lang_class);
+
+uint get_java_lang_class_inst_size(const char *cls_name, internal_class_type *type)
+{
+    int i = 0;
+    for (i = 0; i < java_lang_class_size; i++)
+        if (strcmp(cls_name, class_table[i].clzname) == 0) {
+            *type = class_table[i].type;
+            return class_table[i].inst_size;
+        }
+    *type = 0;
+    return sizeof(sdvm_obj);
+}
+
 java_lang_method *find_java_lang_method(char *cls_name, char *method_name)
 {
     int i = 0;
@@ -427,9 +679,19 @@ int invoke_java_lang_library(DexFileFormat *dex, simple_dalvik_vm *vm,
 {
     java_lang_method *method = find_java_lang_method(cls_name, method_name);
     if (method != 0) {
+        sdvm_context_current()->stats.natives++;
         if (is_verbose())
             printf("    invoke %s/%s %s\n", method->clzname, method->methodname, type);
-        method->method_runtime(dex, vm, type);
+        const u8 start = timeline_on ? stats_now_ns() : 0;
+        if (callgraph_on) {
+            callgraph_enter_native(method, method->clzname, method->methodname);
+            method->method_runtime(dex, vm, type);
+            callgraph_leave();
+        } else {
+            method->method_runtime(dex, vm, type);
+        }
+        if (start)
+            timeline_native(method->clzname, method->methodname, start);
         return 1;
     } else {
         printf("    Warning ! The method %s/%s is not found!\n", method->clzname, method->methodname);
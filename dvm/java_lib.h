@@ -17,6 +17,14 @@ typedef struct _java_lang_method {
     java_lang_lib method_runtime;
 } java_lang_method;
 
+typedef struct _java_lang_class {
+    char *clzname;
+    uint inst_size;
+    internal_class_type type;
+} java_lang_class;
+
+uint get_java_lang_class_inst_size(const char *cls_name, internal_class_type *type);
+
 int invoke_java_lang_library(DexFileFormat *dex, simple_dalvik_vm *vm,
                              char *cls_name, char *method_name, char *type);
 
@@ -9,22 +9,215 @@
 #include <string.h>
 #include "simple_dvm.h"
 
+#define MAX_DEX_FILES 64
+
+static void usage(const char *prog)
+{
+    printf("%s [options] [dex_file] [verbose]\n", prog);
+    printf("%s --zygote=SOCKET [options] dex_file...\n", prog);
+    printf("%s --connect=SOCKET [--entry=NAME] [dex_file]\n", prog);
+    printf("%s --batch=MANIFEST [--jobs=N] [options] [verbose]\n", prog);
+    printf("  --entry=NAME              run the static method NAME (default main)\n");
+    printf("  --zygote=SOCKET           preload the dex files, fork a job per connection\n");
+    printf("  --connect=SOCKET          run a job in the zygote listening on SOCKET\n");
+    printf("  --batch=MANIFEST          run every 'dex [entry [input [output]]]' line\n");
+    printf("  --jobs=N                  batch worker threads (default : one per CPU)\n");
+    printf("  --iterations=N            load once, run the entry N times, time each run\n");
+    printf("  --warmup=M                unmeasured runs before the iterations\n");
+    printf("                            (not with --trace or --boot-image)\n");
+    printf("  --reset-statics           a fresh instance (statics, <clinit>) every run\n");
+    printf("  --stdout=line|full|async  guest stdout buffering\n");
+    printf("  --stdout-buffer=BYTES     guest stdout buffer size (default %d)\n",
+           OUTPUT_DEFAULT_SIZE);
+    printf("  --parse-threads=N         dex loader threads (default : one per CPU)\n");
+    printf("  --image-cache=DIR         load / save pre-linked images in DIR\n");
+    printf("  --boot-image=FILE         load / save the heap after class initialization\n");
+    printf("  --max-insns=N             abort a run after N instructions\n");
+    printf("  --max-time=SECONDS        abort a run after SECONDS\n");
+    printf("  --profile=FILE            sample the guest stack, write folded stacks\n");
+    printf("  --profile-hz=N            samples per CPU second (default 1000)\n");
+    printf("  --callgraph=FILE          time every call, write a callgrind profile\n");
+    printf("  --alloc-profile=FILE      account allocations to sites and types\n");
+    printf("  --alloc-sample=BYTES      record one allocation every BYTES (default all)\n");
+    printf("  --stats=FILE              write runtime statistics as JSON at exit\n");
+    printf("  --timeline=FILE           write a Chrome trace event timeline at exit\n");
+    printf("  --timeline-min-us=N       shortest method or native on it (default 100)\n");
+    printf("  --trace=FILE              write a binary trace of the run (see dvm-trace)\n");
+    printf("  --trace-ring=N            keep only the last N trace records\n");
+    printf("  --trace-regs              trace the registers each instruction changes\n");
+    printf("  --perf-counters           hardware counters of parse, init and execute\n");
+    printf("  --opstats=FILE            opcode histograms (make OPSTATS=1 builds)\n");
+}
+
 int main(int argc, char *argv[])
 {
     DexFileFormat dex;
     simple_dalvik_vm vm;
-    int x = 0;
+    char *args[MAX_DEX_FILES];
+    int arg_count = 0;
+    char *entry = "main";
+    char *zygote = NULL;
+    char *connect_to = NULL;
+    char *boot_image = NULL;
+    char *batch = NULL;
+    int jobs = 0;
+    int iterations = 0;
+    int warmup = 0;
+    int reset_statics = 0;
+    int perf_counters = 0;
+    int out_mode = OUTPUT_DEFAULT;
+    long out_size = 0;
+    int parse_threads = 0;
+    char *profile = NULL;
+    int profile_hz = 1000;
+    char *alloc_profile = NULL;
+    long alloc_sample = 0;
+    char *timeline = NULL;
+    long timeline_min_us = -1;
+    char *trace = NULL;
+    long trace_ring = 0;
+    int trace_regs = 0;
+    int ret;
+    int i;
 
     memset(&dex, 0, sizeof(DexFileFormat));
-    if (argc < 2) {
-        printf("%s [dex_file] \n", argv[0]);
+    for (i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--stdout=", 9) == 0) {
+            out_mode = output_parse_mode(argv[i] + 9);
+            if (out_mode < 0) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (strncmp(argv[i], "--stdout-buffer=", 16) == 0) {
+            out_size = atol(argv[i] + 16);
+            if (out_size <= 0) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (strncmp(argv[i], "--parse-threads=", 16) == 0) {
+            parse_threads = atoi(argv[i] + 16);
+            if (parse_threads <= 0) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (strncmp(argv[i], "--image-cache=", 14) == 0) {
+            image_init(argv[i] + 14);
+        } else if (strncmp(argv[i], "--boot-image=", 13) == 0) {
+            boot_image = argv[i] + 13;
+            boot_image_init(boot_image);
+        } else if (strncmp(argv[i], "--max-insns=", 12) == 0) {
+            sdvm_context_current()->insn_limit = strtoull(argv[i] + 12, NULL, 10);
+        } else if (strncmp(argv[i], "--max-time=", 11) == 0) {
+            sdvm_context_current()->time_limit_ns = (u8)(atof(argv[i] + 11) * 1e9);
+        } else if (strncmp(argv[i], "--profile=", 10) == 0) {
+            profile = argv[i] + 10;
+        } else if (strncmp(argv[i], "--profile-hz=", 13) == 0) {
+            profile_hz = atoi(argv[i] + 13);
+        } else if (strncmp(argv[i], "--alloc-profile=", 16) == 0) {
+            alloc_profile = argv[i] + 16;
+        } else if (strncmp(argv[i], "--alloc-sample=", 15) == 0) {
+            alloc_sample = atol(argv[i] + 15);
+        } else if (strncmp(argv[i], "--stats=", 8) == 0) {
+            stats_start(argv[i] + 8);
+        } else if (strncmp(argv[i], "--callgraph=", 12) == 0) {
+            callgraph_start(argv[i] + 12);
+        } else if (strncmp(argv[i], "--timeline=", 11) == 0) {
+            timeline = argv[i] + 11;
+        } else if (strncmp(argv[i], "--timeline-min-us=", 18) == 0) {
+            timeline_min_us = atol(argv[i] + 18);
+        } else if (strncmp(argv[i], "--trace=", 8) == 0) {
+            trace = argv[i] + 8;
+        } else if (strncmp(argv[i], "--trace-ring=", 13) == 0) {
+            trace_ring = atol(argv[i] + 13);
+        } else if (strcmp(argv[i], "--trace-regs") == 0) {
+            trace_regs = 1;
+        } else if (strcmp(argv[i], "--perf-counters") == 0) {
+            perf_counters = 1;
+        } else if (strncmp(argv[i], "--opstats=", 10) == 0) {
+            if (opstats_init(argv[i] + 10) != 0)
+                return 1;
+        } else if (strncmp(argv[i], "--entry=", 8) == 0) {
+            entry = argv[i] + 8;
+        } else if (strncmp(argv[i], "--zygote=", 9) == 0) {
+            zygote = argv[i] + 9;
+        } else if (strncmp(argv[i], "--connect=", 10) == 0) {
+            connect_to = argv[i] + 10;
+        } else if (strncmp(argv[i], "--batch=", 8) == 0) {
+            batch = argv[i] + 8;
+        } else if (strncmp(argv[i], "--jobs=", 7) == 0) {
+            jobs = atoi(argv[i] + 7);
+            if (jobs <= 0) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (strncmp(argv[i], "--iterations=", 13) == 0) {
+            iterations = atoi(argv[i] + 13);
+            if (iterations <= 0) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (strncmp(argv[i], "--warmup=", 9) == 0) {
+            warmup = atoi(argv[i] + 9);
+            if (warmup < 0) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--reset-statics") == 0) {
+            reset_statics = 1;
+        } else if (strncmp(argv[i], "--", 2) == 0) {
+            usage(argv[0]);
+            return 1;
+        } else if (arg_count < MAX_DEX_FILES) {
+            args[arg_count++] = argv[i];
+        }
+    }
+
+    /* the repeated runs share one parse, traces and boot images are per run */
+    if ((iterations > 0 || warmup > 0) && (trace || boot_image)) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (connect_to)
+        return zygote_connect(connect_to, arg_count ? args[0] : NULL, entry);
+    if (profile && sampler_start(profile, profile_hz) != 0)
+        return 1;
+    if (timeline)
+        timeline_start(timeline, timeline_min_us);
+    if (alloc_profile && allocprof_start(alloc_profile, alloc_sample) != 0)
+        return 1;
+    if (batch) {
+        if (arg_count > 0)
+            set_verbose(atoi(args[0]));
+        thread_pool_init(parse_threads);
+        output_init(out_mode, out_size);
+        return batch_run(batch, jobs) != 0;
+    }
+    if (arg_count == 0) {
+        usage(argv[0]);
         return 0;
     }
-    if (argc >= 3)
-        set_verbose(atoi(argv[2]));
-    parseDexFile(argv[1], &dex);
+    /* the counters only see this thread, the dex is parsed in it alone */
+    thread_pool_init(perf_counters ? 1 : parse_threads);
+    /* the zygote's jobs set up their own stdout */
+    if (zygote)
+        return zygote_serve(zygote, args, arg_count, entry, out_mode, out_size) != 0;
+
+    if (arg_count > 1)
+        set_verbose(atoi(args[1]));
+    output_init(out_mode, out_size);
+    /* not in batch or zygote jobs */
+    if (perf_counters)
+        perfctr_start();
+    if (iterations > 0 || warmup > 0)
+        return repeat_run(args[0], entry, iterations, warmup, reset_statics) != 0;
+    if (parseDexFile(args[0], &dex) != 0)
+        return 1;
     if (is_verbose() > 3) printDexFile(&dex);
-    simple_dvm_startup(&dex, &vm, "main");
+    /* a single run only, the jobs of a batch or a zygote are not traced */
+    if (trace && trace_open(sdvm_context_current(), trace, trace_ring, trace_regs) != 0)
+        return 1;
+    ret = simple_dvm_startup(&dex, &vm, entry);
+    sampler_flush(&dex);
 
-    return 0;
+    return ret != 0;
 }
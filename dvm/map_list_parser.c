@@ -60,16 +60,11 @@ static void parse_type_list(DexFileFormat *dex,
     memcpy(&dex->type_list.size , buf + offset, 4);
     if (is_verbose() > 3)
         printf("type_list size = %d\n", dex->type_list.size);
-    if (dex->type_list.size > 0) {
-        dex->type_list.type_item = malloc(sizeof(type_item) * dex->type_list.size);
-        for (i = 0 ; i < dex->type_list.size; i++) {
-            memcpy(&dex->type_list.type_item[i],
-                   buf + offset + 4 + (sizeof(type_item) * i),
-                   sizeof(type_item));
-            if (is_verbose() > 3)
-                printf("type_list[%d], type_idx = %d\n", i,
-                       dex->type_list.type_item[i].type_idx);
-        }
+    dex->type_list.type_item = (type_item *)(buf + offset + 4);
+    if (is_verbose() > 3) {
+        for (i = 0 ; i < dex->type_list.size; i++)
+            printf("type_list[%d], type_idx = %d\n", i,
+                   dex->type_list.type_item[i].type_idx);
     }
 }
 
@@ -12,21 +12,16 @@ void parse_method_ids(DexFileFormat *dex, unsigned char *buf, int offset)
     int i = 0;
     if (is_verbose() > 3)
         printf("parse method ids offset = %04x\n", (uint)(offset + sizeof(DexHeader)));
-    dex->method_id_item = malloc(
-                              sizeof(method_id_item) * dex->header.methodIdsSize);
+    dex->method_id_item = (method_id_item *)(buf + offset);
 
     for (i = 0 ; i < dex->header.methodIdsSize ; i++) {
-        memcpy(&dex->method_id_item[i],
-               buf + i * sizeof(method_id_item) + offset,
-               sizeof(method_id_item));
-
         if (is_verbose() > 3)
             printf(" method[%d], cls_id = %d, proto_id = %d, name_id = %d, %s\n",
                    i,
                    dex->method_id_item[i].class_idx,
                    dex->method_id_item[i].proto_idx,
                    dex->method_id_item[i].name_idx,
-                   dex->string_data_item[dex->method_id_item[i].name_idx].data);
+                   get_string_data(dex, dex->method_id_item[i].name_idx));
     }
 }
 
@@ -37,6 +32,29 @@ method_id_item *get_method_item(DexFileFormat *dex, int method_id)
     return 0;
 }
 
+/* "Lpkg/Class;.name(params)ret" into 'out', for reports */
+void get_method_full_name(DexFileFormat *dex, int method_id, char *out, size_t size)
+{
+    const method_id_item *m = get_method_item(dex, method_id);
+    const type_list *params;
+    size_t n;
+    uint i;
+
+    if (m == 0) {
+        snprintf(out, size, "method@%04x", method_id);
+        return;
+    }
+    params = get_proto_type_list(dex, m->proto_idx);
+    n = snprintf(out, size, "%s.%s(", get_type_item_name(dex, m->class_idx),
+                 get_string_data(dex, m->name_idx));
+    for (i = 0; params && i < params->size && n < size; i++)
+        n += snprintf(out + n, size - n, "%s",
+                      get_type_item_name(dex, params->type_item[i].type_idx));
+    if (n < size)
+        snprintf(out + n, size - n, ")%s",
+                 get_type_item_name(dex, get_proto_item(dex, m->proto_idx)->return_type_idx));
+}
+
 int get_method_name(DexFileFormat *dex, int method_id, char *name)
 {
     method_id_item *m = get_method_item(dex, method_id);
@@ -0,0 +1,460 @@
+/*
+ * Simple Dalvik Virtual Machine Implementation
+ *
+ * Copyright (C) 2014 cycheng <createinfinite@yahoo.com.tw>
+ * Copyright (C) 2013 Chun-Yu Wang <wicanr2@gmail.com>
+ */
+
+#include "simple_dvm.h"
+
+/*  Number to decimal string conversion, used by StringBuilder.append,
+ *  String.valueOf and PrintStream.print*, so we don't go through snprintf.
+ *
+ *  All functions write a NUL terminated string into 'out' and return its
+ *  length. 'out' must hold NUM_FORMAT_BUF_SIZE bytes.
+ */
+
+static const char digit_pairs[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+/* write the digits of v backwards, ending at 'end', return the first char */
+static char *format_u64_backward(u8 v, char *end)
+{
+    char *p = end;
+    while (v >= 100) {
+        const uint i = (uint)(v % 100) * 2;
+        v /= 100;
+        *--p = digit_pairs[i + 1];
+        *--p = digit_pairs[i];
+    }
+    if (v >= 10) {
+        const uint i = (uint)v * 2;
+        *--p = digit_pairs[i + 1];
+        *--p = digit_pairs[i];
+    } else {
+        *--p = (char)('0' + v);
+    }
+    return p;
+}
+
+static int format_u64_sign(u8 v, int negative, char *out)
+{
+    char tmp[24];
+    char *end = tmp + sizeof(tmp);
+    char *p = format_u64_backward(v, end);
+    int len = 0;
+
+    if (negative)
+        out[len++] = '-';
+    memcpy(out + len, p, end - p);
+    len += end - p;
+    out[len] = '\0';
+    return len;
+}
+
+int format_int(int v, char *out)
+{
+    /* negate as unsigned, so INT_MIN works too */
+    if (v < 0)
+        return format_u64_sign(0u - (uint)v, TRUE, out);
+    return format_u64_sign((uint)v, FALSE, out);
+}
+
+int format_long(s8 v, char *out)
+{
+    if (v < 0)
+        return format_u64_sign(0ull - (u8)v, TRUE, out);
+    return format_u64_sign((u8)v, FALSE, out);
+}
+
+/*  Shortest round-trip digits for float/double
+ *
+ *  This is the exact "free-format" digit generation of Steele & White /
+ *  Burger & Dybvig : v and its rounding interval are scaled into big
+ *  integers r/s, m+/s, m-/s and digits are produced until the remaining
+ *  value falls inside the interval. It gives the same digits as Ryu or
+ *  Schubfach (the shortest decimal that rounds back to v, the closest one
+ *  on ties) without their large power tables. Integral values below 2^53,
+ *  by far the most common case, take a fast path.
+ */
+#define BIGNUM_LIMBS 40     /* 1280 bits, enough for any double */
+
+typedef struct _bignum {
+    int n;
+    u4 d[BIGNUM_LIMBS];
+} bignum;
+
+static void bn_set_u64(bignum *a, u8 v)
+{
+    a->n = 0;
+    while (v) {
+        a->d[a->n++] = (u4)v;
+        v >>= 32;
+    }
+}
+
+static void bn_mul_small(bignum *a, u4 m)
+{
+    u8 carry = 0;
+    int i;
+    for (i = 0; i < a->n; i++) {
+        const u8 t = (u8)a->d[i] * m + carry;
+        a->d[i] = (u4)t;
+        carry = t >> 32;
+    }
+    if (carry) {
+        assert(a->n < BIGNUM_LIMBS);
+        a->d[a->n++] = (u4)carry;
+    }
+}
+
+static void bn_mul_pow10(bignum *a, int k)
+{
+    static const u4 pow10[10] = {
+        1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000,
+        1000000000
+    };
+    while (k >= 9) {
+        bn_mul_small(a, pow10[9]);
+        k -= 9;
+    }
+    if (k > 0)
+        bn_mul_small(a, pow10[k]);
+}
+
+static void bn_shl(bignum *a, int bits)
+{
+    const int words = bits / 32;
+    const int shift = bits % 32;
+    int i;
+
+    if (a->n == 0)
+        return;
+    assert(a->n + words + 1 <= BIGNUM_LIMBS);
+    a->d[a->n + words] = 0;
+    for (i = a->n - 1; i >= 0; i--) {
+        if (shift)
+            a->d[i + words + 1] |= a->d[i] >> (32 - shift);
+        a->d[i + words] = a->d[i] << shift;
+    }
+    for (i = 0; i < words; i++)
+        a->d[i] = 0;
+    a->n += words + 1;
+    while (a->n > 0 && a->d[a->n - 1] == 0)
+        a->n--;
+}
+
+static int bn_cmp(const bignum *a, const bignum *b)
+{
+    int i;
+    if (a->n != b->n)
+        return a->n > b->n ? 1 : -1;
+    for (i = a->n - 1; i >= 0; i--)
+        if (a->d[i] != b->d[i])
+            return a->d[i] > b->d[i] ? 1 : -1;
+    return 0;
+}
+
+/* r = a + b */
+static void bn_add(bignum *r, const bignum *a, const bignum *b)
+{
+    const bignum *big = a->n >= b->n ? a : b;
+    const bignum *small = a->n >= b->n ? b : a;
+    u8 carry = 0;
+    int i;
+
+    for (i = 0; i < big->n; i++) {
+        const u8 t = (u8)big->d[i] + (i < small->n ? small->d[i] : 0) + carry;
+        r->d[i] = (u4)t;
+        carry = t >> 32;
+    }
+    r->n = big->n;
+    if (carry) {
+        assert(r->n < BIGNUM_LIMBS);
+        r->d[r->n++] = (u4)carry;
+    }
+}
+
+/* a -= b, requires a >= b */
+static void bn_sub(bignum *a, const bignum *b)
+{
+    s8 borrow = 0;
+    int i;
+    for (i = 0; i < a->n; i++) {
+        s8 t = (s8)a->d[i] - (i < b->n ? b->d[i] : 0) - borrow;
+        borrow = t < 0;
+        a->d[i] = (u4)(t + (borrow << 32));
+    }
+    while (a->n > 0 && a->d[a->n - 1] == 0)
+        a->n--;
+}
+
+/* r = a - b when a >= b, else b - a */
+static void bn_abs_diff(bignum *r, const bignum *a, const bignum *b)
+{
+    if (bn_cmp(a, b) >= 0) {
+        *r = *a;
+        bn_sub(r, b);
+    } else {
+        *r = *b;
+        bn_sub(r, a);
+    }
+}
+
+/* q = a / b (q < 10 by construction), a = a % b */
+static int bn_divmod_small(bignum *a, const bignum *b)
+{
+    int q = 0;
+    while (bn_cmp(a, b) >= 0) {
+        bn_sub(a, b);
+        q++;
+    }
+    return q;
+}
+
+/*  Generate the shortest digits of f * 2^e (f > 0) into 'digits', return the
+ *  digit count and set *k so that v = 0.d1d2...dn * 10^k.
+ *  'lower_gap_half' is set when f is a power of two (and not the smallest
+ *  exponent) : the next lower value is then only half an ulp away.
+ */
+static int shortest_digits(u8 f, int e, int lower_gap_half, char *digits, int *k)
+{
+    bignum r, s, mp, mm, t, v0, mp0, mm0;
+    const int even = (f & 1) == 0;
+    int n = 0, est, bits = 0;
+    double lg;
+    u8 tmp;
+
+    /*  v = r / s, upper bound = (r + mp) / s, lower bound = (r - mm) / s,
+     *  everything scaled by 2 (or 4) to keep the half-ulp bounds integral */
+    if (e >= 0) {
+        bn_set_u64(&r, f);
+        bn_shl(&r, e + (lower_gap_half ? 2 : 1));
+        bn_set_u64(&s, lower_gap_half ? 4 : 2);
+        bn_set_u64(&mp, 1);
+        bn_shl(&mp, e + (lower_gap_half ? 1 : 0));
+        bn_set_u64(&mm, 1);
+        bn_shl(&mm, e);
+    } else {
+        bn_set_u64(&r, f);
+        bn_shl(&r, lower_gap_half ? 2 : 1);
+        bn_set_u64(&s, 1);
+        bn_shl(&s, -e + (lower_gap_half ? 2 : 1));
+        bn_set_u64(&mp, lower_gap_half ? 2 : 1);
+        bn_set_u64(&mm, 1);
+    }
+
+    /* estimate k = ceil(log10(high bound)) from the bit length, it is
+     * either exact or one too small */
+    for (tmp = f; tmp; tmp >>= 1)
+        bits++;
+    lg = (bits + e - 1) * 0.30102999566398114;
+    est = (int)lg;
+    if (est > lg)
+        est--;
+    est++;
+    if (est > 0) {
+        bn_mul_pow10(&s, est);
+    } else if (est < 0) {
+        bn_mul_pow10(&r, -est);
+        bn_mul_pow10(&mp, -est);
+        bn_mul_pow10(&mm, -est);
+    }
+    bn_add(&t, &r, &mp);
+    if (even ? bn_cmp(&t, &s) >= 0 : bn_cmp(&t, &s) > 0) {
+        est++;
+        bn_mul_small(&s, 10);
+    }
+    *k = est;
+    v0 = r;
+    mp0 = mp;
+    mm0 = mm;
+
+    for (;;) {
+        int d, low, high;
+
+        bn_mul_small(&r, 10);
+        bn_mul_small(&mp, 10);
+        bn_mul_small(&mm, 10);
+        d = bn_divmod_small(&r, &s);
+
+        low = even ? bn_cmp(&r, &mm) <= 0 : bn_cmp(&r, &mm) < 0;
+        bn_add(&t, &r, &mp);
+        high = even ? bn_cmp(&t, &s) >= 0 : bn_cmp(&t, &s) > 0;
+
+        if (!low && !high) {
+            digits[n++] = (char)('0' + d);
+            continue;
+        }
+        if (low && high) {
+            /* both d and d + 1 are within bounds, pick the closer one */
+            int c;
+            bn_add(&t, &r, &r);
+            c = bn_cmp(&t, &s);
+            if (c > 0 || (c == 0 && (d & 1)))
+                d++;
+        } else if (high) {
+            d++;
+        }
+        digits[n++] = (char)('0' + d);
+        break;
+    }
+
+    /*  Java renders two digits when one would do if the two-digit decimal
+     *  closest to v is closer than the one-digit one and still rounds back
+     *  to v (Double.MIN_VALUE is 4.9E-324, not 5.0E-324). Everything below
+     *  is in units of s / 100, where v is 100 * v0.
+     */
+    if (n == 1) {
+        bignum v100, rem, cand, dist1, dist2, bound, s10;
+        int two, c;
+
+        v100 = v0;
+        bn_mul_small(&v100, 100);
+        rem = v100;
+        s10 = s;
+        bn_mul_small(&s10, 10);
+        two = bn_divmod_small(&rem, &s10) * 10;
+        two += bn_divmod_small(&rem, &s);
+        bn_add(&t, &rem, &rem);
+        c = bn_cmp(&t, &s);
+        if (c > 0 || (c == 0 && (two & 1)))
+            two++;
+
+        if (two % 10 != 0) {
+            cand = s;
+            bn_mul_small(&cand, two);
+            bn_abs_diff(&dist2, &cand, &v100);
+            t = s;
+            bn_mul_small(&t, (digits[0] - '0') * 10);
+            bn_abs_diff(&dist1, &t, &v100);
+
+            bound = bn_cmp(&cand, &v100) >= 0 ? mp0 : mm0;
+            bn_mul_small(&bound, 100);
+            c = bn_cmp(&dist2, &bound);
+            if (bn_cmp(&dist2, &dist1) < 0 && (even ? c <= 0 : c < 0)) {
+                digits[0] = (char)('0' + two / 10);
+                digits[1] = (char)('0' + two % 10);
+                n = 2;
+            }
+        }
+    }
+    return n;
+}
+
+/* render digits/k the way Double.toString and Float.toString do */
+static int format_java_decimal(int negative, const char *digits, int n, int k,
+                               char *out)
+{
+    const int exp10 = k - 1;   /* scientific exponent */
+    int len = 0, i;
+
+    if (negative)
+        out[len++] = '-';
+
+    if (exp10 >= -3 && exp10 < 7) {
+        if (k <= 0) {
+            out[len++] = '0';
+            out[len++] = '.';
+            for (i = 0; i < -k; i++)
+                out[len++] = '0';
+            memcpy(out + len, digits, n);
+            len += n;
+        } else {
+            for (i = 0; i < k; i++)
+                out[len++] = i < n ? digits[i] : '0';
+            out[len++] = '.';
+            if (n > k) {
+                memcpy(out + len, digits + k, n - k);
+                len += n - k;
+            } else {
+                out[len++] = '0';
+            }
+        }
+    } else {
+        out[len++] = digits[0];
+        out[len++] = '.';
+        if (n > 1) {
+            memcpy(out + len, digits + 1, n - 1);
+            len += n - 1;
+        } else {
+            out[len++] = '0';
+        }
+        out[len++] = 'E';
+        len += format_int(exp10, out + len);
+    }
+    out[len] = '\0';
+    return len;
+}
+
+/*  f * 2^e split out of an IEEE value with 'mbits' mantissa bits, 'ebias'
+ *  exponent bias, shared by float and double */
+static int format_ieee(u8 bits, int mbits, int ebits, char *out)
+{
+    const u8 mmask = ((u8)1 << mbits) - 1;
+    const int emask = (1 << ebits) - 1;
+    const int bias = emask / 2 + mbits;
+    const int negative = (int)(bits >> (mbits + ebits)) & 1;
+    const int bexp = (int)(bits >> mbits) & emask;
+    u8 f = bits & mmask;
+    char digits[32];
+    int e, n, k;
+
+    if (bexp == emask) {
+        if (f) {
+            strcpy(out, "NaN");
+            return 3;
+        }
+        strcpy(out, negative ? "-Infinity" : "Infinity");
+        return negative ? 9 : 8;
+    }
+    if (bexp == 0 && f == 0) {
+        strcpy(out, negative ? "-0.0" : "0.0");
+        return negative ? 4 : 3;
+    }
+
+    if (bexp == 0) {
+        e = 1 - bias;
+    } else {
+        f |= (u8)1 << mbits;
+        e = bexp - bias;
+    }
+
+    if (e <= 0 && e >= -mbits && (f & (((u8)1 << -e) - 1)) == 0) {
+        /* fast path : integral value, its digits are exact and shortest */
+        char tmp[24];
+        char *end = tmp + sizeof(tmp);
+        char *p = format_u64_backward(f >> -e, end);
+        n = end - p;
+        k = n;
+        while (n > 1 && p[n - 1] == '0')
+            n--;
+        return format_java_decimal(negative, p, n, k, out);
+    }
+
+    n = shortest_digits(f, e, f == ((u8)1 << mbits) && bexp > 1, digits, &k);
+    return format_java_decimal(negative, digits, n, k, out);
+}
+
+int format_double(double v, char *out)
+{
+    u8 bits;
+    memcpy(&bits, &v, sizeof(bits));
+    return format_ieee(bits, 52, 11, out);
+}
+
+int format_float(float v, char *out)
+{
+    u4 bits;
+    memcpy(&bits, &v, sizeof(bits));
+    return format_ieee(bits, 23, 8, out);
+}
@@ -0,0 +1,211 @@
+/*
+ * Simple Dalvik Virtual Machine Implementation
+ *
+ * Copyright (C) 2014 cycheng <createinfinite@yahoo.com.tw>
+ * Copyright (C) 2013 Chun-Yu Wang <wicanr2@gmail.com>
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <time.h>
+#include "simple_dvm.h"
+
+/*  Opcode histograms
+ *
+ *  A profiling build (make OPSTATS=1) has runMethod count every opcode it
+ *  dispatches, every pair of consecutive opcodes (what a superinstruction
+ *  would fuse), and the cycles (rdtsc, or ns elsewhere) spent in each
+ *  handler. An invoke is charged for the call itself, the handlers of the
+ *  callee are charged to themselves.
+ *
+ *  The counters of a run are private to its VM (vm->opstats), so threads
+ *  don't share cache lines while they count. When the run ends they are
+ *  added to the process totals, and dvm --opstats=FILE writes those at
+ *  exit : JSON to FILE, and a table sorted by count to stderr.
+ */
+#ifdef SDVM_OPSTATS
+
+#define OPSTATS_TOP_PAIRS 32
+
+static pthread_mutex_t opstats_lock = PTHREAD_MUTEX_INITIALIZER;
+static opcode_stats *opstats_runs;      /* not ended yet (aborted, running) */
+static opcode_stats opstats_total;
+static char *opstats_file;
+
+#if !defined(__x86_64__) && !defined(__i386__)
+u8 opstats_clock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u8)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+#endif
+
+/* the counters of the run in 'vm', from its first instruction on */
+opcode_stats *opstats_get(simple_dalvik_vm *vm)
+{
+    opcode_stats *st = vm->opstats;
+
+    if (st)
+        return st;
+    st = (opcode_stats *)calloc(1, sizeof(opcode_stats));
+    if (st == NULL) {
+        printf("Error! cannot allocate the opcode counters\n");
+        exit(1);
+    }
+    st->prev = -1;
+    pthread_mutex_lock(&opstats_lock);
+    st->next = opstats_runs;
+    opstats_runs = st;
+    pthread_mutex_unlock(&opstats_lock);
+    vm->opstats = st;
+    return st;
+}
+
+static void opstats_add(opcode_stats *st)
+{
+    int i;
+
+    for (i = 0; i < 256; i++) {
+        opstats_total.count[i] += st->count[i];
+        opstats_total.cycles[i] += st->cycles[i];
+    }
+    for (i = 0; i < 256 * 256; i++)
+        opstats_total.pairs[i] += st->pairs[i];
+}
+
+/* the run in 'vm' is over, add it to the totals */
+void opstats_end(simple_dalvik_vm *vm)
+{
+    opcode_stats *st = vm->opstats, **p;
+
+    if (st == NULL)
+        return;
+    pthread_mutex_lock(&opstats_lock);
+    for (p = &opstats_runs; *p; p = &(*p)->next)
+        if (*p == st) {
+            *p = st->next;
+            break;
+        }
+    opstats_add(st);
+    pthread_mutex_unlock(&opstats_lock);
+    vm->opstats = NULL;
+    free(st);
+}
+
+static const char *opstats_name(int op)
+{
+    const char *name = opcode_name((u1)op);
+    return name ? name : "unknown";
+}
+
+static int opstats_by_count(const void *a, const void *b)
+{
+    const u8 x = opstats_total.count[*(const int *)a];
+    const u8 y = opstats_total.count[*(const int *)b];
+
+    if (x != y)
+        return x < y ? 1 : -1;
+    return *(const int *)a - *(const int *)b;
+}
+
+static int opstats_by_pair_count(const void *a, const void *b)
+{
+    const u8 x = opstats_total.pairs[*(const int *)a];
+    const u8 y = opstats_total.pairs[*(const int *)b];
+
+    if (x != y)
+        return x < y ? 1 : -1;
+    return *(const int *)a - *(const int *)b;
+}
+
+static void opstats_dump(void)
+{
+    int ops[256], *pairs, op_count = 0, pair_count = 0, i;
+    u8 total = 0, cycles = 0;
+    opcode_stats *st;
+    FILE *f;
+
+    pthread_mutex_lock(&opstats_lock);
+    for (st = opstats_runs; st; st = st->next)
+        opstats_add(st);
+    opstats_runs = NULL;
+    pthread_mutex_unlock(&opstats_lock);
+
+    for (i = 0; i < 256; i++) {
+        if (opstats_total.count[i] == 0)
+            continue;
+        ops[op_count++] = i;
+        total += opstats_total.count[i];
+        cycles += opstats_total.cycles[i];
+    }
+    qsort(ops, op_count, sizeof(int), opstats_by_count);
+    pairs = (int *)malloc(sizeof(int) * 256 * 256);
+    for (i = 0; i < 256 * 256; i++)
+        if (opstats_total.pairs[i])
+            pairs[pair_count++] = i;
+    qsort(pairs, pair_count, sizeof(int), opstats_by_pair_count);
+
+    f = fopen(opstats_file, "w");
+    if (f == NULL) {
+        fprintf(stderr, "Error! cannot write opcode statistics %s\n", opstats_file);
+    } else {
+        fprintf(f, "{\n  \"instructions\": %llu,\n  \"cycles\": %llu,\n",
+                (unsigned long long)total, (unsigned long long)cycles);
+        fprintf(f, "  \"opcodes\": [");
+        for (i = 0; i < op_count; i++)
+            fprintf(f, "%s\n    {\"opcode\": %d, \"name\": \"%s\", \"count\": %llu, "
+                    "\"cycles\": %llu}", i ? "," : "", ops[i], opstats_name(ops[i]),
+                    (unsigned long long)opstats_total.count[ops[i]],
+                    (unsigned long long)opstats_total.cycles[ops[i]]);
+        fprintf(f, "\n  ],\n  \"pairs\": [");
+        for (i = 0; i < pair_count; i++)
+            fprintf(f, "%s\n    {\"first\": \"%s\", \"second\": \"%s\", \"count\": %llu}",
+                    i ? "," : "", opstats_name(pairs[i] >> 8), opstats_name(pairs[i] & 0xff),
+                    (unsigned long long)opstats_total.pairs[pairs[i]]);
+        fprintf(f, "\n  ]\n}\n");
+        fclose(f);
+    }
+
+    fprintf(stderr, "%-4s %-22s %12s %6s %14s %8s\n",
+            "op", "name", "count", "%", "cycles", "/insn");
+    for (i = 0; i < op_count; i++) {
+        const u8 n = opstats_total.count[ops[i]];
+        fprintf(stderr, "%02x   %-22s %12llu %5.1f%% %14llu %8.1f\n", ops[i],
+                opstats_name(ops[i]), (unsigned long long)n, 100.0 * n / total,
+                (unsigned long long)opstats_total.cycles[ops[i]],
+                (double)opstats_total.cycles[ops[i]] / n);
+    }
+    fprintf(stderr, "%-27s %12llu %6s %14llu\n\n", "total",
+            (unsigned long long)total, "", (unsigned long long)cycles);
+    fprintf(stderr, "%-45s %12s %6s\n", "pair", "count", "%");
+    for (i = 0; i < pair_count && i < OPSTATS_TOP_PAIRS; i++) {
+        char pair[64];
+        const u8 n = opstats_total.pairs[pairs[i]];
+        snprintf(pair, sizeof(pair), "%s, %s", opstats_name(pairs[i] >> 8),
+                 opstats_name(pairs[i] & 0xff));
+        fprintf(stderr, "%-45s %12llu %5.1f%%\n", pair, (unsigned long long)n,
+                100.0 * n / total);
+    }
+    free(pairs);
+}
+
+/* write the totals to 'file' at exit */
+int opstats_init(const char *file)
+{
+    if (opstats_file == NULL)
+        atexit(opstats_dump);
+    free(opstats_file);
+    opstats_file = strdup(file);
+    return 0;
+}
+
+#else
+
+int opstats_init(const char *file)
+{
+    printf("Error! %s : opcode statistics need a profiling build (make OPSTATS=1)\n", file);
+    return -1;
+}
+
+#endif
@@ -0,0 +1,274 @@
+/*
+ * Simple Dalvik Virtual Machine Implementation
+ *
+ * Copyright (C) 2014 cycheng <createinfinite@yahoo.com.tw>
+ * Copyright (C) 2013 Chun-Yu Wang <wicanr2@gmail.com>
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdio_ext.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "simple_dvm.h"
+
+/*  Guest standard output
+ *
+ *  PrintStream natives write here instead of going through printf, so a
+ *  println costs a memcpy rather than a syscall. Modes :
+ *    OUTPUT_LINE  : flush at every newline (default on a terminal)
+ *    OUTPUT_FULL  : flush when the buffer fills up (default otherwise)
+ *    OUTPUT_ASYNC : full buffers are handed to a writer thread, which
+ *                   drains everything queued so far with one writev()
+ *  The buffer is always flushed on PrintStream.flush and at exit.
+ *
+ *  Trace output (is_verbose) still uses printf, so in verbose mode guest
+ *  output goes straight to stdio to keep both in program order. Outside
+ *  of it the VM still printf's its warnings and errors : before the guest
+ *  adds to the buffer, stdio holding text means that text came after the
+ *  buffer, so the buffer goes out first, then stdio, then the new output.
+ *
+ *  The buffer is the process's stdout, set up by the command line tool.
+ *  A context with an out_fn (e.g. a library VM instance) has its output
+ *  handed to that function instead.
+ */
+#define OUTPUT_ASYNC_BUFFERS 8
+
+typedef struct _output_buffer {
+    char *data;
+    size_t len;
+    struct _output_buffer *next;
+} output_buffer;
+
+static int out_mode = OUTPUT_FULL;
+static size_t out_size = OUTPUT_DEFAULT_SIZE;
+static output_buffer *cur = NULL;
+
+/* async mode */
+static pthread_t writer;
+static pthread_mutex_t out_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t out_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t out_done = PTHREAD_COND_INITIALIZER;
+static output_buffer *queue_head = NULL;
+static output_buffer *queue_tail = NULL;
+static output_buffer *free_list = NULL;
+static int writer_busy = 0;
+static int writer_stop = 0;
+
+static output_buffer *new_output_buffer(void)
+{
+    output_buffer *b = (output_buffer *)malloc(sizeof(output_buffer));
+    b->data = (char *)malloc(out_size);
+    b->len = 0;
+    b->next = NULL;
+    return b;
+}
+
+/* write all of iov[0 .. cnt), retrying partial writes */
+static void write_all(struct iovec *iov, int cnt)
+{
+    while (cnt > 0) {
+        ssize_t n = writev(STDOUT_FILENO, iov, cnt);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        while (cnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+}
+
+static void *output_writer(void *arg)
+{
+    struct iovec iov[OUTPUT_ASYNC_BUFFERS];
+
+    pthread_mutex_lock(&out_lock);
+    for (;;) {
+        output_buffer *batch, *b;
+        int cnt = 0;
+
+        while (queue_head == NULL && !writer_stop)
+            pthread_cond_wait(&out_work, &out_lock);
+        if (queue_head == NULL)
+            break;
+
+        /* take everything queued so far */
+        batch = queue_head;
+        queue_head = queue_tail = NULL;
+        writer_busy = 1;
+        pthread_mutex_unlock(&out_lock);
+
+        for (b = batch; b; b = b->next) {
+            iov[cnt].iov_base = b->data;
+            iov[cnt].iov_len = b->len;
+            cnt++;
+        }
+        write_all(iov, cnt);
+
+        pthread_mutex_lock(&out_lock);
+        while (batch) {
+            b = batch;
+            batch = batch->next;
+            b->len = 0;
+            b->next = free_list;
+            free_list = b;
+        }
+        writer_busy = 0;
+        pthread_cond_broadcast(&out_done);
+    }
+    pthread_mutex_unlock(&out_lock);
+    return NULL;
+}
+
+/* hand 'cur' over to the writer thread and take a free buffer */
+static void output_submit(void)
+{
+    pthread_mutex_lock(&out_lock);
+    if (queue_tail)
+        queue_tail->next = cur;
+    else
+        queue_head = cur;
+    queue_tail = cur;
+    pthread_cond_signal(&out_work);
+
+    while (free_list == NULL)
+        pthread_cond_wait(&out_done, &out_lock);
+    cur = free_list;
+    free_list = cur->next;
+    cur->next = NULL;
+    pthread_mutex_unlock(&out_lock);
+}
+
+/* push out the current buffer, without waiting for the async writer */
+static void output_drain(void)
+{
+    struct iovec iov;
+
+    if (cur->len == 0)
+        return;
+    if (out_mode == OUTPUT_ASYNC) {
+        output_submit();
+    } else {
+        iov.iov_base = cur->data;
+        iov.iov_len = cur->len;
+        write_all(&iov, 1);
+        cur->len = 0;
+    }
+}
+
+/* the buffer, then what the VM printf'ed after it */
+void output_flush(void)
+{
+    if (cur != NULL) {
+        output_drain();
+        if (out_mode == OUTPUT_ASYNC) {
+            pthread_mutex_lock(&out_lock);
+            while (queue_head || writer_busy)
+                pthread_cond_wait(&out_done, &out_lock);
+            pthread_mutex_unlock(&out_lock);
+        }
+    }
+    fflush(stdout);
+}
+
+static void output_shutdown(void)
+{
+    output_flush();
+    if (cur && out_mode == OUTPUT_ASYNC) {
+        pthread_mutex_lock(&out_lock);
+        writer_stop = 1;
+        pthread_cond_signal(&out_work);
+        pthread_mutex_unlock(&out_lock);
+        pthread_join(writer, NULL);
+    }
+}
+
+void output_init(int mode, size_t size)
+{
+    int i;
+
+    assert(cur == NULL);
+    if (size > 0)
+        out_size = size;
+    if (mode == OUTPUT_DEFAULT)
+        mode = isatty(STDOUT_FILENO) ? OUTPUT_LINE : OUTPUT_FULL;
+    out_mode = mode;
+
+    cur = new_output_buffer();
+    if (out_mode == OUTPUT_ASYNC) {
+        for (i = 1; i < OUTPUT_ASYNC_BUFFERS; i++) {
+            output_buffer *b = new_output_buffer();
+            b->next = free_list;
+            free_list = b;
+        }
+        if (pthread_create(&writer, NULL, output_writer, NULL) != 0) {
+            printf("Warning! cannot start the output thread, using full buffering\n");
+            out_mode = OUTPUT_FULL;
+        }
+    }
+    atexit(output_shutdown);
+
+    if (is_verbose())
+        printf("output : mode %d, buffer %zu bytes\n", out_mode, out_size);
+}
+
+void output_write(const void *data, size_t len)
+{
+    sdvm_context *ctx = sdvm_context_current();
+    const char *p = (const char *)data;
+    int has_newline;
+
+    ctx->out_written += len;
+    if (ctx->out_fn) {
+        ctx->out_fn(ctx->out_arg, data, len);
+        return;
+    }
+    if (cur == NULL || ctx->verbose) {
+        fwrite(data, 1, len, stdout);
+        return;
+    }
+    /* a printf since the last write : it goes before this output */
+    if (__fpending(stdout) > 0)
+        output_flush();
+
+    has_newline = out_mode == OUTPUT_LINE && memchr(data, '\n', len) != NULL;
+    while (len > 0) {
+        size_t n = out_size - cur->len;
+        if (n > len)
+            n = len;
+        memcpy(cur->data + cur->len, p, n);
+        cur->len += n;
+        p += n;
+        len -= n;
+        if (cur->len == out_size)
+            output_drain();
+    }
+    if (has_newline)
+        output_drain();
+}
+
+/* bytes the guest of the current context has written so far */
+u8 output_written(void)
+{
+    return sdvm_context_current()->out_written;
+}
+
+int output_parse_mode(const char *name)
+{
+    if (strcmp(name, "line") == 0)
+        return OUTPUT_LINE;
+    if (strcmp(name, "full") == 0)
+        return OUTPUT_FULL;
+    if (strcmp(name, "async") == 0)
+        return OUTPUT_ASYNC;
+    return -1;
+}
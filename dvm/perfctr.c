@@ -0,0 +1,200 @@
+/*
+ * Simple Dalvik Virtual Machine Implementation
+ *
+ * Copyright (C) 2014 cycheng <createinfinite@yahoo.com.tw>
+ * Copyright (C) 2013 Chun-Yu Wang <wicanr2@gmail.com>
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "simple_dvm.h"
+
+/*  Hardware performance counters
+ *
+ *  dvm --perf-counters counts cycles, instructions, branch misses and L1d
+ *  read misses (perf_event_open, user space only) of the thread running
+ *  the program, and charges them to the phase it is in : parse (loading
+ *  the dex), init (the class of the entry) and execute. At exit stderr
+ *  gets a table per phase, with the IPC, and the cycles and host
+ *  instructions per guest instruction run.
+ *
+ *  The counters are per thread and the loader's workers would escape
+ *  them, so dvm parses serially under --perf-counters (the table says
+ *  so) : the parse row is the cost of a one thread load.
+ *
+ *  A counter the kernel won't give (no PMU, a container, a paranoid
+ *  perf_event_paranoid) is left out, with none the table still has the
+ *  time of each phase.
+ */
+static const char *perfctr_event_names[PERFCTR_EVENTS] = {
+    "cycles", "instructions", "branch-misses", "L1d-misses",
+};
+
+static const char *perfctr_phase_names[PERFCTR_PHASES] = {
+    "parse", "init", "execute",
+};
+
+static int perfctr_fd[PERFCTR_EVENTS] = {-1, -1, -1, -1};
+static __thread int perfctr_mine = 0;       /* counted thread */
+static pid_t perfctr_pid;
+static int perfctr_current = -1;            /* phase, -1 : none */
+static u8 perfctr_last[PERFCTR_EVENTS];
+static u8 perfctr_last_ns;
+static u8 perfctr_last_insns;
+static const sdvm_context *perfctr_last_ctx;
+static u8 perfctr_total[PERFCTR_PHASES][PERFCTR_EVENTS];
+static u8 perfctr_ns[PERFCTR_PHASES];
+static u8 perfctr_insns[PERFCTR_PHASES];
+
+/* a counter of event 'e' (PERFCTR_xxx) for this thread, user space only */
+static int perfctr_open_event(int e)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    switch (e) {
+    case PERFCTR_CYCLES:
+        attr.config = PERF_COUNT_HW_CPU_CYCLES;
+        break;
+    case PERFCTR_INSTRUCTIONS:
+        attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+        break;
+    case PERFCTR_BRANCH_MISSES:
+        attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+        break;
+    default:
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = PERF_COUNT_HW_CACHE_L1D |
+                      PERF_COUNT_HW_CACHE_OP_READ << 8 |
+                      PERF_COUNT_HW_CACHE_RESULT_MISS << 16;
+        break;
+    }
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void perfctr_read(u8 *values)
+{
+    int e;
+
+    for (e = 0; e < PERFCTR_EVENTS; e++) {
+        values[e] = 0;
+        if (perfctr_fd[e] >= 0 && read(perfctr_fd[e], &values[e], sizeof(u8)) != sizeof(u8))
+            values[e] = 0;
+    }
+}
+
+/* the counted thread enters 'phase' (PERFCTR_xxx, -1 : none) */
+void perfctr_phase(int phase)
+{
+    sdvm_context *ctx = sdvm_context_current();
+    u8 now[PERFCTR_EVENTS], ns;
+    int e;
+
+    if (!perfctr_mine)
+        return;
+    /* the instructions of the run in progress, counted so far */
+    if (ctx->stats.run_start_ns)
+        budget_sync(ctx, ctx->run_vm);
+    perfctr_read(now);
+    ns = stats_now_ns();
+    if (perfctr_current >= 0) {
+        for (e = 0; e < PERFCTR_EVENTS; e++)
+            perfctr_total[perfctr_current][e] += now[e] - perfctr_last[e];
+        perfctr_ns[perfctr_current] += ns - perfctr_last_ns;
+        /* a phase ending in another instance ran no guest code of its own */
+        if (ctx == perfctr_last_ctx)
+            perfctr_insns[perfctr_current] += ctx->stats.insns - perfctr_last_insns;
+    }
+    memcpy(perfctr_last, now, sizeof(now));
+    perfctr_last_ns = ns;
+    perfctr_last_insns = ctx->stats.insns;
+    perfctr_last_ctx = ctx;
+    perfctr_current = phase;
+}
+
+static void perfctr_row(const char *name, const u8 *v, u8 ns, u8 insns)
+{
+    int e;
+
+    fprintf(stderr, "%-8s %10.3f", name, ns / 1e6);
+    for (e = 0; e < PERFCTR_EVENTS; e++) {
+        if (perfctr_fd[e] >= 0)
+            fprintf(stderr, " %14llu", (unsigned long long)v[e]);
+        else
+            fprintf(stderr, " %14s", "-");
+    }
+    if (perfctr_fd[PERFCTR_CYCLES] >= 0 && perfctr_fd[PERFCTR_INSTRUCTIONS] >= 0 &&
+        v[PERFCTR_CYCLES])
+        fprintf(stderr, " %6.2f", (double)v[PERFCTR_INSTRUCTIONS] / v[PERFCTR_CYCLES]);
+    else
+        fprintf(stderr, " %6s", "-");
+    fprintf(stderr, " %12llu", (unsigned long long)insns);
+    if (insns && perfctr_fd[PERFCTR_CYCLES] >= 0)
+        fprintf(stderr, " %10.1f", (double)v[PERFCTR_CYCLES] / insns);
+    else
+        fprintf(stderr, " %10s", "-");
+    if (insns && perfctr_fd[PERFCTR_INSTRUCTIONS] >= 0)
+        fprintf(stderr, " %10.1f\n", (double)v[PERFCTR_INSTRUCTIONS] / insns);
+    else
+        fprintf(stderr, " %10s\n", "-");
+}
+
+static void perfctr_report(void)
+{
+    u8 total[PERFCTR_EVENTS], ns = 0, insns = 0;
+    int p, e;
+
+    /* a zygote job (fork) does not own the counters */
+    if (perfctr_pid != getpid())
+        return;
+    perfctr_phase(-1);
+    perfctr_mine = 0;
+    memset(total, 0, sizeof(total));
+    for (p = 0; p < PERFCTR_PHASES; p++) {
+        for (e = 0; e < PERFCTR_EVENTS; e++)
+            total[e] += perfctr_total[p][e];
+        ns += perfctr_ns[p];
+        insns += perfctr_insns[p];
+    }
+    fprintf(stderr, "%-8s %10s", "phase", "ms");
+    for (e = 0; e < PERFCTR_EVENTS; e++)
+        fprintf(stderr, " %14s", perfctr_event_names[e]);
+    fprintf(stderr, " %6s %12s %10s %10s\n", "IPC", "guest insns", "cyc/insn", "ins/insn");
+    for (p = 0; p < PERFCTR_PHASES; p++)
+        perfctr_row(perfctr_phase_names[p], perfctr_total[p], perfctr_ns[p], perfctr_insns[p]);
+    perfctr_row("total", total, ns, insns);
+    fprintf(stderr, "(parse on one thread while counting, --parse-threads ignored)\n");
+    for (e = 0; e < PERFCTR_EVENTS; e++)
+        if (perfctr_fd[e] >= 0)
+            close(perfctr_fd[e]);
+}
+
+/*  count the current thread from now on, in the parse phase ; the table
+ *  goes to stderr at exit
+ */
+int perfctr_start(void)
+{
+    int e, missing = 0, err = 0;
+
+    for (e = 0; e < PERFCTR_EVENTS; e++) {
+        perfctr_fd[e] = perfctr_open_event(e);
+        if (perfctr_fd[e] < 0) {
+            missing++;
+            err = errno;
+        }
+    }
+    if (missing == PERFCTR_EVENTS)
+        fprintf(stderr, "perf counters unavailable (%s), timing only\n", strerror(err));
+    perfctr_mine = 1;
+    perfctr_pid = getpid();
+    atexit(perfctr_report);
+    perfctr_phase(PERFCTR_PARSE);
+    return 0;
+}
@@ -0,0 +1,103 @@
+/*
+ * Simple Dalvik Virtual Machine Implementation
+ *
+ * Copyright (C) 2014 cycheng <createinfinite@yahoo.com.tw>
+ * Copyright (C) 2013 Chun-Yu Wang <wicanr2@gmail.com>
+ */
+
+#include <math.h>
+#include "simple_dvm.h"
+#include "sdvm.h"
+
+/*  Repeated runs
+ *
+ *  dvm --iterations=N [--warmup=M] parses the dex once (sdvm_dex_open),
+ *  then runs the entry method M + N times in the same process and reports
+ *  the time of each run on stderr, with the median, mean and deviation of
+ *  the N measured ones : the interpreter alone, without the parse and the
+ *  cold start a new process pays.
+ *
+ *  By default the runs share one VM instance : classes are initialized by
+ *  the first run only, and static fields keep what the previous run left
+ *  in them. With --reset-statics every run gets a fresh instance (as a
+ *  batch job does), so each starts from the state of a new process,
+ *  <clinit> included. There is no GC, objects of a shared instance pile
+ *  up until the end. --trace and --boot-image are for a single run, main
+ *  refuses them here.
+ */
+static int repeat_by_value(const void *a, const void *b)
+{
+    const double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void repeat_report(double *ms, int count)
+{
+    double mean = 0, var = 0, median;
+    int i;
+
+    for (i = 0; i < count; i++)
+        mean += ms[i];
+    mean /= count;
+    for (i = 0; i < count; i++)
+        var += (ms[i] - mean) * (ms[i] - mean);
+    var = count > 1 ? var / (count - 1) : 0;
+    qsort(ms, count, sizeof(double), repeat_by_value);
+    median = count % 2 ? ms[count / 2] : (ms[count / 2 - 1] + ms[count / 2]) / 2;
+    fprintf(stderr, "iterations : %d, median %.3f ms, mean %.3f ms, stddev %.3f ms, "
+            "min %.3f ms, max %.3f ms\n", count, median, mean, sqrt(var),
+            ms[0], ms[count - 1]);
+}
+
+/*  run 'entry' of 'file' 'warmup' times, then 'iterations' times measured,
+ *  in a fresh instance each time if 'reset' ; 0 if every run went fine
+ */
+int repeat_run(char *file, char *entry, int iterations, int warmup, int reset)
+{
+    sdvm_context *ctx = sdvm_context_current();
+    sdvm_dex *d;
+    sdvm_vm *vm = NULL;
+    double *ms;
+    u8 start;
+    int i, ret = SDVM_OK;
+
+    start = stats_now_ns();
+    d = sdvm_dex_open(file);
+    if (d == NULL) {
+        printf("Error! cannot load %s\n", file);
+        return -1;
+    }
+    fprintf(stderr, "load : %.3f ms\n", (stats_now_ns() - start) / 1e6);
+    ms = (double *)malloc(sizeof(double) * (iterations > 0 ? iterations : 1));
+
+    for (i = 0; i < warmup + iterations && ret == SDVM_OK; i++) {
+        double t;
+
+        if (vm == NULL) {
+            vm = sdvm_vm_new(d);
+            sdvm_vm_set_verbose(vm, is_verbose());
+            sdvm_vm_set_budget(vm, ctx->insn_limit, ctx->time_limit_ns / 1e9);
+        }
+        start = stats_now_ns();
+        ret = sdvm_run(vm, entry);
+        t = (stats_now_ns() - start) / 1e6;
+        output_flush();
+        if (ret != SDVM_OK) {
+            fprintf(stderr, "Error! iteration %d : %s\n", i + 1, sdvm_strerror(ret));
+            break;
+        }
+        fprintf(stderr, "iteration %d%s : %.3f ms\n", i + 1, i < warmup ? " (warmup)" : "", t);
+        if (i >= warmup)
+            ms[i - warmup] = t;
+        if (reset) {
+            sdvm_vm_free(vm);
+            vm = NULL;
+        }
+    }
+    if (ret == SDVM_OK && iterations > 0)
+        repeat_report(ms, iterations);
+    free(ms);
+    sdvm_vm_free(vm);
+    sdvm_dex_close(d);
+    return ret == SDVM_OK ? 0 : -1;
+}
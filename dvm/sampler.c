@@ -0,0 +1,273 @@
+/*
+ * Simple Dalvik Virtual Machine Implementation
+ *
+ * Copyright (C) 2014 cycheng <createinfinite@yahoo.com.tw>
+ * Copyright (C) 2013 Chun-Yu Wang <wicanr2@gmail.com>
+ */
+
+#define _GNU_SOURCE
+#include <signal.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include "simple_dvm.h"
+
+/*  Sampling profiler
+ *
+ *  dvm --profile=FILE arms a SIGPROF timer (--profile-hz, 1000 by default)
+ *  on the CPU time of the process. Each tick, the handler copies the guest
+ *  stack of the run in progress on the interrupted thread (ctx->run_vm,
+ *  see runMethod for the frames) into a sample buffer : the methods from
+ *  the outermost in, and the dex pc of the innermost one. It takes no lock
+ *  and calls nothing, so the cost of profiling is a few hundred ns per
+ *  tick.
+ *
+ *  Names are resolved later, while the dex is still around (sampler_flush,
+ *  see sdvm_dex_close and main), into a table of folded stacks, which
+ *  sampler_finish writes out at exit, one line per distinct stack :
+ *
+ *      Foo1.main;Foo1.Proc_1;@0x0012 37
+ *
+ *  the last element being the dex pc, so flame graph tools (flamegraph.pl,
+ *  speedscope, ...) show where time goes within the method as well.
+ *  Ticks with no guest code running (parsing, linking) are counted apart.
+ */
+#define SAMPLER_WORDS (4 << 20)     /* 32 MB of address space, used lazily */
+#define SAMPLER_DEPTH 64            /* innermost frames kept per sample */
+#define SAMPLER_BUCKETS 4096
+#define SAMPLER_CONSUMED 1
+
+/*  sample layout in sampler.buf :
+ *      [0] the dex (the shared one for an instance), SAMPLER_CONSUMED once
+ *          it is folded, 0 while being written
+ *      [1] number of frames | pc << 32
+ *      [2..] encoded_method *, outermost first
+ */
+typedef struct _sampler_stack {
+    struct _sampler_stack *next;
+    u8 count;
+    char name[];
+} sampler_stack;
+
+static struct {
+    char *file;
+    pid_t pid;
+    int hz;
+    u8 *buf;
+    volatile size_t used;           /* words, may pass SAMPLER_WORDS */
+    volatile u8 taken;
+    volatile u8 dropped;
+    volatile u8 idle;
+    sampler_stack *stacks[SAMPLER_BUCKETS];
+    u8 folded;
+} sampler;
+
+static void sampler_tick(int sig)
+{
+    sdvm_context *ctx = sdvm_context_current();
+    simple_dalvik_vm *vm = ctx->run_vm;
+    DexFileFormat *dex = ctx->run_dex;
+    int depth, skip, i;
+    size_t pos;
+    u8 *s;
+
+    (void)sig;
+    if (vm == NULL || dex == NULL || vm->depth <= 0) {
+        __sync_fetch_and_add(&sampler.idle, 1);
+        return;
+    }
+    depth = vm->depth < VM_MAX_FRAMES ? vm->depth : VM_MAX_FRAMES;
+    skip = depth > SAMPLER_DEPTH ? depth - SAMPLER_DEPTH : 0;
+    pos = __sync_fetch_and_add(&sampler.used, 2 + depth - skip);
+    if (pos + 2 + depth - skip > SAMPLER_WORDS) {
+        __sync_fetch_and_add(&sampler.dropped, 1);
+        return;
+    }
+    s = &sampler.buf[pos];
+    for (i = skip; i < depth; i++)
+        s[2 + i - skip] = (u8)(uintptr_t)vm->frames[i].method;
+    s[1] = (u8)(depth - skip) | (u8)(vm->pc / 2) << 32;
+    __sync_synchronize();
+    s[0] = (u8)(uintptr_t)(dex->instance_of ? dex->instance_of : dex);
+    __sync_fetch_and_add(&sampler.taken, 1);
+}
+
+/* "La/b/Foo;" as "a.b.Foo", ';' separates frames in a folded stack */
+static size_t sampler_class_name(char *out, const char *descriptor)
+{
+    size_t len = strlen(descriptor), i, n = 0;
+
+    if (len >= 2 && descriptor[0] == 'L' && descriptor[len - 1] == ';') {
+        descriptor++;
+        len -= 2;
+    }
+    for (i = 0; i < len; i++)
+        out[n++] = descriptor[i] == '/' ? '.' : descriptor[i] == ';' ? '_' : descriptor[i];
+    return n;
+}
+
+static void sampler_count(const char *name, u8 count)
+{
+    unsigned int h = 5381;
+    const char *p;
+    sampler_stack *st;
+
+    for (p = name; *p; p++)
+        h = h * 33 + (unsigned char)*p;
+    for (st = sampler.stacks[h % SAMPLER_BUCKETS]; st; st = st->next)
+        if (strcmp(st->name, name) == 0)
+            break;
+    if (st == NULL) {
+        st = (sampler_stack *)malloc(sizeof(sampler_stack) + strlen(name) + 1);
+        strcpy(st->name, name);
+        st->count = 0;
+        st->next = sampler.stacks[h % SAMPLER_BUCKETS];
+        sampler.stacks[h % SAMPLER_BUCKETS] = st;
+    }
+    st->count += count;
+}
+
+/*  fold the samples taken in 'dex' (NULL : all of them, the dex files are
+ *  known to be alive) into sampler.stacks
+ */
+void sampler_flush(DexFileFormat *dex)
+{
+    const u8 key = (u8)(uintptr_t)(dex && dex->instance_of ? dex->instance_of : dex);
+    size_t pos = 0, end;
+    char name[SAMPLER_DEPTH * 128 + 32];
+
+    if (sampler.buf == NULL)
+        return;
+    end = sampler.used < SAMPLER_WORDS ? sampler.used : SAMPLER_WORDS;
+    while (pos + 2 <= end) {
+        u8 *s = &sampler.buf[pos];
+        const u8 owner = s[0];
+        const int depth = (int)(s[1] & 0xffffffff);
+        DexFileFormat *d = (DexFileFormat *)(uintptr_t)owner;
+        size_t n = 0;
+        int i;
+
+        /* still being written by another thread, the rest comes later */
+        if (owner == 0 || depth == 0)
+            break;
+        pos += 2 + depth;
+        if (owner == SAMPLER_CONSUMED || (key && owner != key))
+            continue;
+        for (i = 0; i < depth; i++) {
+            const encoded_method *m = (const encoded_method *)(uintptr_t)s[2 + i];
+            const method_id_item *id;
+            const char *method;
+
+            if (m == NULL) {
+                n += sprintf(name + n, "?;");
+                continue;
+            }
+            id = get_method_item(d, m->method_id);
+            method = get_string_data(d, id->name_idx);
+            n += sampler_class_name(name + n, get_type_item_name(d, id->class_idx));
+            n += snprintf(name + n, 128, ".%.100s;", method);
+        }
+        sprintf(name + n, "@0x%04x", (uint)(s[1] >> 32));
+        sampler_count(name, 1);
+        sampler.folded++;
+        s[0] = SAMPLER_CONSUMED;
+    }
+}
+
+static int sampler_by_count(const void *a, const void *b)
+{
+    const sampler_stack *x = *(const sampler_stack **)a;
+    const sampler_stack *y = *(const sampler_stack **)b;
+
+    if (x->count != y->count)
+        return x->count < y->count ? 1 : -1;
+    return strcmp(x->name, y->name);
+}
+
+/* stop sampling and write the folded stacks, at exit */
+void sampler_finish(void)
+{
+    struct itimerval off;
+    sampler_stack **all, *st;
+    size_t count = 0, i;
+    FILE *f;
+
+    /* a zygote job (fork) isn't sampled, and must not clobber the file */
+    if (sampler.buf == NULL || sampler.pid != getpid())
+        return;
+    memset(&off, 0, sizeof(off));
+    setitimer(ITIMER_PROF, &off, NULL);
+    signal(SIGPROF, SIG_IGN);
+    sampler_flush(NULL);
+
+    for (i = 0; i < SAMPLER_BUCKETS; i++)
+        for (st = sampler.stacks[i]; st; st = st->next)
+            count++;
+    all = (sampler_stack **)malloc(sizeof(sampler_stack *) * (count + 1));
+    count = 0;
+    for (i = 0; i < SAMPLER_BUCKETS; i++)
+        for (st = sampler.stacks[i]; st; st = st->next)
+            all[count++] = st;
+    qsort(all, count, sizeof(sampler_stack *), sampler_by_count);
+
+    f = fopen(sampler.file, "w");
+    if (f == NULL) {
+        fprintf(stderr, "Error! cannot write profile %s\n", sampler.file);
+    } else {
+        for (i = 0; i < count; i++)
+            fprintf(f, "%s %llu\n", all[i]->name, (unsigned long long)all[i]->count);
+        fclose(f);
+    }
+    if (is_verbose())
+        fprintf(stderr, "sampler : %llu samples at %d Hz, %llu idle, %llu dropped, "
+                "%zu stacks in %s\n", (unsigned long long)sampler.folded, sampler.hz,
+                (unsigned long long)sampler.idle, (unsigned long long)sampler.dropped,
+                count, sampler.file);
+
+    for (i = 0; i < SAMPLER_BUCKETS; i++)
+        while ((st = sampler.stacks[i]) != NULL) {
+            sampler.stacks[i] = st->next;
+            free(st);
+        }
+    free(all);
+    munmap(sampler.buf, SAMPLER_WORDS * sizeof(u8));
+    sampler.buf = NULL;
+    free(sampler.file);
+}
+
+/* sample 'hz' times per CPU second until exit, the profile goes to 'file' */
+int sampler_start(const char *file, int hz)
+{
+    struct sigaction sa;
+    struct itimerval it;
+
+    if (hz <= 0 || hz > 1000000) {
+        printf("Error! bad sampling rate %d\n", hz);
+        return -1;
+    }
+    sampler.buf = (u8 *)mmap(NULL, SAMPLER_WORDS * sizeof(u8), PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (sampler.buf == MAP_FAILED) {
+        sampler.buf = NULL;
+        printf("Error! cannot allocate the sample buffer\n");
+        return -1;
+    }
+    sampler.file = strdup(file);
+    sampler.pid = getpid();
+    sampler.hz = hz;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sampler_tick;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGPROF, &sa, NULL);
+    it.it_interval.tv_sec = 0;
+    it.it_interval.tv_usec = 1000000 / hz;
+    if (it.it_interval.tv_usec == 0)
+        it.it_interval.tv_usec = 1;
+    it.it_value = it.it_interval;
+    setitimer(ITIMER_PROF, &it, NULL);
+    atexit(sampler_finish);
+    return 0;
+}
@@ -0,0 +1,389 @@
+/*
+ * Simple Dalvik Virtual Machine Implementation
+ *
+ * Copyright (C) 2014 cycheng <createinfinite@yahoo.com.tw>
+ * Copyright (C) 2013 Chun-Yu Wang <wicanr2@gmail.com>
+ */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include "simple_dvm.h"
+#include "sdvm.h"
+
+/*  libsdvm, see sdvm.h
+ *
+ *  An sdvm_dex owns the parsed dex and the context it was loaded in (the
+ *  loader's heap). An sdvm_vm is a copyDexFile instance of it, with its own
+ *  context : every entry point switches to the instance's context for the
+ *  duration of the call, so all the state the interpreter touches is the
+ *  instance's.
+ */
+struct _sdvm_dex {
+    DexFileFormat dex;
+    sdvm_context ctx;
+};
+
+struct _sdvm_vm {
+    sdvm_dex *dex;
+    DexFileFormat inst;
+    sdvm_context ctx;
+    simple_dalvik_vm vm;
+    char *result_str;   /* UTF-8 copy of the last string result */
+};
+
+sdvm_dex *sdvm_dex_open(const char *path)
+{
+    sdvm_dex *d = (sdvm_dex *)calloc(1, sizeof(sdvm_dex));
+    sdvm_context *prev;
+    u8 t;
+
+    if (d == NULL)
+        return NULL;
+    sdvm_context_init(&d->ctx);
+    prev = sdvm_context_switch(&d->ctx);
+    if (parseDexFile((char *)path, &d->dex) != 0) {
+        sdvm_context_switch(prev);
+        sdvm_context_free(&d->ctx);
+        free(d);
+        return NULL;
+    }
+    /* from now on the shared tables are only read */
+    t = stats_now_ns();
+    link_classes(&d->dex);
+    resolve_string_data(&d->dex);
+    stats_lap(STATS_LINK, t);
+    sdvm_context_switch(prev);
+    return d;
+}
+
+void sdvm_dex_close(sdvm_dex *d)
+{
+    if (d == NULL)
+        return;
+    /* name the profile samples while the tables are there */
+    sampler_flush(&d->dex);
+    freeDexFile(&d->dex);
+    sdvm_context_free(&d->ctx);
+    free(d);
+}
+
+sdvm_vm *sdvm_vm_new(sdvm_dex *d)
+{
+    sdvm_vm *vm = (sdvm_vm *)calloc(1, sizeof(sdvm_vm));
+    sdvm_context *prev;
+
+    if (vm == NULL)
+        return NULL;
+    vm->dex = d;
+    sdvm_context_init(&vm->ctx);
+    prev = sdvm_context_switch(&vm->ctx);
+    copyDexFile(&vm->inst, &d->dex);
+    sdvm_context_switch(prev);
+    return vm;
+}
+
+void sdvm_vm_free(sdvm_vm *vm)
+{
+    if (vm == NULL)
+        return;
+    freeDexFile(&vm->inst);
+    sdvm_context_free(&vm->ctx);
+    free(vm->result_str);
+    free(vm);
+}
+
+void sdvm_vm_set_output(sdvm_vm *vm, sdvm_write_func fn, void *arg)
+{
+    vm->ctx.out_fn = fn;
+    vm->ctx.out_arg = arg;
+}
+
+void sdvm_vm_set_input(sdvm_vm *vm, int fd)
+{
+    vm->ctx.in.fd = fd;
+}
+
+void sdvm_vm_set_verbose(sdvm_vm *vm, int level)
+{
+    vm->ctx.verbose = level;
+}
+
+void sdvm_vm_set_budget(sdvm_vm *vm, unsigned long long insns, double seconds)
+{
+    vm->ctx.insn_limit = insns;
+    vm->ctx.time_limit_ns = seconds > 0 ? (u8)(seconds * 1e9) : 0;
+}
+
+void sdvm_vm_set_preempt(sdvm_vm *vm, sdvm_preempt_func fn, void *arg)
+{
+    vm->ctx.preempt_fn = fn;
+    vm->ctx.preempt_arg = arg;
+}
+
+int sdvm_vm_stats(sdvm_vm *vm, char *buf, size_t size)
+{
+    char *json = NULL;
+    size_t len = 0;
+    FILE *f = open_memstream(&json, &len);
+
+    if (f == NULL)
+        return -1;
+    stats_write(f, &vm->ctx, &vm->dex->ctx);
+    fclose(f);
+    if (size > 0)
+        snprintf(buf, size, "%s", json);
+    free(json);
+    return (int)len;
+}
+
+const char *sdvm_strerror(int err)
+{
+    switch (err) {
+    case SDVM_OK:
+        return "success";
+    case SDVM_ERR_CLASS:
+        return "no such class";
+    case SDVM_ERR_METHOD:
+        return "no such static method";
+    case SDVM_ERR_ARGS:
+        return "arguments don't match the method";
+    case SDVM_ERR_ABORTED:
+        return "aborted, over budget";
+    }
+    return "unknown error";
+}
+
+/* class_defs index of "Foo", "a.b.Foo" or "La/b/Foo;", -1 if not found */
+static int find_class(DexFileFormat *dex, const char *name)
+{
+    const size_t len = strlen(name);
+    char descriptor[256];
+    size_t i;
+    int type_id;
+
+    if (len >= 2 && name[0] == 'L' && name[len - 1] == ';') {
+        if (len >= sizeof(descriptor))
+            return -1;
+        strcpy(descriptor, name);
+    } else {
+        if (len + 3 > sizeof(descriptor))
+            return -1;
+        descriptor[0] = 'L';
+        for (i = 0; i < len; i++)
+            descriptor[i + 1] = name[i] == '.' ? '/' : name[i];
+        descriptor[len + 1] = ';';
+        descriptor[len + 2] = 0;
+    }
+    for (type_id = 0; type_id < dex->header.typeIdsSize; type_id++)
+        if (strcmp(get_type_item_name(dex, type_id), descriptor) == 0)
+            return dex->class_index[type_id];
+    return -1;
+}
+
+/* can a value of 'type' be passed as shorty type 'c' */
+static int arg_matches(char c, sdvm_type type)
+{
+    switch (c) {
+    case 'Z': case 'B': case 'S': case 'C': case 'I':
+        return type == SDVM_INT;
+    case 'J':
+        return type == SDVM_LONG;
+    case 'F':
+        return type == SDVM_FLOAT;
+    case 'D':
+        return type == SDVM_DOUBLE;
+    case 'L': case '[':
+        return type == SDVM_STRING || type == SDVM_OBJECT;
+    }
+    return FALSE;
+}
+
+/*  the static method 'name' of 'clazz' taking 'args', with its shorty ;
+ *  *err tells a missing method from a signature mismatch
+ */
+static encoded_method *find_static_method(DexFileFormat *dex, class_data_item *clazz,
+                                          const char *name, const sdvm_value *args,
+                                          int nargs, const char **shorty, int *err)
+{
+    int i, k;
+
+    *err = SDVM_ERR_METHOD;
+    for (i = 0; i < clazz->direct_methods_size; i++) {
+        encoded_method *m = &clazz->direct_methods[i];
+        const method_id_item *id = get_method_item(dex, m->method_id);
+        const char *s;
+
+        if (!(m->access_flags & ACC_STATIC) || m->code_off == 0 ||
+            strcmp(get_string_data(dex, id->name_idx), name) != 0)
+            continue;
+        *err = SDVM_ERR_ARGS;
+        s = get_string_data(dex, get_proto_item(dex, id->proto_idx)->shorty_idx);
+        if (strlen(s) != (size_t)nargs + 1)
+            continue;
+        for (k = 0; k < nargs; k++)
+            if (!arg_matches(s[k + 1], args[k].type))
+                break;
+        if (k == nargs) {
+            *shorty = s;
+            return m;
+        }
+    }
+    return NULL;
+}
+
+/*  the ins registers are the last ones of the frame, wide values take two
+ *  (see invoke_clazz_method), return FALSE if they don't fit
+ */
+static int set_arguments(simple_dalvik_vm *vm, const encoded_method *m,
+                         const sdvm_value *args, int nargs)
+{
+    int reg = m->code_item.registers_size - m->code_item.ins_size;
+    int k;
+
+    for (k = 0; k < nargs; k++) {
+        const sdvm_value *a = &args[k];
+        const int wide = a->type == SDVM_LONG || a->type == SDVM_DOUBLE;
+        u1 *p;
+
+        if (reg + wide >= m->code_item.registers_size)
+            return FALSE;
+        switch (a->type) {
+        case SDVM_LONG:
+            p = (u1 *)&a->v.j;
+            store_long_to_reg(vm, reg, p + 4);
+            store_long_to_reg(vm, reg + 1, p);
+            break;
+        case SDVM_DOUBLE:
+            p = (u1 *)&a->v.d;
+            store_double_to_reg(vm, reg, p + 4);
+            store_double_to_reg(vm, reg + 1, p);
+            break;
+        case SDVM_STRING: {
+            string_object *s = a->v.s ?
+                new_string_object_from_utf8(a->v.s, strlen(a->v.s)) : NULL;
+            store_to_reg(vm, reg, (u1 *)&s);
+            break;
+        }
+        default:
+            /* int, float and object references are 32 bits */
+            store_to_reg(vm, reg, (u1 *)&a->v);
+            break;
+        }
+        reg += 1 + wide;
+    }
+    return reg == m->code_item.registers_size;
+}
+
+static void get_result(sdvm_vm *vm, char type, sdvm_value *result)
+{
+    simple_dalvik_vm *v = &vm->vm;
+    u4 bottom;
+
+    memcpy(&bottom, &v->result[4], sizeof(bottom));
+    memset(result, 0, sizeof(sdvm_value));
+    switch (type) {
+    case 'V':
+        result->type = SDVM_VOID;
+        break;
+    case 'J':
+        result->type = SDVM_LONG;
+        load_result_to_double(v, (u1 *)&result->v.j);
+        break;
+    case 'D':
+        result->type = SDVM_DOUBLE;
+        load_result_to_double(v, (u1 *)&result->v.d);
+        break;
+    case 'F':
+        result->type = SDVM_FLOAT;
+        memcpy(&result->v.f, &bottom, sizeof(float));
+        break;
+    case 'L': case '[': {
+        sdvm_obj *obj = (sdvm_obj *)(uintptr_t)bottom;
+        if (is_string_object(obj)) {
+            string_object *s = (string_object *)obj;
+            free(vm->result_str);
+            vm->result_str = (char *)malloc(string_object_utf8_size(s) + 1);
+            vm->result_str[string_object_to_utf8(s, vm->result_str)] = 0;
+            result->type = SDVM_STRING;
+            result->v.s = vm->result_str;
+        } else {
+            result->type = SDVM_OBJECT;
+            result->v.o = obj;
+        }
+        break;
+    }
+    default:
+        result->type = SDVM_INT;
+        result->v.i = (int)bottom;
+        break;
+    }
+}
+
+int sdvm_invoke(sdvm_vm *vm, const char *clazz_name, const char *method,
+                const sdvm_value *args, int nargs, sdvm_value *result)
+{
+    DexFileFormat *dex = &vm->inst;
+    sdvm_context *prev = sdvm_context_switch(&vm->ctx);
+    class_data_item *clazz;
+    encoded_method *m;
+    const char *shorty = NULL;
+    int index, ret = SDVM_OK;
+    jmp_buf abort_jmp;
+
+    index = find_class(dex, clazz_name);
+    if (index < 0) {
+        ret = SDVM_ERR_CLASS;
+        goto out;
+    }
+    clazz = load_class(dex, index);
+    m = find_static_method(dex, clazz, method, args, nargs, &shorty, &ret);
+    if (m == NULL)
+        goto out;
+    ret = SDVM_OK;
+
+    if (is_verbose())
+        printf("sdvm_invoke %s.%s (%s)\n", clazz_name, method, shorty);
+    memset(&vm->vm, 0, sizeof(simple_dalvik_vm));
+    vm->ctx.run_dex = dex;
+    vm->ctx.run_vm = &vm->vm;
+    budget_start(&vm->ctx);
+    stats_run_begin(&vm->ctx);
+    vm->ctx.abort_jmp = &abort_jmp;
+    if (setjmp(abort_jmp) != 0) {
+        ret = SDVM_ERR_ABORTED;
+        goto out;
+    }
+    init_class(dex, &vm->vm, clazz);
+    memset(vm->vm.regs, 0, sizeof(vm->vm.regs));
+    if (!set_arguments(&vm->vm, m, args, nargs)) {
+        ret = SDVM_ERR_ARGS;
+        goto out;
+    }
+    runMethod(dex, &vm->vm, m);
+#ifdef SDVM_OPSTATS
+    opstats_end(&vm->vm);
+#endif
+    if (result)
+        get_result(vm, shorty[0], result);
+out:
+    stats_run_end(&vm->ctx);
+    vm->ctx.abort_jmp = NULL;
+    sdvm_context_switch(prev);
+    return ret;
+}
+
+int sdvm_run(sdvm_vm *vm, const char *entry)
+{
+    sdvm_context *prev = sdvm_context_switch(&vm->ctx);
+    jmp_buf abort_jmp;
+    volatile int ret = SDVM_ERR_ABORTED;
+
+    vm->ctx.abort_jmp = &abort_jmp;
+    if (setjmp(abort_jmp) == 0)
+        ret = simple_dvm_startup(&vm->inst, &vm->vm, (char *)entry) == 0 ?
+              SDVM_OK : SDVM_ERR_METHOD;
+    stats_run_end(&vm->ctx);
+    vm->ctx.abort_jmp = NULL;
+    sdvm_context_switch(prev);
+    return ret;
+}
@@ -0,0 +1,102 @@
+/*
+ * Simple Dalvik Virtual Machine Implementation
+ *
+ * Copyright (C) 2014 cycheng <createinfinite@yahoo.com.tw>
+ * Copyright (C) 2013 Chun-Yu Wang <wicanr2@gmail.com>
+ */
+
+#ifndef SDVM_H
+#define SDVM_H
+
+#include <stddef.h>
+
+/*  libsdvm : the VM as a library
+ *
+ *    sdvm_dex *dex = sdvm_dex_open("Foo.dex");
+ *    sdvm_vm *vm = sdvm_vm_new(dex);
+ *    sdvm_value arg = { SDVM_INT, { .i = 10 } }, ret;
+ *    if (sdvm_invoke(vm, "Foo", "fib", &arg, 1, &ret) == SDVM_OK)
+ *        printf("%d\n", ret.v.i);
+ *    sdvm_vm_free(vm);
+ *    sdvm_dex_close(dex);
+ *
+ *  A dex is parsed, verified and linked once by sdvm_dex_open, and is only
+ *  read after that. Every VM instance has its own heap, class states,
+ *  static fields and guest stdout, so instances don't see each other.
+ *  Different instances may run on different threads at the same time; a
+ *  single instance must not be used by two threads at once.
+ */
+typedef struct _sdvm_dex sdvm_dex;
+typedef struct _sdvm_vm sdvm_vm;
+
+typedef enum _sdvm_type {
+    SDVM_VOID = 0,
+    SDVM_INT,       /* int, and boolean / byte / short / char */
+    SDVM_LONG,
+    SDVM_FLOAT,
+    SDVM_DOUBLE,
+    SDVM_STRING,    /* java.lang.String, as UTF-8 */
+    SDVM_OBJECT     /* any other reference, opaque */
+} sdvm_type;
+
+typedef struct _sdvm_value {
+    sdvm_type type;
+    union {
+        int i;
+        long long j;
+        float f;
+        double d;
+        const char *s;  /* a result string belongs to the VM, see sdvm_invoke */
+        void *o;
+    } v;
+} sdvm_value;
+
+/* sdvm_invoke results */
+#define SDVM_OK            0
+#define SDVM_ERR_CLASS    -1    /* no such class in the dex */
+#define SDVM_ERR_METHOD   -2    /* no such static method */
+#define SDVM_ERR_ARGS     -3    /* no overload takes these arguments */
+#define SDVM_ERR_ABORTED  -4    /* over budget or preempted, see below */
+
+/* receives the guest's System.out output */
+typedef void (*sdvm_write_func)(void *arg, const void *data, size_t len);
+/* called every few thousand instructions, return non-zero to abort */
+typedef int (*sdvm_preempt_func)(void *arg, unsigned long long insns);
+
+/* NULL if the file can't be read or fails verification */
+sdvm_dex *sdvm_dex_open(const char *path);
+/* every VM instance of 'dex' has to be freed first */
+void sdvm_dex_close(sdvm_dex *dex);
+
+sdvm_vm *sdvm_vm_new(sdvm_dex *dex);
+void sdvm_vm_free(sdvm_vm *vm);
+/* NULL : the process's stdout (default) */
+void sdvm_vm_set_output(sdvm_vm *vm, sdvm_write_func fn, void *arg);
+/* where the guest's System.in reads from (default 0 : stdin) */
+void sdvm_vm_set_input(sdvm_vm *vm, int fd);
+void sdvm_vm_set_verbose(sdvm_vm *vm, int level);
+/*  Bound each sdvm_invoke / sdvm_run : past 'insns' instructions or
+ *  'seconds' (0 : no limit), the call is aborted with SDVM_ERR_ABORTED and
+ *  a report of the guest stack on stderr. The instance's static state may
+ *  be half updated after that, it is best freed.
+ */
+void sdvm_vm_set_budget(sdvm_vm *vm, unsigned long long insns, double seconds);
+void sdvm_vm_set_preempt(sdvm_vm *vm, sdvm_preempt_func fn, void *arg);
+
+/*  Run the static method 'method' of 'clazz' ("Foo", "a.b.Foo" or
+ *  "La/b/Foo;") with 'nargs' arguments, the class is initialized first if
+ *  needed. A string result stays valid until the next call on 'vm'.
+ */
+int sdvm_invoke(sdvm_vm *vm, const char *clazz, const char *method,
+                const sdvm_value *args, int nargs, sdvm_value *result);
+/* run the first static method named 'entry', as the dvm tool does */
+int sdvm_run(sdvm_vm *vm, const char *entry);
+/*  The counters of 'vm' as JSON (parse time of its dex, class init time,
+ *  instructions, invokes, native calls, allocations, run times, peak RSS
+ *  of the process) into 'buf', like snprintf : returns the length of the
+ *  whole text, -1 on error.
+ */
+int sdvm_vm_stats(sdvm_vm *vm, char *buf, size_t size);
+const char *sdvm_strerror(int err);
+
+#endif
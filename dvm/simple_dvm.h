@@ -11,6 +11,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <setjmp.h>
+#if defined(SDVM_OPSTATS) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#endif
 
 typedef signed char s1;
 typedef short u2;
@@ -61,9 +65,9 @@ typedef struct _type_list {
 
 /* string_ids */
 typedef struct _string_data_item {
-    int index;
-    int uleb128_len;
-    u1  data[255];
+    u4  data_off;       /* MUTF-8 bytes in the mapped file, 0 : unresolved */
+    u4  utf16_size;
+    u4  byte_size;
 } string_data_item;
 
 typedef struct _string_ids {
@@ -179,6 +183,39 @@ typedef struct _sdvm_obj {
     void *other_data;
 } sdvm_obj;
 
+/*  java.lang.String object (sdvm internal class, other_data = ICT_STRING_OBJ)
+ *
+ *  value points to 'count' Latin-1 bytes or 'count' UTF-16 units depending on
+ *  coder. It normally points right behind the object, but may also point into
+ *  a buffer owned by somebody else. hash caches String.hashCode().
+ */
+#define STRING_CODER_LATIN1 0
+#define STRING_CODER_UTF16  1
+
+typedef struct _string_object {
+    sdvm_obj obj;
+    uint count;
+    int  hash;
+    u1   coder;
+    u1   hash_is_set;
+    const void *value;
+} string_object;
+
+/*  java.lang.StringBuilder object (other_data = ICT_STRING_BUILDER_OBJ)
+ *
+ *  value holds 'count' chars in a buffer of 'capacity' chars, grown
+ *  geometrically. toString() hands the buffer to the String without a copy
+ *  and marks it shared, the next append copies it first.
+ */
+typedef struct _string_builder_object {
+    sdvm_obj obj;
+    uint count;
+    uint capacity;
+    u1   coder;
+    u1   shared;
+    void *value;
+} string_builder_object;
+
 typedef struct _static_field_data {
     /*  e.g. Msg.out = System.err;
      *  out is a static object, err is an object, out will actually point to err
@@ -225,8 +262,16 @@ typedef struct _class_data_item {
      *  instance_fields tell me the object layout
      */
     uint class_inst_size;
+
+    u1 state;   /* CLASS_xxx, classes are loaded and initialized lazily */
 } class_data_item;
 
+#define CLASS_UNLOADED      0   /* only the class_def is known */
+#define CLASS_LINKED        1   /* class data parsed, layout ready */
+#define CLASS_LOADED        2   /* static data (sdata) ready */
+#define CLASS_INITIALIZING  3   /* <clinit> is running */
+#define CLASS_INITIALIZED   4
+
 typedef struct _DexHeader {
     u1 magic[8]; /* includes version number */
     u1 checksum[4]; /* adler32 checksum */
@@ -257,6 +302,7 @@ typedef struct DexFileFormat {
     DexHeader header;
     string_ids       *string_ids;
     string_data_item *string_data_item;
+    string_object    **string_obj;  /* interned const-string, by string_id */
     type_id_item     *type_id_item;
     proto_id_item    *proto_id_item;
     type_list        *proto_type_list;
@@ -264,6 +310,7 @@ typedef struct DexFileFormat {
     method_id_item   *method_id_item;
     class_def_item   *class_def_item;
     class_data_item  *class_data_item;
+    int              *class_index;  /* type_id -> class_defs index, or -1 */
 
     static_field_data*undef_sdata;  /* for those undefined static obj */
     uint             undef_id_start;
@@ -272,12 +319,20 @@ typedef struct DexFileFormat {
 
     map_list         map_list;
     type_list        type_list;
-    u1               *data;
+    u1               *data;         /* data section, inside the mapping */
+
+    u1               *map_base;     /* the whole dex file, mapped read-only */
+    size_t           map_size;
+    u1               *image_base;   /* pre-linked image, see image.c */
+    size_t           image_size;
+    const struct DexFileFormat *instance_of; /* see copyDexFile */
 } DexFileFormat;
 
 /* Dex File Parser */
 int parseDexFile(char *file, DexFileFormat *dex);
 void printDexFile(DexFileFormat *dex);
+void copyDexFile(DexFileFormat *inst, const DexFileFormat *dex);
+void freeDexFile(DexFileFormat *dex);
 
 /* map list parser */
 void parse_map_list(DexFileFormat *dex, unsigned char *buf, int offset);
@@ -285,6 +340,9 @@ void parse_map_list(DexFileFormat *dex, unsigned char *buf, int offset);
 /* String ids parser */
 void parse_string_ids(DexFileFormat *dex, unsigned char *buf, int offset);
 char *get_string_data(DexFileFormat *dex, int string_id);
+char *get_string_data_len(DexFileFormat *dex, int string_id,
+                          uint *byte_size, uint *utf16_size);
+void resolve_string_data(DexFileFormat *dex);
 
 /* type_ids parser */
 void parse_type_ids(DexFileFormat *dex, unsigned char *buf, int offset);
@@ -305,14 +363,19 @@ const char *get_class_name(DexFileFormat *dex, int field_id);
 /* method ids parser */
 void parse_method_ids(DexFileFormat *dex, unsigned char *buf, int offset);
 method_id_item *get_method_item(DexFileFormat *dex, int method_id);
+void get_method_full_name(DexFileFormat *dex, int method_id, char *out, size_t size);
 
 /* class defs parser */
 void parse_class_defs(DexFileFormat *dex, unsigned char *buf, int offset);
 sdvm_obj * get_static_obj_by_fieldid(DexFileFormat *dex, const int fieldid);
 static_field_data * get_static_field_data_by_fieldid(DexFileFormat *dex, const int fieldid);
 class_data_item *get_class_data_by_typeid(DexFileFormat *dex, const int type_id);
-class_data_item *get_class_data_by_typeid_in_range(DexFileFormat *dex, const int type_id,
-                                                   const uint max_count);
+class_data_item *get_class_data_by_fieldid(DexFileFormat *dex, const int fieldid);
+class_data_item *load_class(DexFileFormat *dex, const int index);
+class_data_item *link_class(DexFileFormat *dex, const int index);
+void link_classes(DexFileFormat *dex);
+void create_undef_sdata(DexFileFormat *dex);
+int verify_class_defs(DexFileFormat *dex);
 int get_uleb128_len(unsigned char *buf, int offset, int *size);
 
 /* generic parameter parser for 35c */
@@ -327,6 +390,13 @@ typedef struct _simple_dvm_register {
     u1 data[4];
 } simple_dvm_register;
 
+/* shadow stack of the methods being run, see runMethod */
+#define VM_MAX_FRAMES 256
+typedef struct _vm_frame {
+    encoded_method *method;
+    uint pc;        /* of the call, for the callers ; vm->pc for the top */
+} vm_frame;
+
 typedef struct _simple_dalvik_vm {
     u1 heap[8192];
     //u4 stack[8192];
@@ -337,6 +407,17 @@ typedef struct _simple_dalvik_vm {
     invoke_parameters p;
     u1 result[8];
     uint pc;
+
+    vm_frame frames[VM_MAX_FRAMES];
+    int depth;      /* may exceed VM_MAX_FRAMES, deeper frames aren't kept */
+
+    /* instructions left in / given to this slice, see budget.c */
+    s8 budget;
+    s8 slice;
+
+#ifdef SDVM_OPSTATS
+    struct _opcode_stats *opstats;
+#endif
 } simple_dalvik_vm;
 
 /* convert to int ok */
@@ -357,7 +438,8 @@ void store_to_bottom_half_result(simple_dalvik_vm *vm, unsigned char *ptr);
 void move_top_half_result_to_reg(simple_dalvik_vm *vm, int id);
 void move_bottom_half_result_to_reg(simple_dalvik_vm *vm, int id);
 
-void simple_dvm_startup(DexFileFormat *dex, simple_dalvik_vm *vm, char *entry);
+int simple_dvm_startup(DexFileFormat *dex, simple_dalvik_vm *vm, char *entry);
+void simple_dvm_preload(DexFileFormat *dex, simple_dalvik_vm *vm, char *entry);
 void runMethod(DexFileFormat *dex, simple_dalvik_vm *vm, encoded_method *m);
 
 void push(simple_dalvik_vm *vm, const u4 data);
@@ -365,11 +447,359 @@ u4 pop(simple_dalvik_vm *vm);
 
 void invoke_clazz_method(DexFileFormat *dex, simple_dalvik_vm *vm,
                          class_data_item *clazz, invoke_parameters *p);
+void init_class(DexFileFormat *dex, simple_dalvik_vm *vm, class_data_item *clazz);
+void init_class_by_fieldid(DexFileFormat *dex, simple_dalvik_vm *vm, const int fieldid);
 uint get_field_size(DexFileFormat *dex, const uint field_id);
 int get_field_type(DexFileFormat *dex, const uint field_id);
 
-sdvm_obj *create_sdvm_obj(void);
+sdvm_obj *create_sdvm_obj(const char *type);
+
+/* sdvm heap, every object reference has to fit in a 32-bit register */
+typedef struct _sdvm_heap_chunk {
+    u1 *base;
+    size_t size;
+    size_t used;
+    u1 *starts;     /* bitmap, one bit per 8 bytes : an object starts here */
+    u1 mapped;      /* base comes from mmap, not calloc */
+    struct _sdvm_heap_chunk *next;
+} sdvm_heap_chunk;
+typedef void (*sdvm_heap_visit)(void *arg, sdvm_heap_chunk *chunk, u1 *obj, size_t size);
+/* 'type' : a descriptor, or "(what)" for VM internals, see allocprof.c */
+void *sdvm_heap_alloc(size_t size, const char *type);
+sdvm_heap_chunk *sdvm_heap_chunks(void);
+void sdvm_heap_walk(sdvm_heap_visit fn, void *arg);
+
+/* malloc'd buffers that live as long as the heap, see heap.c */
+typedef struct _sdvm_buffer {
+    struct _sdvm_buffer *prev;
+    struct _sdvm_buffer *next;
+} sdvm_buffer;
+void *sdvm_buffer_alloc(size_t size);
+void sdvm_buffer_free(void *p);
+
+/* guest stdin chunks, see input.c */
+typedef struct _input_chunk {
+    struct _input_chunk *next;
+    char data[];
+} input_chunk;
+
+typedef struct _input_state {
+    int fd;                 /* where lines come from, 0 : stdin */
+    input_chunk *chunks;    /* every chunk so far, the current one first */
+    char *chunk;            /* current chunk's data */
+    size_t size;            /* chunk capacity */
+    size_t pos;             /* start of the next line */
+    size_t end;             /* end of valid data */
+    int eof;
+    int skip_lf;            /* last line ended with '\r' */
+} input_state;
+
+typedef void (*output_func)(void *arg, const void *data, size_t len);
+/* called every budget slice, return non-zero to abort the run */
+typedef int (*budget_func)(void *arg, u8 used);
+
+/* runtime counters of a context, see stats.c */
+enum {
+    STATS_MAP_LIST,
+    STATS_STRING_IDS,
+    STATS_TYPE_IDS,
+    STATS_PROTO_IDS,
+    STATS_FIELD_IDS,
+    STATS_METHOD_IDS,
+    STATS_CLASS_DEFS,
+    STATS_VERIFY,
+    STATS_IMAGE,
+    STATS_LINK,
+    STATS_SECTIONS
+};
+
+typedef struct _sdvm_stats {
+    u8 parse_ns[STATS_SECTIONS];
+    u8 class_inits;
+    u8 class_init_ns;       /* outermost <clinit> runs */
+    int init_depth;
+    u8 insns;
+    u8 invokes;
+    u8 natives;
+    u8 alloc_objects;
+    u8 alloc_bytes;
+    u8 runs;
+    u8 run_ns;
+    u8 run_cpu_ns;
+    u8 run_start_ns;        /* 0 : no run in progress */
+    u8 run_start_cpu_ns;
+} sdvm_stats;
+
+/*  binary trace, see trace.c : a trace_header, then one trace_record per
+ *  instruction run, each followed by one per register it changed (with
+ *  TRACE_FLAG_REGS) ; little endian, as the dex
+ */
+#define TRACE_MAGIC         "SDVMTRC1"
+#define TRACE_FLAG_REGS     1
+#define TRACE_FLAG_RING     2   /* the last records only */
+#define TRACE_INSN          0
+#define TRACE_REG           1
+
+typedef struct _trace_header {
+    char magic[8];
+    u1 checksum[4];     /* of the dex, see DexHeader */
+    u4 flags;
+    u8 dropped;         /* records the ring lost */
+} trace_header;
+
+typedef struct _trace_record {
+    ushort method_id;
+    u1 kind;            /* TRACE_xxx */
+    u1 op;              /* opcode, or register number */
+    u4 value;           /* dex pc (code units), or register value */
+} trace_record;
+
+typedef struct _trace_state {
+    FILE *f;
+    int flags;
+    int started;        /* header written */
+    u1 checksum[4];
+    trace_record *buf;
+    size_t cap;
+    size_t count;       /* in buf ; a ring wraps around at cap */
+    u8 total;
+    u4 shadow[32];      /* registers as last traced */
+} trace_state;
+
+/*  Per-instance state, see context.c. The thread's current context is the
+ *  one every module works on.
+ */
+typedef struct _sdvm_context {
+    int verbose;
+
+    /* heap.c */
+    sdvm_heap_chunk *heap_chunks;
+    sdvm_heap_chunk *heap_cur;
+    sdvm_buffer *buffers;       /* sdvm_buffer_alloc */
+    struct _alloc_table *alloc;     /* allocprof.c */
+
+    /* output.c : bytes written so far, and where they go (NULL : stdout) */
+    u8 out_written;
+    output_func out_fn;
+    void *out_arg;
+
+    /* input.c */
+    input_state in;
+
+    /* the run in progress, e.g. for the sampler */
+    struct DexFileFormat *run_dex;
+    struct _simple_dalvik_vm *run_vm;
+
+    /* budget.c : limits of a run (0 : none), and what it used so far */
+    u8 insn_limit;
+    u8 time_limit_ns;
+    u8 insn_used;
+    u8 start_ns;
+    budget_func preempt_fn;
+    void *preempt_arg;
+    jmp_buf *abort_jmp;     /* where an aborted run goes, NULL : exit */
+
+    /* stats.c */
+    sdvm_stats stats;
+
+    /* trace.c, NULL : not tracing */
+    trace_state *trace;
+
+    /* image.c, boot_image.c */
+    const char *image_dir;
+    const char *boot_file;
+    int boot_load_tried;
+    int boot_save_tried;
+    int boot_loaded;
+} sdvm_context;
+
+sdvm_context *sdvm_context_current(void);
+sdvm_context *sdvm_context_switch(sdvm_context *ctx);
+void sdvm_context_init(sdvm_context *ctx);
+void sdvm_context_free(sdvm_context *ctx);
+void sdvm_heap_free(sdvm_context *ctx);
+void input_free(sdvm_context *ctx);
+
+/* java.lang.String objects */
+int is_string_object(const sdvm_obj *obj);
+string_object *new_string_object(const void *value, uint count, int coder);
+string_object *new_string_object_ref(const void *value, uint count, int coder);
+string_object *new_string_object_from_utf8(const char *str, uint len);
+string_object *get_const_string_object(DexFileFormat *dex, int string_id);
+ushort string_object_char_at(const string_object *s, uint index);
+int string_object_hash_code(string_object *s);
+int string_object_equals(const string_object *a, const string_object *b);
+int string_object_compare_to(const string_object *a, const string_object *b);
+int string_object_parse_long(const string_object *s, s8 min, s8 max, s8 *val);
+uint string_object_utf8_size(const string_object *s);
+uint string_object_to_utf8(const string_object *s, char *out);
+void print_string_object(const string_object *s);
+
+/* java.lang.StringBuilder objects */
+void string_builder_init(string_builder_object *sb, uint capacity);
+void string_builder_append_latin1(string_builder_object *sb, const char *str, uint len);
+void string_builder_append_char(string_builder_object *sb, ushort ch);
+void string_builder_append_string(string_builder_object *sb, const string_object *s);
+string_object *string_builder_to_string(string_builder_object *sb);
+
+/* number to decimal string, Java formatting rules */
+#define NUM_FORMAT_BUF_SIZE 32
+int format_int(int v, char *out);
+int format_long(s8 v, char *out);
+int format_double(double v, char *out);
+int format_float(float v, char *out);
+
+/* guest standard output, see output.c */
+#define OUTPUT_DEFAULT      0
+#define OUTPUT_LINE         1
+#define OUTPUT_FULL         2
+#define OUTPUT_ASYNC        3
+#define OUTPUT_DEFAULT_SIZE (64 * 1024)
+void output_init(int mode, size_t size);
+int output_parse_mode(const char *name);
+void output_write(const void *data, size_t len);
+void output_flush(void);
+u8 output_written(void);
+
+/* guest standard input, see input.c */
+string_object *input_read_line(void);
+int input_started(void);
+
+/* pre-linked image cache, see image.c */
+void image_init(const char *dir);
+int image_load(DexFileFormat *dex);
+int image_save(DexFileFormat *dex);
+
+/* heap snapshot after class initialization, see boot_image.c */
+void boot_image_init(const char *file);
+int boot_image_load(DexFileFormat *dex);
+int boot_image_save(DexFileFormat *dex);
+
+/* fork server, see zygote.c */
+int zygote_serve(const char *socket_path, char **dex_files, int dex_count,
+                 const char *entry, int out_mode, size_t out_size);
+int zygote_connect(const char *socket_path, const char *dex_file, const char *entry);
+
+/* bounded execution, see budget.c */
+#define BUDGET_ABORTED 124  /* exit status, as timeout(1) */
+void budget_start(sdvm_context *ctx);
+void budget_expired(DexFileFormat *dex, simple_dalvik_vm *vm);
+void budget_sync(sdvm_context *ctx, simple_dalvik_vm *vm);
+void print_frames(FILE *f, DexFileFormat *dex, simple_dalvik_vm *vm);
+
+/* sampling profiler, see sampler.c */
+int sampler_start(const char *file, int hz);
+void sampler_flush(DexFileFormat *dex);
+void sampler_finish(void);
+
+/* opcode histograms of a profiling build (make OPSTATS=1), see opstats.c */
+int opstats_init(const char *file);
+#ifdef SDVM_OPSTATS
+typedef struct _opcode_stats {
+    struct _opcode_stats *next;
+    u8 count[256];
+    u8 cycles[256];         /* in the handler, not counting nested runs */
+    u8 charged;             /* cycles given to handlers so far */
+    int prev;               /* last opcode, -1 : none yet */
+    u8 pairs[256 * 256];    /* [previous << 8 | opcode] */
+} opcode_stats;
+
+#if defined(__x86_64__) || defined(__i386__)
+#define opstats_clock() __rdtsc()
+#else
+u8 opstats_clock(void);
+#endif
+opcode_stats *opstats_get(simple_dalvik_vm *vm);
+void opstats_end(simple_dalvik_vm *vm);
+
+/* opcode 'op' is about to run */
+static inline void opstats_enter(opcode_stats *st, u1 op)
+{
+    st->count[op]++;
+    if (st->prev >= 0)
+        st->pairs[st->prev << 8 | op]++;
+    st->prev = op;
+}
+
+/*  it took 'cycles', including the handlers run meanwhile (an invoke) ;
+ *  'charged' is st->charged when it started
+ */
+static inline void opstats_leave(opcode_stats *st, u1 op, u8 cycles, u8 charged)
+{
+    cycles -= st->charged - charged;
+    st->cycles[op] += cycles;
+    st->charged += cycles;
+}
+#endif
+
+/* call graph profiler, see callgraph.c */
+extern int callgraph_on;
+int callgraph_start(const char *file);
+void callgraph_enter(DexFileFormat *dex, simple_dalvik_vm *vm, encoded_method *m);
+void callgraph_enter_native(const void *key, const char *clazz, const char *method);
+void callgraph_leave(void);
+
+/* allocation profiler, see allocprof.c */
+extern int allocprof_on;
+int allocprof_start(const char *file, long sample_bytes);
+void allocprof_record(sdvm_context *ctx, size_t size, const char *type);
+void allocprof_release(sdvm_context *ctx);
+
+/* runtime statistics, see stats.c */
+u8 stats_now_ns(void);
+u8 stats_lap(int section, u8 since);
+void stats_run_begin(sdvm_context *ctx);
+void stats_run_end(sdvm_context *ctx);
+void stats_release(sdvm_context *ctx);
+void stats_write(FILE *f, const sdvm_context *ctx, const sdvm_context *loader);
+int stats_start(const char *file);
+
+/* binary trace, see trace.c and tracedump.c */
+int trace_open(sdvm_context *ctx, const char *file, long ring, int regs);
+void trace_close(sdvm_context *ctx);
+void trace_insn(trace_state *t, DexFileFormat *dex, const encoded_method *m, uint pc, u1 op);
+void trace_regs(trace_state *t, const simple_dalvik_vm *vm);
+
+/* Chrome trace event timeline, see timeline.c */
+extern int timeline_on;
+int timeline_start(const char *file, long min_us);
+void timeline_span(const char *cat, const char *name, u8 start, u8 end);
+void timeline_method(DexFileFormat *dex, const encoded_method *m, u8 start);
+void timeline_native(const char *clazz, const char *method, u8 start);
+
+/* hardware performance counters per phase, see perfctr.c */
+enum {
+    PERFCTR_CYCLES,
+    PERFCTR_INSTRUCTIONS,
+    PERFCTR_BRANCH_MISSES,
+    PERFCTR_L1D_MISSES,
+    PERFCTR_EVENTS
+};
+
+enum {
+    PERFCTR_PARSE,
+    PERFCTR_INIT,
+    PERFCTR_EXECUTE,
+    PERFCTR_PHASES
+};
+
+int perfctr_start(void);
+void perfctr_phase(int phase);
+
+/* many jobs in one process, see batch.c */
+int batch_run(const char *manifest, int workers);
+
+/* the entry run again and again after one load, see repeat.c */
+int repeat_run(char *file, char *entry, int iterations, int warmup, int reset);
+
+/* loader worker threads, see thread_pool.c */
+typedef void (*thread_pool_func)(void *arg, int index);
+void thread_pool_init(int threads);
+int thread_pool_size(void);
+void thread_pool_for(int count, thread_pool_func fn, void *arg);
+
 void printRegs(simple_dalvik_vm *vm);
+const char *opcode_name(u1 op);
 
 typedef int (*opCodeFunc)(DexFileFormat *dex, simple_dalvik_vm *vm, u1 *ptr, int *pc);
 
@@ -390,7 +820,9 @@ typedef enum _internal_class_type {
     ICT_NEW_FILLED_ARRAY = 1,
     ICT_NEW_ARRAY_OBJ,
     ICT_MULTI_DIM_ARRAY_OBJ,
-    ICT_UNDEF_STATIC_OBJ
+    ICT_UNDEF_STATIC_OBJ,
+    ICT_STRING_OBJ,
+    ICT_STRING_BUILDER_OBJ
 } internal_class_type;
 
 typedef struct _new_filled_array {
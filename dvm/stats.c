@@ -0,0 +1,212 @@
+/*
+ * Simple Dalvik Virtual Machine Implementation
+ *
+ * Copyright (C) 2014 cycheng <createinfinite@yahoo.com.tw>
+ * Copyright (C) 2013 Chun-Yu Wang <wicanr2@gmail.com>
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+#include "simple_dvm.h"
+
+/*  Runtime statistics
+ *
+ *  Every context counts what happens in it (ctx->stats) : time spent in
+ *  each step of parseDexFile, class initialization, instructions, invokes,
+ *  native calls, allocations, and the wall and CPU time of its runs. The
+ *  counters are bumped in place by the modules concerned, a context is
+ *  only used by one thread at a time.
+ *
+ *  dvm --stats=FILE writes them as JSON at exit, for the whole process :
+ *  the default context, plus every context freed before (the jobs of a
+ *  batch, see stats_release). Library users get the counters of an
+ *  instance with sdvm_vm_stats, see sdvm.h.
+ */
+static const char *stats_section_names[STATS_SECTIONS] = {
+    "map_list",
+    "string_ids",
+    "type_ids",
+    "proto_ids",
+    "field_ids",
+    "method_ids",
+    "class_defs",
+    "verify",
+    "image",
+    "link",
+};
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static sdvm_stats stats_freed;      /* of the contexts already gone */
+static char *stats_file;
+static pid_t stats_pid;
+static u8 stats_process_start;
+
+u8 stats_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u8)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static u8 stats_cpu_ns(clockid_t clock)
+{
+    struct timespec ts;
+    if (clock_gettime(clock, &ts) != 0)
+        return 0;
+    return (u8)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* charge the time since 'since' to parse step 'section', return now */
+u8 stats_lap(int section, u8 since)
+{
+    const u8 now = stats_now_ns();
+    sdvm_context_current()->stats.parse_ns[section] += now - since;
+    if (timeline_on) {
+        char name[32];
+        /* named after the parser functions */
+        snprintf(name, sizeof(name), "%s%s", section < STATS_VERIFY ? "parse_" : "",
+                 stats_section_names[section]);
+        timeline_span("load", name, since, now);
+    }
+    return now;
+}
+
+void stats_run_begin(sdvm_context *ctx)
+{
+    ctx->stats.init_depth = 0;
+    ctx->stats.run_start_ns = stats_now_ns();
+    /* embedded, the process is timed from the first run */
+    __sync_bool_compare_and_swap(&stats_process_start, 0, ctx->stats.run_start_ns);
+    ctx->stats.run_start_cpu_ns = stats_cpu_ns(CLOCK_THREAD_CPUTIME_ID);
+}
+
+void stats_run_end(sdvm_context *ctx)
+{
+    sdvm_stats *s = &ctx->stats;
+    u8 now;
+
+    if (s->run_start_ns == 0)
+        return;
+    budget_sync(ctx, ctx->run_vm);
+    now = stats_now_ns();
+    s->runs++;
+    s->run_ns += now - s->run_start_ns;
+    s->run_cpu_ns += stats_cpu_ns(CLOCK_THREAD_CPUTIME_ID) - s->run_start_cpu_ns;
+    if (timeline_on)
+        timeline_span("vm", "run", s->run_start_ns, now);
+    s->run_start_ns = 0;
+}
+
+static void stats_add(sdvm_stats *to, const sdvm_stats *s)
+{
+    int i;
+
+    for (i = 0; i < STATS_SECTIONS; i++)
+        to->parse_ns[i] += s->parse_ns[i];
+    to->class_inits += s->class_inits;
+    to->class_init_ns += s->class_init_ns;
+    to->insns += s->insns;
+    to->invokes += s->invokes;
+    to->natives += s->natives;
+    to->alloc_objects += s->alloc_objects;
+    to->alloc_bytes += s->alloc_bytes;
+    to->runs += s->runs;
+    to->run_ns += s->run_ns;
+    to->run_cpu_ns += s->run_cpu_ns;
+}
+
+/* 'ctx' is going away, keep its counters for the process totals */
+void stats_release(sdvm_context *ctx)
+{
+    stats_run_end(ctx);
+    pthread_mutex_lock(&stats_lock);
+    stats_add(&stats_freed, &ctx->stats);
+    pthread_mutex_unlock(&stats_lock);
+}
+
+static void stats_write_json(FILE *f, const sdvm_stats *s, const sdvm_stats *parse)
+{
+    struct rusage ru;
+    u8 parse_total = 0;
+    int i;
+
+    fprintf(f, "{\n  \"parse_ns\": {");
+    for (i = 0; i < STATS_SECTIONS; i++) {
+        fprintf(f, "%s\n    \"%s\": %llu", i ? "," : "", stats_section_names[i],
+                (unsigned long long)parse->parse_ns[i]);
+        parse_total += parse->parse_ns[i];
+    }
+    fprintf(f, ",\n    \"total\": %llu\n  },\n", (unsigned long long)parse_total);
+    fprintf(f, "  \"class_inits\": %llu,\n  \"class_init_ns\": %llu,\n",
+            (unsigned long long)s->class_inits, (unsigned long long)s->class_init_ns);
+    fprintf(f, "  \"instructions\": %llu,\n  \"invokes\": %llu,\n  \"native_calls\": %llu,\n",
+            (unsigned long long)s->insns, (unsigned long long)s->invokes,
+            (unsigned long long)s->natives);
+    fprintf(f, "  \"allocations\": {\"objects\": %llu, \"bytes\": %llu},\n",
+            (unsigned long long)s->alloc_objects, (unsigned long long)s->alloc_bytes);
+    /* the heap has no collector, objects go away with their context */
+    fprintf(f, "  \"gc\": {\"cycles\": 0, \"pause_ns\": 0},\n");
+    fprintf(f, "  \"runs\": %llu,\n  \"run_wall_ns\": %llu,\n  \"run_cpu_ns\": %llu,\n",
+            (unsigned long long)s->runs, (unsigned long long)s->run_ns,
+            (unsigned long long)s->run_cpu_ns);
+
+    memset(&ru, 0, sizeof(ru));
+    getrusage(RUSAGE_SELF, &ru);
+    fprintf(f, "  \"process\": {\"wall_ns\": %llu, \"cpu_ns\": %llu, \"peak_rss_kb\": %ld}\n}\n",
+            (unsigned long long)(stats_process_start ? stats_now_ns() - stats_process_start : 0),
+            (unsigned long long)stats_cpu_ns(CLOCK_PROCESS_CPUTIME_ID), ru.ru_maxrss);
+}
+
+/* the counters of 'ctx' as JSON, with the parse times of 'loader' (its dex) */
+void stats_write(FILE *f, const sdvm_context *ctx, const sdvm_context *loader)
+{
+    sdvm_stats s = ctx->stats;
+
+    /* a run in progress counts up to now */
+    if (s.run_start_ns) {
+        s.runs++;
+        s.run_ns += stats_now_ns() - s.run_start_ns;
+        s.run_cpu_ns += stats_cpu_ns(CLOCK_THREAD_CPUTIME_ID) - s.run_start_cpu_ns;
+    }
+    stats_write_json(f, &s, loader ? &loader->stats : &s);
+}
+
+static void stats_finish(void)
+{
+    sdvm_context *ctx = sdvm_context_current();
+    sdvm_stats s;
+    FILE *f;
+
+    /* a zygote job (fork) must not clobber the file */
+    if (stats_pid != getpid())
+        return;
+    stats_run_end(ctx);
+    pthread_mutex_lock(&stats_lock);
+    s = stats_freed;
+    pthread_mutex_unlock(&stats_lock);
+    stats_add(&s, &ctx->stats);
+
+    f = fopen(stats_file, "w");
+    if (f == NULL) {
+        fprintf(stderr, "Error! cannot write statistics %s\n", stats_file);
+        return;
+    }
+    stats_write_json(f, &s, &s);
+    fclose(f);
+}
+
+/* write the process totals to 'file' at exit */
+int stats_start(const char *file)
+{
+    if (stats_file == NULL)
+        atexit(stats_finish);
+    free(stats_file);
+    stats_file = strdup(file);
+    stats_pid = getpid();
+    if (stats_process_start == 0)
+        stats_process_start = stats_now_ns();
+    return 0;
+}
@@ -6,33 +6,34 @@
 
 #include "simple_dvm.h"
 
-static void parse_string_data_item(DexFileFormat *dex,
-                                   unsigned char *buf, int offset, int index)
+/*  String table
+ *
+ *  string_data_item records where a string's MUTF-8 bytes start in the
+ *  mapped dex file, with its UTF-16 and byte lengths. The records are
+ *  filled on first use. The bytes are never copied: the dex format stores
+ *  them NUL terminated, so get_string_data can return them directly.
+ */
+static string_data_item *get_string_data_item(DexFileFormat *dex, int string_id)
 {
-    int i = 0;
+    string_data_item *s;
     int size = 0;
-    int len = 0;
-    if (is_verbose() > 3)
-        printf("parse string data item offset = %04x ",
-               (uint)(offset + sizeof(DexHeader)));
-    memset(&dex->string_data_item[index], 0, sizeof(string_data_item));
-    dex->string_data_item[index].index = index;
-    dex->string_data_item[index].uleb128_len =
-        get_uleb128_len(buf, offset , &size) ;
 
-    strncpy(dex->string_data_item[index].data,
-            buf + offset + size,
-            dex->string_data_item[index].uleb128_len);
-    if (is_verbose() > 3) {
-        printf("str[%2d], len = %4d, ",
-               dex->string_data_item[index].index,
-               dex->string_data_item[index].uleb128_len
-              );
-        printf("data = ");
-        for (i = 0; i < dex->string_data_item[index].uleb128_len; i++)
-            printf("%c", dex->string_data_item[index].data[i]);
-        printf("\n");
+    if (string_id < 0 || string_id >= dex->header.stringIdsSize)
+        return 0;
+    s = &dex->string_data_item[string_id];
+    if (s->data_off == 0) {
+        /* data offset is never 0, that is where the header lives */
+        const uint off = dex->string_ids[string_id].string_data_off;
+        s->utf16_size = get_uleb128_len(dex->map_base, off, &size);
+        s->byte_size = strlen((char *)dex->map_base + off + size);
+        s->data_off = off + size;
     }
+    return s;
+}
+
+static void resolve_string_data_item(void *arg, int string_id)
+{
+    get_string_data_item((DexFileFormat *)arg, string_id);
 }
 
 void parse_string_ids(DexFileFormat *dex, unsigned char *buf, int offset)
@@ -40,30 +41,46 @@ void parse_string_ids(DexFileFormat *dex, unsigned char *buf, int offset)
     int i = 0;
     if (is_verbose() > 3)
         printf("parse string ids offset = %04x\n", (uint)(offset + sizeof(DexHeader)));
-    dex->string_ids = malloc(
-                          sizeof(string_ids) * dex->header.stringIdsSize);
-    dex->string_data_item = malloc(
-                                sizeof(string_data_item) * dex->header.stringIdsSize);
-    for (i = 0 ; i < dex->header.stringIdsSize ; i++) {
-        memcpy(&dex->string_ids[i].string_data_off,
-               buf + i * 4 + offset, 4);
-        parse_string_data_item(dex, buf,
-                               dex->string_ids[i].string_data_off - sizeof(dex->header),
-                               i);
+    /* string_ids is referenced in place, the records are resolved lazily */
+    dex->string_ids = (string_ids *)(buf + offset);
+    dex->string_data_item = calloc(dex->header.stringIdsSize, sizeof(string_data_item));
+    dex->string_obj = calloc(dex->header.stringIdsSize, sizeof(string_object *));
+
+    if (is_verbose() > 3) {
+        for (i = 0 ; i < dex->header.stringIdsSize ; i++) {
+            string_data_item *s = get_string_data_item(dex, i);
+            printf("parse string data item offset = %04x str[%2d], len = %4d, data = %s\n",
+                   dex->string_ids[i].string_data_off, i, s->utf16_size,
+                   (char *)dex->map_base + s->data_off);
+        }
     }
 }
 
-static string_data_item *get_string_data_item(DexFileFormat *dex, int string_id)
+/* resolve every record now, on the thread pool */
+void resolve_string_data(DexFileFormat *dex)
 {
-    if (string_id >= 0 && string_id < dex->header.stringIdsSize)
-        return &dex->string_data_item[string_id];
-    return 0;
+    thread_pool_for(dex->header.stringIdsSize, resolve_string_data_item, dex);
 }
 
+/* the MUTF-8 bytes of string_id, NUL terminated, or NULL */
 char *get_string_data(DexFileFormat *dex, int string_id)
 {
     string_data_item *s = get_string_data_item(dex, string_id);
     if (s != 0)
-        return s->data;
+        return (char *)dex->map_base + s->data_off;
     return 0;
 }
+
+/* same as get_string_data, with the byte and UTF-16 lengths */
+char *get_string_data_len(DexFileFormat *dex, int string_id,
+                          uint *byte_size, uint *utf16_size)
+{
+    string_data_item *s = get_string_data_item(dex, string_id);
+    if (s == 0)
+        return 0;
+    if (byte_size)
+        *byte_size = s->byte_size;
+    if (utf16_size)
+        *utf16_size = s->utf16_size;
+    return (char *)dex->map_base + s->data_off;
+}
@@ -0,0 +1,439 @@
+/*
+ * Simple Dalvik Virtual Machine Implementation
+ *
+ * Copyright (C) 2014 cycheng <createinfinite@yahoo.com.tw>
+ * Copyright (C) 2013 Chun-Yu Wang <wicanr2@gmail.com>
+ */
+
+#include "simple_dvm.h"
+
+/*  java.lang.String support
+ *
+ *  Like the compact strings of OpenJDK, a string whose chars all fit in one
+ *  byte is always stored as Latin-1 (coder == STRING_CODER_LATIN1), otherwise
+ *  as UTF-16 units. Keeping that invariant means two strings with different
+ *  coders can never be equal, and equals() is a plain memcmp.
+ */
+
+int is_string_object(const sdvm_obj *obj)
+{
+    return obj != NULL && obj->clazz == NULL &&
+           obj->other_data == (void *)ICT_STRING_OBJ;
+}
+
+static string_object *alloc_string_object(uint count, int coder)
+{
+    const uint bytes = (coder == STRING_CODER_LATIN1) ? count : count * 2;
+    string_object *s = (string_object *)
+        sdvm_heap_alloc(sizeof(string_object) + bytes, "Ljava/lang/String;");
+
+    s->obj.ref_count = 1;
+    s->obj.clazz = NULL;
+    s->obj.other_data = (void *)ICT_STRING_OBJ;
+    s->count = count;
+    s->coder = coder;
+    s->value = (u1 *)(s + 1);
+    return s;
+}
+
+/* copy 'count' chars of 'value' (encoded by 'coder') into a new string */
+string_object *new_string_object(const void *value, uint count, int coder)
+{
+    string_object *s;
+    uint i;
+
+    if (coder == STRING_CODER_UTF16) {
+        const ushort *utf16 = (const ushort *)value;
+        for (i = 0; i < count; i++)
+            if (utf16[i] > 0xff)
+                break;
+        if (i == count) {
+            /* every char fits in Latin-1, compress it */
+            s = alloc_string_object(count, STRING_CODER_LATIN1);
+            for (i = 0; i < count; i++)
+                ((u1 *)s->value)[i] = (u1)utf16[i];
+            return s;
+        }
+    }
+
+    s = alloc_string_object(count, coder);
+    memcpy((void *)s->value, value,
+           coder == STRING_CODER_LATIN1 ? count : count * 2);
+    return s;
+}
+
+/*  Wrap 'value' without copying, it has to stay alive as long as the string
+ *  (i.e. forever). The caller keeps the Latin-1 invariant for 'coder'.
+ */
+string_object *new_string_object_ref(const void *value, uint count, int coder)
+{
+    string_object *s = alloc_string_object(0, coder);
+
+    s->count = count;
+    s->value = value;
+    return s;
+}
+
+/*  Decode (M)UTF-8 bytes into UTF-16 units, return the number of units.
+ *  'out' may be NULL to only count. Modified UTF-8 is a superset of what we
+ *  need here : NUL is 0xC0 0x80 and supplementary chars are two 3-byte
+ *  surrogates, both decode naturally.
+ */
+static uint utf8_decode(const u1 *in, uint len, ushort *out)
+{
+    uint i = 0, n = 0;
+    while (i < len) {
+        u1 c = in[i];
+        ushort ch;
+        if (c < 0x80) {
+            ch = c;
+            i += 1;
+        } else if ((c & 0xe0) == 0xc0 && i + 1 < len) {
+            ch = ((c & 0x1f) << 6) | (in[i + 1] & 0x3f);
+            i += 2;
+        } else if ((c & 0xf0) == 0xe0 && i + 2 < len) {
+            ch = ((c & 0x0f) << 12) | ((in[i + 1] & 0x3f) << 6) |
+                 (in[i + 2] & 0x3f);
+            i += 3;
+        } else if ((c & 0xf8) == 0xf0 && i + 3 < len) {
+            /* standard UTF-8 (e.g. from stdin), emit a surrogate pair */
+            const uint cp = ((c & 0x07) << 18) | ((in[i + 1] & 0x3f) << 12) |
+                            ((in[i + 2] & 0x3f) << 6) | (in[i + 3] & 0x3f);
+            if (out)
+                out[n] = 0xd800 | (((cp - 0x10000) >> 10) & 0x3ff);
+            n++;
+            ch = 0xdc00 | (cp & 0x3ff);
+            i += 4;
+        } else {
+            /* malformed sequence, replace it */
+            ch = 0xfffd;
+            i += 1;
+        }
+        if (out)
+            out[n] = ch;
+        n++;
+    }
+    return n;
+}
+
+string_object *new_string_object_from_utf8(const char *str, uint len)
+{
+    const u1 *in = (const u1 *)str;
+    uint i;
+
+    for (i = 0; i < len; i++)
+        if (in[i] >= 0x80)
+            break;
+    if (i == len)
+        return new_string_object(str, len, STRING_CODER_LATIN1);
+
+    {
+        const uint count = utf8_decode(in, len, NULL);
+        ushort *utf16 = (ushort *)malloc(sizeof(ushort) * (count + 1));
+        string_object *s;
+
+        utf8_decode(in, len, utf16);
+        s = new_string_object(utf16, count, STRING_CODER_UTF16);
+        free(utf16);
+        return s;
+    }
+}
+
+/*  const-string objects are materialised lazily and interned per string_id,
+ *  so two const-string of the same id give the same reference.
+ */
+string_object *get_const_string_object(DexFileFormat *dex, int string_id)
+{
+    string_object *s;
+    const char *data;
+    uint len, count;
+
+    if (string_id < 0 || string_id >= dex->header.stringIdsSize)
+        return NULL;
+
+    s = dex->string_obj[string_id];
+    if (s != NULL)
+        return s;
+
+    data = get_string_data_len(dex, string_id, &len, &count);
+    if (len == count) {
+        /* plain ASCII, use the bytes in the mapped dex file as they are */
+        s = new_string_object_ref(data, count, STRING_CODER_LATIN1);
+    } else {
+        s = new_string_object_from_utf8(data, len);
+    }
+    dex->string_obj[string_id] = s;
+
+    if (is_verbose() > 3)
+        printf("    intern string_id %d -> %p (len %d, coder %d)\n",
+               string_id, s, s->count, s->coder);
+    return s;
+}
+
+ushort string_object_char_at(const string_object *s, uint index)
+{
+    assert(index < s->count);
+    if (s->coder == STRING_CODER_LATIN1)
+        return ((const u1 *)s->value)[index];
+    return ((const ushort *)s->value)[index];
+}
+
+/* s[0]*31^(n-1) + s[1]*31^(n-2) + ... + s[n-1], computed once */
+int string_object_hash_code(string_object *s)
+{
+    uint h = 0, i;
+
+    if (s->hash_is_set)
+        return s->hash;
+
+    if (s->coder == STRING_CODER_LATIN1) {
+        const u1 *v = (const u1 *)s->value;
+        for (i = 0; i < s->count; i++)
+            h = 31 * h + v[i];
+    } else {
+        const ushort *v = (const ushort *)s->value;
+        for (i = 0; i < s->count; i++)
+            h = 31 * h + v[i];
+    }
+    s->hash = (int)h;
+    s->hash_is_set = 1;
+    return s->hash;
+}
+
+int string_object_equals(const string_object *a, const string_object *b)
+{
+    if (a == b)
+        return TRUE;
+    if (a->count != b->count || a->coder != b->coder)
+        return FALSE;
+    if (a->hash_is_set && b->hash_is_set && a->hash != b->hash)
+        return FALSE;
+    return memcmp(a->value, b->value,
+                  a->coder == STRING_CODER_LATIN1 ? a->count : a->count * 2) == 0;
+}
+
+/* java.lang.String.compareTo : first differing char, else length difference */
+int string_object_compare_to(const string_object *a, const string_object *b)
+{
+    const uint n = a->count < b->count ? a->count : b->count;
+    uint i = 0;
+
+    if (a->coder == STRING_CODER_LATIN1 && b->coder == STRING_CODER_LATIN1) {
+        const u1 *va = (const u1 *)a->value;
+        const u1 *vb = (const u1 *)b->value;
+        for (; i < n; i++)
+            if (va[i] != vb[i])
+                return (int)va[i] - (int)vb[i];
+    } else {
+        for (; i < n; i++) {
+            const ushort ca = string_object_char_at(a, i);
+            const ushort cb = string_object_char_at(b, i);
+            if (ca != cb)
+                return (int)ca - (int)cb;
+        }
+    }
+    return (int)a->count - (int)b->count;
+}
+
+/*  Long.parseLong rules : optional sign, then decimal digits, no overflow.
+ *  Return FALSE (NumberFormatException) on anything else.
+ */
+int string_object_parse_long(const string_object *s, s8 min, s8 max, s8 *val)
+{
+    const u8 limit = min < 0 ? 0ull - (u8)min : (u8)max;
+    u8 acc = 0;
+    int negative = 0;
+    uint i = 0;
+
+    if (s->count == 0)
+        return FALSE;
+    if (string_object_char_at(s, 0) == '-' || string_object_char_at(s, 0) == '+') {
+        negative = string_object_char_at(s, 0) == '-';
+        if (++i == s->count)
+            return FALSE;
+    }
+    for (; i < s->count; i++) {
+        const ushort ch = s->coder == STRING_CODER_LATIN1 ?
+                          ((const u1 *)s->value)[i] : ((const ushort *)s->value)[i];
+        const uint d = ch - '0';
+        if (d > 9)
+            return FALSE;
+        if (acc > (limit - d) / 10)
+            return FALSE;
+        acc = acc * 10 + d;
+    }
+    if (negative) {
+        *val = (s8)(0ull - acc);
+    } else {
+        if (acc > (u8)max)
+            return FALSE;
+        *val = (s8)acc;
+    }
+    return TRUE;
+}
+
+/* number of bytes string_object_to_utf8 will write */
+uint string_object_utf8_size(const string_object *s)
+{
+    uint i, size = 0;
+    for (i = 0; i < s->count; i++) {
+        const ushort ch = string_object_char_at(s, i);
+        size += (ch < 0x80) ? 1 : (ch < 0x800) ? 2 : 3;
+    }
+    return size;
+}
+
+/* encode as UTF-8 into 'out' (no terminating NUL), return bytes written */
+uint string_object_to_utf8(const string_object *s, char *out)
+{
+    u1 *o = (u1 *)out;
+    uint i;
+
+    for (i = 0; i < s->count; i++) {
+        const ushort ch = string_object_char_at(s, i);
+        if (ch < 0x80) {
+            *o++ = ch;
+        } else if (ch < 0x800) {
+            *o++ = 0xc0 | (ch >> 6);
+            *o++ = 0x80 | (ch & 0x3f);
+        } else {
+            *o++ = 0xe0 | (ch >> 12);
+            *o++ = 0x80 | ((ch >> 6) & 0x3f);
+            *o++ = 0x80 | (ch & 0x3f);
+        }
+    }
+    return o - (u1 *)out;
+}
+
+void print_string_object(const string_object *s)
+{
+    char small[256];
+    char *out = small;
+    uint size;
+
+    if (s->coder == STRING_CODER_LATIN1) {
+        const u1 *v = (const u1 *)s->value;
+        uint i;
+        for (i = 0; i < s->count; i++)
+            if (v[i] >= 0x80)
+                break;
+        if (i == s->count) {
+            /* plain ASCII, the payload is already UTF-8 */
+            output_write(v, s->count);
+            return;
+        }
+    }
+
+    size = string_object_utf8_size(s);
+    if (size > sizeof(small))
+        out = (char *)malloc(size);
+    string_object_to_utf8(s, out);
+    output_write(out, size);
+    if (out != small)
+        free(out);
+}
+
+/*  StringBuilder buffer management
+ *
+ *  The buffer is outside the heap (only the object header has to be below
+ *  4GB), an sdvm_buffer of the context. Once a String shares it, it is
+ *  never written again, and goes away with the context.
+ */
+#define STRING_BUILDER_MIN_CAPACITY 16
+
+void string_builder_init(string_builder_object *sb, uint capacity)
+{
+    sb->count = 0;
+    sb->capacity = capacity;
+    sb->coder = STRING_CODER_LATIN1;
+    sb->shared = 0;
+    sb->value = capacity ? sdvm_buffer_alloc(capacity) : NULL;
+}
+
+/* make room for 'extra' more chars, switching to UTF-16 if 'coder' needs it */
+static void string_builder_ensure(string_builder_object *sb, uint extra, int coder)
+{
+    const uint need = sb->count + extra;
+    const int new_coder = (coder == STRING_CODER_UTF16) ? coder : sb->coder;
+    uint capacity = sb->capacity;
+    void *value;
+
+    if (!sb->shared && need <= capacity && new_coder == sb->coder)
+        return;
+
+    if (need > capacity) {
+        capacity = capacity * 2 + 2;
+        if (capacity < need)
+            capacity = need;
+        if (capacity < STRING_BUILDER_MIN_CAPACITY)
+            capacity = STRING_BUILDER_MIN_CAPACITY;
+    }
+
+    if (new_coder == STRING_CODER_UTF16) {
+        ushort *utf16 = (ushort *)sdvm_buffer_alloc(sizeof(ushort) * capacity);
+        uint i;
+        if (sb->coder == STRING_CODER_LATIN1) {
+            for (i = 0; i < sb->count; i++)
+                utf16[i] = ((u1 *)sb->value)[i];
+        } else {
+            memcpy(utf16, sb->value, sizeof(ushort) * sb->count);
+        }
+        value = utf16;
+    } else {
+        value = sdvm_buffer_alloc(capacity);
+        memcpy(value, sb->value, sb->count);
+    }
+
+    if (!sb->shared)
+        sdvm_buffer_free(sb->value);
+    sb->value = value;
+    sb->capacity = capacity;
+    sb->coder = new_coder;
+    sb->shared = 0;
+}
+
+void string_builder_append_latin1(string_builder_object *sb, const char *str, uint len)
+{
+    string_builder_ensure(sb, len, STRING_CODER_LATIN1);
+    if (sb->coder == STRING_CODER_LATIN1) {
+        memcpy((u1 *)sb->value + sb->count, str, len);
+    } else {
+        ushort *dst = (ushort *)sb->value + sb->count;
+        uint i;
+        for (i = 0; i < len; i++)
+            dst[i] = (u1)str[i];
+    }
+    sb->count += len;
+}
+
+void string_builder_append_char(string_builder_object *sb, ushort ch)
+{
+    string_builder_ensure(sb, 1, ch > 0xff ? STRING_CODER_UTF16 : STRING_CODER_LATIN1);
+    if (sb->coder == STRING_CODER_LATIN1)
+        ((u1 *)sb->value)[sb->count] = (u1)ch;
+    else
+        ((ushort *)sb->value)[sb->count] = ch;
+    sb->count++;
+}
+
+void string_builder_append_string(string_builder_object *sb, const string_object *s)
+{
+    if (s->coder == STRING_CODER_LATIN1) {
+        string_builder_append_latin1(sb, (const char *)s->value, s->count);
+        return;
+    }
+    string_builder_ensure(sb, s->count, STRING_CODER_UTF16);
+    memcpy((ushort *)sb->value + sb->count, s->value, sizeof(ushort) * s->count);
+    sb->count += s->count;
+}
+
+/* zero-copy : the new String points at the builder buffer */
+string_object *string_builder_to_string(string_builder_object *sb)
+{
+    string_object *s = alloc_string_object(0, sb->coder);
+
+    s->count = sb->count;
+    s->value = sb->value;
+    sb->shared = 1;
+    return s;
+}
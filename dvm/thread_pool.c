@@ -0,0 +1,167 @@
+/*
+ * Simple Dalvik Virtual Machine Implementation
+ *
+ * Copyright (C) 2014 cycheng <createinfinite@yahoo.com.tw>
+ * Copyright (C) 2013 Chun-Yu Wang <wicanr2@gmail.com>
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <unistd.h>
+#include "simple_dvm.h"
+
+/*  Worker threads for the dex loader
+ *
+ *  thread_pool_for(count, fn, arg) calls fn(arg, i) for every i in
+ *  [0, count), spread over the pool threads and the calling thread, and
+ *  returns when all calls are done. Indices are handed out in chunks from
+ *  a shared counter, so uneven items (big classes) balance out.
+ *
+ *  The loop runs serially when the pool has a single thread, for small
+ *  counts, and in verbose > 3 mode (so the parser's trace stays in order).
+ *  The pool is shared by every VM instance in the process : a loop started
+ *  while another one is running also runs serially, in its own thread.
+ *  Workers run in the caller's context.
+ */
+#define THREAD_POOL_MAX        64
+#define THREAD_POOL_MIN_COUNT  64     /* below this, threads cost more */
+
+static int pool_threads = 1;    /* including the calling thread */
+static int pool_started = 0;
+static pthread_t pool_tid[THREAD_POOL_MAX];
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+
+/* the current job, protected by pool_lock except for job_next */
+static thread_pool_func job_fn;
+static void *job_arg;
+static sdvm_context *job_ctx;
+static int job_count;
+static int job_grain;
+static volatile int job_next;
+static int job_generation = 0;
+static int job_active = 0;      /* workers still inside the job */
+static int job_running = 0;     /* a thread_pool_for is in progress */
+
+static void thread_pool_run_job(thread_pool_func fn, void *arg, int count, int grain)
+{
+    for (;;) {
+        int i = __sync_fetch_and_add(&job_next, grain);
+        int end;
+        if (i >= count)
+            break;
+        end = i + grain < count ? i + grain : count;
+        for (; i < end; i++)
+            fn(arg, i);
+    }
+}
+
+static void *thread_pool_worker(void *unused)
+{
+    int seen = 0;
+
+    pthread_mutex_lock(&pool_lock);
+    for (;;) {
+        thread_pool_func fn;
+        void *arg;
+        int count, grain;
+
+        while (job_generation == seen)
+            pthread_cond_wait(&pool_work, &pool_lock);
+        seen = job_generation;
+        fn = job_fn;
+        arg = job_arg;
+        count = job_count;
+        grain = job_grain;
+        sdvm_context_switch(job_ctx);
+        pthread_mutex_unlock(&pool_lock);
+
+        thread_pool_run_job(fn, arg, count, grain);
+
+        pthread_mutex_lock(&pool_lock);
+        if (--job_active == 0)
+            pthread_cond_signal(&pool_done);
+    }
+    return NULL;
+}
+
+/* 'threads' <= 0 : one per online CPU */
+void thread_pool_init(int threads)
+{
+    if (threads <= 0) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = n > 0 ? (int)n : 1;
+    }
+    if (threads > THREAD_POOL_MAX)
+        threads = THREAD_POOL_MAX;
+    pool_threads = threads;
+}
+
+int thread_pool_size(void)
+{
+    return pool_threads;
+}
+
+/* start the workers on first use, fall back to serial if we can't */
+static int thread_pool_start(void)
+{
+    int i;
+
+    if (pool_started)
+        return pool_threads > 1;
+    pool_started = 1;
+    for (i = 0; i < pool_threads - 1; i++) {
+        if (pthread_create(&pool_tid[i], NULL, thread_pool_worker, NULL) != 0)
+            break;
+        pthread_detach(pool_tid[i]);
+    }
+    pool_threads = i + 1;
+    if (is_verbose())
+        printf("thread pool : %d threads\n", pool_threads);
+    return pool_threads > 1;
+}
+
+static void thread_pool_serial(int count, thread_pool_func fn, void *arg)
+{
+    int i;
+    for (i = 0; i < count; i++)
+        fn(arg, i);
+}
+
+void thread_pool_for(int count, thread_pool_func fn, void *arg)
+{
+    if (pool_threads <= 1 || count < THREAD_POOL_MIN_COUNT ||
+        is_verbose() > 3) {
+        thread_pool_serial(count, fn, arg);
+        return;
+    }
+
+    pthread_mutex_lock(&pool_lock);
+    if (job_running || !thread_pool_start()) {
+        pthread_mutex_unlock(&pool_lock);
+        thread_pool_serial(count, fn, arg);
+        return;
+    }
+    job_running = 1;
+    job_fn = fn;
+    job_arg = arg;
+    job_ctx = sdvm_context_current();
+    job_count = count;
+    job_grain = count / (pool_threads * 8);
+    if (job_grain < 1)
+        job_grain = 1;
+    job_next = 0;
+    job_active = pool_threads - 1;
+    job_generation++;
+    pthread_cond_broadcast(&pool_work);
+    pthread_mutex_unlock(&pool_lock);
+
+    thread_pool_run_job(fn, arg, count, job_grain);
+
+    pthread_mutex_lock(&pool_lock);
+    while (job_active > 0)
+        pthread_cond_wait(&pool_done, &pool_lock);
+    job_running = 0;
+    pthread_mutex_unlock(&pool_lock);
+}
@@ -0,0 +1,163 @@
+/*
+ * Simple Dalvik Virtual Machine Implementation
+ *
+ * Copyright (C) 2014 cycheng <createinfinite@yahoo.com.tw>
+ * Copyright (C) 2013 Chun-Yu Wang <wicanr2@gmail.com>
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "simple_dvm.h"
+
+/*  Timeline
+ *
+ *  dvm --timeline=FILE writes what the VM spent its time on as Chrome
+ *  trace events (chrome://tracing, ui.perfetto.dev), one track per thread :
+ *  the steps of parseDexFile and the link, every <clinit>, every run, the
+ *  guest methods and natives taking at least --timeline-min-us (100 by
+ *  default, so that the file stays readable), and the heap growing. The
+ *  heap has no collector, a new chunk is what stands for a GC pause.
+ *
+ *  The events are kept in memory and written at exit, the timestamps are
+ *  microseconds since --timeline was given.
+ */
+#define TIMELINE_DEFAULT_MIN_US 100
+
+typedef struct _timeline_event {
+    const char *cat;
+    char *name;
+    u8 start;
+    u8 duration;
+    int tid;
+} timeline_event;
+
+int timeline_on = 0;
+static char *timeline_file;
+static pid_t timeline_pid;
+static u8 timeline_origin;
+static u8 timeline_min_ns = TIMELINE_DEFAULT_MIN_US * 1000;
+static pthread_mutex_t timeline_lock = PTHREAD_MUTEX_INITIALIZER;
+static timeline_event *timeline_events;
+static size_t timeline_count, timeline_cap;
+static __thread int timeline_tid = 0;
+
+/* 'cat' 'name' ran from 'start' to 'end' (stats_now_ns) */
+void timeline_span(const char *cat, const char *name, u8 start, u8 end)
+{
+    timeline_event *e;
+
+    if (timeline_tid == 0)
+        timeline_tid = (int)syscall(SYS_gettid);
+    pthread_mutex_lock(&timeline_lock);
+    if (timeline_count == timeline_cap) {
+        size_t cap = timeline_cap ? timeline_cap * 2 : 1024;
+        e = (timeline_event *)realloc(timeline_events, sizeof(timeline_event) * cap);
+        if (e == NULL) {
+            pthread_mutex_unlock(&timeline_lock);
+            return;
+        }
+        timeline_events = e;
+        timeline_cap = cap;
+    }
+    e = &timeline_events[timeline_count++];
+    e->cat = cat;
+    e->name = strdup(name);
+    e->start = start;
+    e->duration = end - start;
+    e->tid = timeline_tid;
+    pthread_mutex_unlock(&timeline_lock);
+}
+
+/* guest method 'm' returns, it started at 'start' */
+void timeline_method(DexFileFormat *dex, const encoded_method *m, u8 start)
+{
+    const u8 end = stats_now_ns();
+    char name[1024];
+
+    if (end - start < timeline_min_ns)
+        return;
+    get_method_full_name(dex, m->method_id, name, sizeof(name));
+    timeline_span("method", name, start, end);
+}
+
+/* native 'clazz'.'method' returns, it started at 'start' */
+void timeline_native(const char *clazz, const char *method, u8 start)
+{
+    const u8 end = stats_now_ns();
+    char name[1024];
+
+    if (end - start < timeline_min_ns)
+        return;
+    snprintf(name, sizeof(name), "%s.%s", clazz, method);
+    timeline_span("native", name, start, end);
+}
+
+static void timeline_json_string(FILE *f, const char *s)
+{
+    fputc('"', f);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            fputc('\\', f);
+        if ((unsigned char)*s >= 0x20)
+            fputc(*s, f);
+    }
+    fputc('"', f);
+}
+
+static void timeline_finish(void)
+{
+    size_t i;
+    FILE *f;
+
+    /* a zygote job (fork) must not clobber the file */
+    if (timeline_pid != getpid())
+        return;
+    timeline_on = 0;
+    f = fopen(timeline_file, "w");
+    if (f == NULL) {
+        fprintf(stderr, "Error! cannot write timeline %s\n", timeline_file);
+        return;
+    }
+    pthread_mutex_lock(&timeline_lock);
+    fprintf(f, "{\"traceEvents\": [\n");
+    fprintf(f, "  {\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, "
+            "\"args\": {\"name\": \"dvm\"}}", (int)timeline_pid);
+    for (i = 0; i < timeline_count; i++) {
+        const timeline_event *e = &timeline_events[i];
+        /* spans started before --timeline (startup) begin at 0 */
+        const u8 start = e->start > timeline_origin ? e->start - timeline_origin : 0;
+
+        fprintf(f, ",\n  {\"name\": ");
+        timeline_json_string(f, e->name);
+        fprintf(f, ", \"cat\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, "
+                "\"pid\": %d, \"tid\": %d}", e->cat, start / 1000.0,
+                e->duration / 1000.0, (int)timeline_pid, e->tid);
+        free(e->name);
+    }
+    fprintf(f, "\n], \"displayTimeUnit\": \"ms\"}\n");
+    if (is_verbose())
+        fprintf(stderr, "timeline : %zu events in %s\n", timeline_count, timeline_file);
+    timeline_count = 0;
+    pthread_mutex_unlock(&timeline_lock);
+    fclose(f);
+}
+
+/*  record the timeline from now on, methods and natives from 'min_us'
+ *  microseconds (< 0 : the default), it goes to 'file' at exit
+ */
+int timeline_start(const char *file, long min_us)
+{
+    if (timeline_file == NULL)
+        atexit(timeline_finish);
+    free(timeline_file);
+    timeline_file = strdup(file);
+    timeline_pid = getpid();
+    if (min_us >= 0)
+        timeline_min_ns = (u8)min_us * 1000;
+    if (timeline_origin == 0)
+        timeline_origin = stats_now_ns();
+    timeline_on = 1;
+    return 0;
+}
@@ -0,0 +1,175 @@
+/*
+ * Simple Dalvik Virtual Machine Implementation
+ *
+ * Copyright (C) 2014 cycheng <createinfinite@yahoo.com.tw>
+ * Copyright (C) 2013 Chun-Yu Wang <wicanr2@gmail.com>
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include "simple_dvm.h"
+
+/*  Binary trace
+ *
+ *  The verbose printf tracing costs far more than the instructions it
+ *  describes. dvm --trace=FILE records instead one 8 byte trace_record
+ *  per instruction (method id, dex pc, opcode), and with --trace-regs one
+ *  more per register the instruction changed, with its new value. They
+ *  are written to FILE in big blocks as the program runs, or, with
+ *  --trace-ring=N, only the last N are kept in memory and written when
+ *  the trace is closed (at exit, including an exit on the budget) : what
+ *  led to the end of a run, at a fixed memory cost.
+ *
+ *  The trace belongs to a context (ctx->trace), runMethod checks for it
+ *  once per call and then runs either its traced loop or the plain one,
+ *  which has no test per instruction. Names are left out, dvm-trace
+ *  (tracedump.c) renders a trace with the string tables of the dex.
+ */
+#define TRACE_BLOCK 4096    /* records per write when streaming */
+
+static void trace_start(trace_state *t)
+{
+    trace_header h;
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, TRACE_MAGIC, sizeof(h.magic));
+    memcpy(h.checksum, t->checksum, sizeof(h.checksum));
+    h.flags = t->flags;
+    if (t->flags & TRACE_FLAG_RING && t->total > t->cap)
+        h.dropped = t->total - t->cap;
+    fwrite(&h, sizeof(h), 1, t->f);
+    t->started = 1;
+}
+
+static void trace_put(trace_state *t, const trace_record *r)
+{
+    if (t->flags & TRACE_FLAG_RING) {
+        t->buf[t->total % t->cap] = *r;
+        t->total++;
+        return;
+    }
+    if (t->count == t->cap) {
+        fwrite(t->buf, sizeof(trace_record), t->count, t->f);
+        t->count = 0;
+    }
+    t->buf[t->count++] = *r;
+    t->total++;
+}
+
+/* 'op' at 'pc' (in bytes) of 'm' is about to run */
+void trace_insn(trace_state *t, DexFileFormat *dex, const encoded_method *m, uint pc, u1 op)
+{
+    trace_record r;
+
+    if (t->total == 0) {
+        /* the dex it was taken from, for the decoder to check */
+        memcpy(t->checksum, dex->header.checksum, sizeof(t->checksum));
+        if (!(t->flags & TRACE_FLAG_RING))
+            trace_start(t);
+    }
+    r.method_id = (ushort)m->method_id;
+    r.kind = TRACE_INSN;
+    r.op = op;
+    r.value = pc / 2;
+    trace_put(t, &r);
+}
+
+/* the registers the last instruction changed */
+void trace_regs(trace_state *t, const simple_dalvik_vm *vm)
+{
+    trace_record r;
+    int i;
+
+    for (i = 0; i < 32; i++) {
+        u4 value;
+        memcpy(&value, vm->regs[i].data, sizeof(value));
+        if (value == t->shadow[i])
+            continue;
+        t->shadow[i] = value;
+        r.method_id = 0;
+        r.kind = TRACE_REG;
+        r.op = (u1)i;
+        r.value = value;
+        trace_put(t, &r);
+    }
+}
+
+static pid_t trace_pid;
+
+static void trace_close_default(void)
+{
+    /* a zygote job (fork) must not write the records of its parent again */
+    if (trace_pid != getpid())
+        return;
+    trace_close(sdvm_context_current());
+}
+
+/*  trace what 'ctx' runs to 'file' : everything, or the last 'ring'
+ *  records if it is not 0, with register changes if 'regs'
+ */
+int trace_open(sdvm_context *ctx, const char *file, long ring, int regs)
+{
+    static int registered = 0;
+    trace_state *t;
+
+    if (ring < 0) {
+        printf("Error! bad trace ring size %ld\n", ring);
+        return -1;
+    }
+    t = (trace_state *)calloc(1, sizeof(trace_state));
+    if (t == NULL)
+        return -1;
+    t->f = fopen(file, "wb");
+    if (t->f == NULL) {
+        printf("Error! cannot create trace %s\n", file);
+        free(t);
+        return -1;
+    }
+    t->flags = (regs ? TRACE_FLAG_REGS : 0) | (ring ? TRACE_FLAG_RING : 0);
+    t->cap = ring ? (size_t)ring : TRACE_BLOCK;
+    t->buf = (trace_record *)malloc(sizeof(trace_record) * t->cap);
+    if (t->buf == NULL) {
+        printf("Error! cannot allocate %zu trace records\n", t->cap);
+        fclose(t->f);
+        free(t);
+        return -1;
+    }
+    trace_close(ctx);
+    ctx->trace = t;
+    /* the command line tool never frees its context */
+    if (!registered) {
+        registered = 1;
+        trace_pid = getpid();
+        atexit(trace_close_default);
+    }
+    return 0;
+}
+
+/* write what is left and stop tracing 'ctx' */
+void trace_close(sdvm_context *ctx)
+{
+    trace_state *t = ctx->trace;
+
+    if (t == NULL)
+        return;
+    ctx->trace = NULL;
+    if (!t->started)
+        trace_start(t);
+    if (t->flags & TRACE_FLAG_RING) {
+        /* oldest first */
+        if (t->total <= t->cap) {
+            fwrite(t->buf, sizeof(trace_record), t->total, t->f);
+        } else {
+            const size_t first = t->total % t->cap;
+            fwrite(t->buf + first, sizeof(trace_record), t->cap - first, t->f);
+            fwrite(t->buf, sizeof(trace_record), first, t->f);
+        }
+    } else {
+        fwrite(t->buf, sizeof(trace_record), t->count, t->f);
+    }
+    if (is_verbose())
+        fprintf(stderr, "trace : %llu records\n", (unsigned long long)t->total);
+    fclose(t->f);
+    free(t->buf);
+    free(t);
+}
@@ -0,0 +1,84 @@
+/*
+ * Simple Dalvik Virtual Machine Implementation
+ *
+ * Copyright (C) 2014 cycheng <createinfinite@yahoo.com.tw>
+ * Copyright (C) 2013 Chun-Yu Wang <wicanr2@gmail.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "simple_dvm.h"
+
+/*  dvm-trace : render a binary trace (dvm --trace=FILE, see trace.c)
+ *
+ *  The trace only has method ids, the names come from the dex it was
+ *  taken from, which must be the same (the checksums are compared). One
+ *  line per instruction : method, dex pc, opcode ; with --trace-regs, one
+ *  more per register it changed.
+ */
+#define TRACEDUMP_NAME_SIZE 1024
+
+int main(int argc, char *argv[])
+{
+    DexFileFormat dex;
+    trace_header h;
+    trace_record r;
+    char name[TRACEDUMP_NAME_SIZE];
+    const char *op;
+    int last_method = -1;
+    u8 count = 0;
+    FILE *f;
+
+    if (argc != 3) {
+        printf("%s trace_file dex_file\n", argv[0]);
+        return 1;
+    }
+    f = fopen(argv[1], "rb");
+    if (f == NULL) {
+        printf("Error! cannot open trace %s\n", argv[1]);
+        return 1;
+    }
+    if (fread(&h, sizeof(h), 1, f) != 1 ||
+        memcmp(h.magic, TRACE_MAGIC, sizeof(h.magic)) != 0) {
+        printf("Error! %s is not a trace\n", argv[1]);
+        fclose(f);
+        return 1;
+    }
+    memset(&dex, 0, sizeof(DexFileFormat));
+    if (parseDexFile(argv[2], &dex) != 0) {
+        fclose(f);
+        return 1;
+    }
+    if (memcmp(h.checksum, dex.header.checksum, sizeof(h.checksum)) != 0) {
+        printf("Error! %s was not traced from %s\n", argv[1], argv[2]);
+        fclose(f);
+        return 1;
+    }
+    if (h.dropped)
+        printf("# ring : %llu earlier records dropped\n", (unsigned long long)h.dropped);
+
+    name[0] = '\0';
+    while (fread(&r, sizeof(r), 1, f) == 1) {
+        if (r.kind == TRACE_REG) {
+            printf("    v%d <- 0x%08x\n", r.op, r.value);
+            continue;
+        }
+        if (r.kind != TRACE_INSN) {
+            printf("Error! bad record %llu\n", (unsigned long long)count);
+            break;
+        }
+        if (r.method_id != last_method) {
+            if (r.method_id < dex.header.methodIdsSize)
+                get_method_full_name(&dex, r.method_id, name, sizeof(name));
+            else
+                snprintf(name, sizeof(name), "method@%d", r.method_id);
+            last_method = r.method_id;
+        }
+        op = opcode_name(r.op);
+        printf("%s+0x%04x: %02x %s\n", name, r.value, r.op, op ? op : "unknown");
+        count++;
+    }
+    fclose(f);
+    return 0;
+}
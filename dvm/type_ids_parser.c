@@ -12,18 +12,13 @@ void parse_type_ids(DexFileFormat *dex, unsigned char *buf, int offset)
     int i = 0;
     if (is_verbose() > 3)
         printf("parse type ids offset = %04x\n", (uint)(offset + sizeof(DexHeader)));
-    dex->type_id_item = malloc(
-                            sizeof(type_id_item) * dex->header.typeIdsSize);
+    /* referenced in place, buf is the mapped dex file */
+    dex->type_id_item = (type_id_item *)(buf + offset);
 
     for (i = 0; i < dex->header.typeIdsSize; i++) {
-        memcpy(&dex->type_id_item[i],
-               buf + i * sizeof(type_id_item) + offset,
-               sizeof(type_id_item));
-
         if (is_verbose() > 3)
             printf(" type_ids [%d], = %s\n", i,
-                   dex->string_data_item[
-                       dex->type_id_item[i].descriptor_idx].data);
+                   get_type_item_name(dex, i));
     }
 }
 
@@ -42,62 +37,55 @@ char *get_type_item_name(DexFileFormat *dex, int type_id)
     return 0;
 }
 
+/* parameter type list of proto_ids[i], entries are independent */
+static void parse_proto_type_list(void *arg, int i)
+{
+    DexFileFormat *dex = (DexFileFormat *)arg;
+    unsigned char *buf = dex->map_base + sizeof(DexHeader);
+    int j = 0;
+    int idx = dex->proto_id_item[i].return_type_idx;
+
+    memset(&dex->proto_type_list[i], 0, sizeof(type_list));
+    if (is_verbose() > 3)
+        printf(" proto_id_item [%d], %s, type_id = %d %s, parameters_off = %08x\n", i,
+               get_string_data(dex, dex->proto_id_item[i].shorty_idx),
+               idx, get_type_item_name(dex, idx),
+               dex->proto_id_item[i].parameters_off);
+    if (dex->proto_id_item[i].parameters_off == 0)
+        return;
+    if (is_verbose() > 3)
+        printf(" proto_typ_list[%d] offset %p ", i,
+               buf + dex->proto_id_item[i].parameters_off - sizeof(DexHeader));
+    memcpy(&dex->proto_type_list[i].size,
+           buf + dex->proto_id_item[i].parameters_off - sizeof(DexHeader),
+           sizeof(int));
+
+    if (is_verbose() > 3)
+        printf("proto_type_list[%d].size = %d\n", i,
+               dex->proto_type_list[i].size);
+    /* the type list is referenced in place */
+    dex->proto_type_list[i].type_item = (type_item *)
+        (buf + dex->proto_id_item[i].parameters_off - sizeof(DexHeader) + 4);
+
+    if (is_verbose() > 3) {
+        for (j = 0 ; j < dex->proto_type_list[i].size ; j++) {
+            type_item *item = &dex->proto_type_list[i].type_item[j];
+            printf("item[%d], type_idx = %d, type = %s\n",
+                   j, item->type_idx,
+                   get_type_item_name(dex, item->type_idx));
+        }
+    }
+}
+
 void parse_proto_ids(DexFileFormat *dex, unsigned char *buf, int offset)
 {
-    volatile int i = 0, j = 0;
-    int idx = 0;
     if (is_verbose() > 3)
         printf("parse proto ids offset = %04x\n", (uint)(offset + sizeof(DexHeader)));
-    dex->proto_id_item = malloc(
-                             sizeof(proto_id_item) * dex->header.protoIdsSize);
+    dex->proto_id_item = (proto_id_item *)(buf + offset);
 
     dex->proto_type_list = malloc(
                                sizeof(type_list) * dex->header.protoIdsSize);
-    for (i = 0 ; i < dex->header.protoIdsSize; i++) {
-        memcpy(&dex->proto_id_item[i],
-               buf + i * sizeof(proto_id_item) + offset,
-               sizeof(proto_id_item));
-        memset(&dex->proto_type_list[i], 0, sizeof(type_list));
-        idx = dex->proto_id_item[i].return_type_idx;
-        if (is_verbose() > 3)
-            printf(" proto_id_item [%d], %s, type_id = %d %s, parameters_off = %08x\n", i,
-                   dex->string_data_item[dex->proto_id_item[i].shorty_idx].data,
-                   idx, get_type_item_name(dex, idx),
-                   dex->proto_id_item[i].parameters_off);
-        if (dex->proto_id_item[i].parameters_off == 0)
-            continue;
-        if (is_verbose() > 3)
-            printf(" proto_typ_list[%d] offset %p ", i,
-                   buf + dex->proto_id_item[i].parameters_off - sizeof(DexHeader));
-        memcpy(&dex->proto_type_list[i].size,
-               buf + dex->proto_id_item[i].parameters_off - sizeof(DexHeader),
-               sizeof(int));
-
-        if (is_verbose() > 3)
-            printf("proto_type_list[%d].size = %d\n", i,
-                   dex->proto_type_list[i].size);
-        if (dex->proto_type_list[i].size > 0) {
-            dex->proto_type_list[i].type_item = (type_item *)
-                                                malloc(sizeof(type_item) * dex->proto_type_list[i].size);
-
-            for (j = 0 ; j < dex->proto_type_list[i].size ; j++) {
-                memset(&dex->proto_type_list[i].type_item[j], 0, sizeof(type_item));
-                type_item *item = &dex->proto_type_list[i].type_item[j];
-                memcpy(item,
-                       buf
-                       + dex->proto_id_item[i].parameters_off
-                       - sizeof(DexHeader)
-                       + 4
-                       + (sizeof(type_item) * j),
-                       sizeof(type_item));
-
-                if (is_verbose() > 3)
-                    printf("item[%d], type_idx = %d, type = %s\n",
-                           j, item->type_idx,
-                           get_type_item_name(dex, item->type_idx));
-            }
-        }
-    }
+    thread_pool_for(dex->header.protoIdsSize, parse_proto_type_list, dex);
 }
 
 proto_id_item *get_proto_item(DexFileFormat *dex, int proto_id)
@@ -121,28 +109,20 @@ void parse_field_ids(DexFileFormat *dex, unsigned char *buf, int offset)
         printf("parse feild ids offset = %04x\n"
                "    the parsed field include instance & static data\n",
                (uint)(offset + sizeof(DexHeader)));
-    dex->field_id_item = malloc(sizeof(field_id_item) * dex->header.fieldIdsSize);
+    dex->field_id_item = (field_id_item *)(buf + offset);
 
     if (is_verbose() > 3)
         printf("dex->header.fieldIdsSize = %d\n", dex->header.fieldIdsSize);
     for (i = 0; i < dex->header.fieldIdsSize; i++) {
-        memcpy(&dex->field_id_item[i],
-               buf + i * sizeof(field_id_item) + offset,
-               sizeof(field_id_item));
-
         if (is_verbose() > 3) {
             printf(" field_id_item [%d], class_id = %d %s, type_id = %d %s, name_idx=%d %s\n",
                    i, dex->field_id_item[i].class_idx,
-                   dex->string_data_item[
-                       dex->type_id_item[
-                           dex->field_id_item[i].class_idx].descriptor_idx].data,
+                   get_type_item_name(dex, dex->field_id_item[i].class_idx),
 
                    dex->field_id_item[i].type_idx,
-                   dex->string_data_item[
-                       dex->type_id_item[
-                           dex->field_id_item[i].type_idx].descriptor_idx].data,
+                   get_type_item_name(dex, dex->field_id_item[i].type_idx),
                    dex->field_id_item[i].name_idx,
-                   dex->string_data_item[dex->field_id_item[i].name_idx].data);
+                   get_string_data(dex, dex->field_id_item[i].name_idx));
         }
     }
 }
@@ -156,13 +136,11 @@ field_id_item *get_field_item(DexFileFormat *dex, int field_id)
 
 const char *get_field_name(DexFileFormat *dex, int field_id) {
     field_id_item *field = get_field_item(dex, field_id);
-    return dex->string_data_item[field->name_idx].data;
+    return get_string_data(dex, field->name_idx);
 }
 
 const char *get_class_name(DexFileFormat *dex, int field_id) {
     field_id_item *field = get_field_item(dex, field_id);
-    return dex->string_data_item[
-               dex->type_id_item[
-                   field->class_idx].descriptor_idx].data;
+    return get_type_item_name(dex, field->class_idx);
 }
 
@@ -10,28 +10,27 @@
 #include <string.h>
 #include "simple_dvm.h"
 
-static int verbose_flag = 0;
-
+/* the trace level belongs to the current context, see context.c */
 int is_verbose()
 {
-    return verbose_flag;
+    return sdvm_context_current()->verbose;
 }
 
 int enable_verbose()
 {
-    verbose_flag = 1;
+    sdvm_context_current()->verbose = 1;
     return 0;
 }
 
 int disable_verbose()
 {
-    verbose_flag = 0;
+    sdvm_context_current()->verbose = 0;
     return 0;
 }
 
 int set_verbose(int l)
 {
-    verbose_flag = l;
+    sdvm_context_current()->verbose = l;
     return 0;
 }
 
@@ -175,6 +174,87 @@ uint pop(simple_dalvik_vm *vm) {
 }
 #endif
 
+/*  Run <clinit> of 'clazz' (and of its super classes first) if it has not
+ *  run yet, following the Java rules : on first new-instance, invoke-static
+ *  or static field access. A class already being initialized counts as
+ *  initialized, so a <clinit> touching its own class doesn't recurse.
+ *  <clinit> runs in the middle of the caller's method, so the registers,
+ *  pc, invoke parameters and result are saved around it.
+ */
+void init_class(DexFileFormat *dex, simple_dalvik_vm *vm, class_data_item *clazz)
+{
+    encoded_method *clinit = NULL;
+    int iter;
+
+    if (clazz == NULL || clazz->state >= CLASS_INITIALIZING)
+        return;
+    clazz->state = CLASS_INITIALIZING;
+    init_class(dex, vm, clazz->super_class);
+
+    for (iter = 0; iter < clazz->direct_methods_size; iter++) {
+        encoded_method *m = &clazz->direct_methods[iter];
+        if ((m->access_flags & ACC_STATIC) && (m->access_flags & ACC_CONSTRUCTOR)) {
+            clinit = m;
+            break;
+        }
+    }
+
+    if (clinit) {
+        simple_dvm_register regs[sizeof(vm->regs) / sizeof(vm->regs[0])];
+        invoke_parameters p = vm->p;
+        const uint pc = vm->pc;
+        u1 result[sizeof(vm->result)];
+
+        if (is_verbose()) {
+            printf("Execute static class (0x%x) initialization\n",
+                   clazz->clazz_def->class_idx);
+        }
+        sdvm_stats *stats = &sdvm_context_current()->stats;
+        u8 start = 0, began = timeline_on ? stats_now_ns() : 0;
+
+        memcpy(regs, vm->regs, sizeof(regs));
+        memcpy(result, vm->result, sizeof(result));
+
+        /* nested initializations are part of the outermost one */
+        if (stats->init_depth++ == 0)
+            start = stats_now_ns();
+        runMethod(dex, vm, clinit);
+        if (--stats->init_depth == 0)
+            stats->class_init_ns += stats_now_ns() - start;
+        stats->class_inits++;
+        if (began) {
+            char name[256];
+            snprintf(name, sizeof(name), "<clinit> %s",
+                     get_type_item_name(dex, clazz->clazz_def->class_idx));
+            timeline_span("clinit", name, began, stats_now_ns());
+        }
+
+        memcpy(vm->regs, regs, sizeof(regs));
+        memcpy(vm->result, result, sizeof(result));
+        vm->pc = pc;
+        vm->p = p;
+    }
+    clazz->state = CLASS_INITIALIZED;
+}
+
+/* initialize the class declaring static field 'fieldid' */
+void init_class_by_fieldid(DexFileFormat *dex, simple_dalvik_vm *vm, const int fieldid)
+{
+    class_data_item *clazz = get_class_data_by_fieldid(dex, fieldid);
+    int iter;
+
+    if (clazz == NULL || clazz->state == CLASS_INITIALIZED)
+        return;
+    for (iter = 0; iter < clazz->static_fields_size; iter++) {
+        if (clazz->static_fields[iter].field_id == fieldid) {
+            init_class(dex, vm, clazz);
+            return;
+        }
+    }
+    /* inherited static field, only the super class gets initialized */
+    init_class(dex, vm, clazz->super_class);
+}
+
 void invoke_clazz_method(DexFileFormat *dex, simple_dalvik_vm *vm,
                          class_data_item *clazz, invoke_parameters *p)
 {
@@ -286,8 +366,7 @@ void invoke_clazz_method(DexFileFormat *dex, simple_dalvik_vm *vm,
 uint get_field_size(DexFileFormat *dex, const uint field_id) {
     uint field_size = 0;
     field_id_item *field = get_field_item(dex, field_id);
-    char *type_name = dex->string_data_item[
-        dex->type_id_item[field->type_idx].descriptor_idx].data;
+    char *type_name = get_type_item_name(dex, field->type_idx);
     assert(field);
 
     if (strlen(type_name) == 1) {
@@ -326,8 +405,7 @@ uint get_field_size(DexFileFormat *dex, const uint field_id) {
 int get_field_type(DexFileFormat *dex, const uint field_id) {
     uint field_size = 0;
     field_id_item *field = get_field_item(dex, field_id);
-    char *type_name = dex->string_data_item[
-        dex->type_id_item[field->type_idx].descriptor_idx].data;
+    char *type_name = get_type_item_name(dex, field->type_idx);
     assert(field);
 
     if (strlen(type_name) == 1) {
@@ -355,8 +433,8 @@ int get_field_type(DexFileFormat *dex, const uint field_id) {
     return -1;
 }
 
-sdvm_obj *create_sdvm_obj() {
-    sdvm_obj *obj = malloc(sizeof(sdvm_obj));
+sdvm_obj *create_sdvm_obj(const char *type) {
+    sdvm_obj *obj = sdvm_heap_alloc(sizeof(sdvm_obj), type);
     obj->clazz = NULL;
     obj->other_data = NULL;
     obj->ref_count = 0;
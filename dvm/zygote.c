@@ -0,0 +1,377 @@
+/*
+ * Simple Dalvik Virtual Machine Implementation
+ *
+ * Copyright (C) 2014 cycheng <createinfinite@yahoo.com.tw>
+ * Copyright (C) 2013 Chun-Yu Wang <wicanr2@gmail.com>
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "simple_dvm.h"
+
+/*  Zygote : a fork server
+ *
+ *  dvm --zygote=SOCKET a.dex b.dex ... parses and links the dex files and
+ *  initializes the class of the entry (--entry, main by default) once,
+ *  then listens on the Unix socket SOCKET. For each request it forks a
+ *  child that runs the requested entry point (the zygote's if none), so a
+ *  job costs a fork : the parsed dex and the initialized heap are shared
+ *  copy-on-write.
+ *
+ *  A client (dvm --connect=SOCKET [dex_file]) sends a zygote_request with
+ *  its stdin, stdout and stderr attached (SCM_RIGHTS), the child runs with
+ *  those as fd 0, 1 and 2, and the zygote answers with the child's exit
+ *  status (1 if the entry does not exist, 128 + signal if it was killed)
+ *  once it is done.
+ *
+ *  Like a boot image, output or input done by <clinit> at preload time
+ *  goes to the zygote, not to the jobs.
+ */
+#define ZYGOTE_MAGIC    0x7a796764  /* "dgyz" */
+#define ZYGOTE_MAX_JOBS 256
+#define ZYGOTE_RECV_TIMEOUT 1   /* seconds a client has to send its request */
+
+typedef struct _zygote_request {
+    u4   magic;
+    char dex[256];      /* as given to the zygote, empty : the first one */
+    char entry[64];     /* direct method to run */
+} zygote_request;
+
+typedef struct _zygote_job {
+    pid_t pid;
+    int   conn;         /* where the exit status goes */
+} zygote_job;
+
+static int sigchld_pipe[2] = {-1, -1};
+static const char *zygote_entry = "main";  /* preloaded, and the default */
+
+static void zygote_sigchld(int sig)
+{
+    const int saved = errno;
+    char c = 0;
+
+    if (write(sigchld_pipe[1], &c, 1) < 0) {
+        /* the pipe is full, a wakeup is pending anyway */
+    }
+    errno = saved;
+}
+
+static int zygote_status(int status)
+{
+    if (WIFEXITED(status))
+        return WEXITSTATUS(status);
+    if (WIFSIGNALED(status))
+        return 128 + WTERMSIG(status);
+    return 1;
+}
+
+static void zygote_reply(int conn, int status)
+{
+    u4 value = status;
+
+    if (send(conn, &value, sizeof(value), MSG_NOSIGNAL) != sizeof(value) &&
+        is_verbose())
+        printf("zygote : client went away\n");
+    close(conn);
+}
+
+/*  receive a request and the client's fd 0, 1, 2 ; every fd a bad request
+ *  passed is closed
+ */
+static int zygote_recv(int conn, zygote_request *req, int fds[3])
+{
+    char control[CMSG_SPACE(sizeof(int) * 3)];
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    int got[3], count = 0, extra = 0, i;
+    ssize_t n;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = req;
+    iov.iov_len = sizeof(*req);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    /* bounded by ZYGOTE_RECV_TIMEOUT, see zygote_serve */
+    do {
+        n = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+    /* on failure the control data was not written */
+    if (n <= 0)
+        return -1;
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        const int nfd = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        for (i = 0; i < nfd; i++) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg) + sizeof(int) * i, sizeof(int));
+            if (count < 3)
+                got[count++] = fd;
+            else {
+                close(fd);
+                extra = 1;
+            }
+        }
+    }
+    /* MSG_CTRUNC : the kernel dropped what did not fit */
+    if (count != 3 || extra || (msg.msg_flags & MSG_CTRUNC) ||
+        n != sizeof(*req) || req->magic != ZYGOTE_MAGIC) {
+        for (i = 0; i < count; i++)
+            close(got[i]);
+        return -1;
+    }
+    memcpy(fds, got, sizeof(got));
+    req->dex[sizeof(req->dex) - 1] = 0;
+    req->entry[sizeof(req->entry) - 1] = 0;
+    return 0;
+}
+
+/* in the child : become the job and never return */
+static void zygote_run_job(DexFileFormat *dex, const zygote_request *req,
+                           int fds[3], int out_mode, size_t out_size)
+{
+    simple_dalvik_vm vm;
+    char entry[sizeof(req->entry)];
+    int i;
+
+    signal(SIGCHLD, SIG_DFL);
+    for (i = 0; i < 3; i++) {
+        dup2(fds[i], i);
+        close(fds[i]);
+    }
+    output_init(out_mode, out_size);
+    snprintf(entry, sizeof(entry), "%s", req->entry[0] ? req->entry : zygote_entry);
+    exit(simple_dvm_startup(dex, &vm, entry) != 0);
+}
+
+/* fork the job for one connection, return its pid or -1 */
+static pid_t zygote_fork(int conn, DexFileFormat *dex, char **dex_files, int dex_count,
+                         int out_mode, size_t out_size, int listen_fd)
+{
+    zygote_request req;
+    int fds[3];
+    pid_t pid;
+    int i;
+
+    if (zygote_recv(conn, &req, fds) != 0)
+        return -1;
+    for (i = 0; i < dex_count; i++)
+        if (req.dex[0] == 0 || strcmp(req.dex, dex_files[i]) == 0)
+            break;
+    if (i == dex_count) {
+        dprintf(fds[2], "zygote : %s is not preloaded\n", req.dex);
+        close(fds[0]);
+        close(fds[1]);
+        close(fds[2]);
+        return -1;
+    }
+
+    fflush(stdout);
+    pid = fork();
+    if (pid == 0) {
+        close(listen_fd);
+        close(conn);
+        close(sigchld_pipe[0]);
+        close(sigchld_pipe[1]);
+        zygote_run_job(&dex[i], &req, fds, out_mode, out_size);
+    }
+    close(fds[0]);
+    close(fds[1]);
+    close(fds[2]);
+    if (is_verbose())
+        printf("zygote : job %d runs %s %s\n", (int)pid, dex_files[i],
+               req.entry[0] ? req.entry : zygote_entry);
+    return pid;
+}
+
+static void zygote_reap(zygote_job *jobs, int *job_count)
+{
+    int status, i;
+    pid_t pid;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for (i = 0; i < *job_count; i++) {
+            if (jobs[i].pid == pid) {
+                zygote_reply(jobs[i].conn, zygote_status(status));
+                jobs[i] = jobs[--*job_count];
+                break;
+            }
+        }
+    }
+}
+
+/*  Preload 'dex_count' dex files, the class of 'entry' initialized, and
+ *  serve jobs on 'socket_path', only returns on error.
+ */
+int zygote_serve(const char *socket_path, char **dex_files, int dex_count,
+                 const char *entry, int out_mode, size_t out_size)
+{
+    DexFileFormat *dex = calloc(dex_count, sizeof(DexFileFormat));
+    zygote_job jobs[ZYGOTE_MAX_JOBS];
+    int job_count = 0;
+    struct sockaddr_un addr;
+    struct sigaction sa;
+    int listen_fd = -1, i;
+
+    if (dex == NULL)
+        return -1;
+    zygote_entry = entry;
+    for (i = 0; i < dex_count; i++) {
+        simple_dalvik_vm vm;
+        if (parseDexFile(dex_files[i], &dex[i]) != 0)
+            goto fail;
+        simple_dvm_preload(&dex[i], &vm, (char *)entry);
+    }
+
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        printf("Error! socket path too long : %s\n", socket_path);
+        goto fail;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    unlink(socket_path);
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(listen_fd, 64) != 0) {
+        printf("Error! cannot listen on %s\n", socket_path);
+        goto fail;
+    }
+
+    if (pipe2(sigchld_pipe, O_CLOEXEC | O_NONBLOCK) != 0)
+        goto fail;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = zygote_sigchld;
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigaction(SIGCHLD, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    if (is_verbose())
+        printf("zygote : %d dex preloaded, listening on %s\n", dex_count, socket_path);
+    fflush(stdout);
+
+    for (;;) {
+        struct pollfd pfd[2];
+
+        pfd[0].fd = sigchld_pipe[0];
+        pfd[0].events = POLLIN;
+        /* too many jobs in flight : stop accepting until one finishes */
+        pfd[1].fd = job_count < ZYGOTE_MAX_JOBS ? listen_fd : -1;
+        pfd[1].events = POLLIN;
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        if (pfd[0].revents & POLLIN) {
+            char drain[64];
+            while (read(sigchld_pipe[0], drain, sizeof(drain)) > 0)
+                ;
+            zygote_reap(jobs, &job_count);
+        }
+        if (pfd[1].revents & POLLIN) {
+            int conn = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+            struct timeval timeout = {ZYGOTE_RECV_TIMEOUT, 0};
+            pid_t pid;
+            if (conn < 0)
+                continue;
+            /* a client sending nothing must not hold the others up */
+            setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            pid = zygote_fork(conn, dex, dex_files, dex_count,
+                              out_mode, out_size, listen_fd);
+            if (pid < 0) {
+                zygote_reply(conn, 127);
+                continue;
+            }
+            jobs[job_count].pid = pid;
+            jobs[job_count].conn = conn;
+            job_count++;
+        }
+    }
+
+    signal(SIGCHLD, SIG_DFL);
+    for (i = 0; i < job_count; i++)
+        close(jobs[i].conn);
+    close(sigchld_pipe[0]);
+    close(sigchld_pipe[1]);
+    sigchld_pipe[0] = sigchld_pipe[1] = -1;
+fail:
+    if (listen_fd >= 0)
+        close(listen_fd);
+    for (i = 0; i < dex_count; i++)
+        freeDexFile(&dex[i]);
+    free(dex);
+    return -1;
+}
+
+/*  Client side : run 'entry' of 'dex_file' (NULL : the zygote's first dex)
+ *  in the zygote at 'socket_path' with our stdin / stdout / stderr, return
+ *  the job's exit status.
+ */
+int zygote_connect(const char *socket_path, const char *dex_file, const char *entry)
+{
+    char control[CMSG_SPACE(sizeof(int) * 3)];
+    const int fds[3] = {0, 1, 2};
+    struct sockaddr_un addr;
+    zygote_request req;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    u4 status;
+    ssize_t n;
+    int fd;
+
+    memset(&req, 0, sizeof(req));
+    req.magic = ZYGOTE_MAGIC;
+    if (dex_file)
+        strncpy(req.dex, dex_file, sizeof(req.dex) - 1);
+    if (entry)
+        strncpy(req.entry, entry, sizeof(req.entry) - 1);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        printf("Error! cannot connect to zygote %s\n", socket_path);
+        return 1;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    iov.iov_base = &req;
+    iov.iov_len = sizeof(req);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * 3);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    if (sendmsg(fd, &msg, MSG_NOSIGNAL) != sizeof(req)) {
+        printf("Error! cannot send the job to zygote %s\n", socket_path);
+        close(fd);
+        return 1;
+    }
+
+    do {
+        n = recv(fd, &status, sizeof(status), MSG_WAITALL);
+    } while (n < 0 && errno == EINTR);
+    close(fd);
+    return n == sizeof(status) ? (int)status : 1;
+}
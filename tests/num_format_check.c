@@ -0,0 +1,218 @@
+/*
+ * Simple Dalvik Virtual Machine Implementation
+ *
+ * Copyright (C) 2014 cycheng <createinfinite@yahoo.com.tw>
+ * Copyright (C) 2013 Chun-Yu Wang <wicanr2@gmail.com>
+ */
+
+#include <float.h>
+#include <limits.h>
+#include <math.h>
+#include "simple_dvm.h"
+
+/*  Check of num_format.c (make check)
+ *
+ *  format_int and format_long must print what printf does. format_double
+ *  and format_float must print what Double.toString and Float.toString
+ *  do : the edge values are compared with the strings Java gives, and
+ *  for those and a sweep of random bit patterns the output must read
+ *  back (strtod, strtof) to the same value, with no shorter decimal
+ *  doing it too (Java keeps two digits when those are closer, so a two
+ *  digit result is allowed where one would round-trip).
+ */
+#define CHECK_RANDOM 200000
+
+static int failures = 0;
+static int checks = 0;
+
+static void check_string(const char *what, const char *got, const char *want)
+{
+    checks++;
+    if (strcmp(got, want) == 0)
+        return;
+    if (failures++ < 20)
+        printf("Error! %s : got \"%s\", want \"%s\"\n", what, got, want);
+}
+
+static void check_int(int v)
+{
+    char got[NUM_FORMAT_BUF_SIZE], want[32];
+    const int len = format_int(v, got);
+
+    snprintf(want, sizeof(want), "%d", v);
+    check_string("format_int", got, want);
+    if (len != (int)strlen(got))
+        check_string("format_int length", "wrong", "strlen");
+}
+
+static void check_long(s8 v)
+{
+    char got[NUM_FORMAT_BUF_SIZE], want[32];
+    const int len = format_long(v, got);
+
+    snprintf(want, sizeof(want), "%lld", (long long)v);
+    check_string("format_long", got, want);
+    if (len != (int)strlen(got))
+        check_string("format_long length", "wrong", "strlen");
+}
+
+/* significant digits of a Java decimal string, 0 for NaN, Infinity, 0.0 */
+static int check_digits(const char *s)
+{
+    int n = 0, lead = 1, trail = 0;
+
+    for (; *s && *s != 'E'; s++) {
+        if (*s < '0' || *s > '9')
+            continue;
+        if (*s == '0' && lead)
+            continue;
+        lead = 0;
+        n++;
+        trail = *s == '0' ? trail + 1 : 0;
+    }
+    return n - trail;
+}
+
+static void check_double(double v, const char *want)
+{
+    char got[NUM_FORMAT_BUF_SIZE], shorter[64];
+    const int len = format_double(v, got);
+    double back;
+    int n;
+
+    checks++;
+    if (want)
+        check_string("format_double", got, want);
+    if (len != (int)strlen(got))
+        check_string("format_double length", "wrong", "strlen");
+    back = strtod(got, NULL);
+    if (isnan(v) ? !isnan(back) : memcmp(&back, &v, sizeof(v)) != 0) {
+        if (failures++ < 20)
+            printf("Error! format_double(%.17g) = \"%s\" does not read back\n", v, got);
+        return;
+    }
+    n = check_digits(got);
+    if (n > 2) {
+        snprintf(shorter, sizeof(shorter), "%.*e", n - 2, v);
+        if (strtod(shorter, NULL) == v && failures++ < 20)
+            printf("Error! format_double(%.17g) = \"%s\", \"%s\" is shorter\n", v, got, shorter);
+    }
+}
+
+static void check_float(float v, const char *want)
+{
+    char got[NUM_FORMAT_BUF_SIZE], shorter[64];
+    const int len = format_float(v, got);
+    float back;
+    int n;
+
+    checks++;
+    if (want)
+        check_string("format_float", got, want);
+    if (len != (int)strlen(got))
+        check_string("format_float length", "wrong", "strlen");
+    back = strtof(got, NULL);
+    if (isnan(v) ? !isnan(back) : memcmp(&back, &v, sizeof(v)) != 0) {
+        if (failures++ < 20)
+            printf("Error! format_float(%.9g) = \"%s\" does not read back\n", v, got);
+        return;
+    }
+    n = check_digits(got);
+    if (n > 2) {
+        snprintf(shorter, sizeof(shorter), "%.*e", n - 2, v);
+        if (strtof(shorter, NULL) == v && failures++ < 20)
+            printf("Error! format_float(%.9g) = \"%s\", \"%s\" is shorter\n", v, got, shorter);
+    }
+}
+
+/* xorshift64, the same sweep on every run */
+static u8 check_next(void)
+{
+    static u8 x = 0x9e3779b97f4a7c15ull;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return x;
+}
+
+int main(void)
+{
+    static const int ints[] = {
+        0, 1, -1, 9, 10, 99, 100, -100, 12345, 99999, 1000000, INT_MAX, INT_MIN,
+        INT_MIN + 1,
+    };
+    static const s8 longs[] = {
+        0, 1, -1, 99, 100, 4294967295ll, 4294967296ll, -4294967296ll,
+        1000000000000000000ll, LLONG_MAX, LLONG_MIN, LLONG_MIN + 1,
+    };
+    int i;
+
+    for (i = 0; i < (int)(sizeof(ints) / sizeof(ints[0])); i++)
+        check_int(ints[i]);
+    for (i = 0; i < (int)(sizeof(longs) / sizeof(longs[0])); i++)
+        check_long(longs[i]);
+
+    /* what Double.toString and Float.toString give (JDK 19 on, shortest) */
+    check_double(0.0, "0.0");
+    check_double(-0.0, "-0.0");
+    check_double(1.0, "1.0");
+    check_double(-1.5, "-1.5");
+    check_double(0.1, "0.1");
+    check_double(100.0, "100.0");
+    check_double(0.001, "0.001");
+    check_double(0.0001, "1.0E-4");
+    check_double(9999999.0, "9999999.0");
+    check_double(1e7, "1.0E7");
+    check_double(1e-7, "1.0E-7");
+    check_double(1.0000000000000001e-7, "1.0000000000000001E-7");
+    check_double(9.999999999999999e20, "9.999999999999999E20");
+    check_double(1e21, "1.0E21");
+    check_double(1e23, "1.0E23");
+    check_double(DBL_MAX, "1.7976931348623157E308");
+    check_double(-DBL_MAX, "-1.7976931348623157E308");
+    check_double(DBL_MIN, "2.2250738585072014E-308");
+    check_double(DBL_MIN / 2, "1.1125369292536007E-308");
+    check_double(4.9e-324, "4.9E-324");
+    check_double(9007199254740992.0, "9.007199254740992E15");
+    check_double(NAN, "NaN");
+    check_double(INFINITY, "Infinity");
+    check_double(-INFINITY, "-Infinity");
+    check_float(0.0f, "0.0");
+    check_float(-0.0f, "-0.0");
+    check_float(0.1f, "0.1");
+    check_float(1e7f, "1.0E7");
+    check_float(1e-7f, "1.0E-7");
+    check_float(16777216.0f, "1.6777216E7");
+    check_float(FLT_MAX, "3.4028235E38");
+    check_float(FLT_MIN, "1.1754944E-38");
+    check_float(1.4e-45f, "1.4E-45");
+    check_float(NAN, "NaN");
+    check_float(INFINITY, "Infinity");
+    check_float(-INFINITY, "-Infinity");
+
+    /* random bit patterns : subnormals, integers, anything */
+    for (i = 0; i < CHECK_RANDOM; i++) {
+        const u8 bits = check_next();
+        const u4 bits32 = (u4)(bits >> 32);
+        double d;
+        float f;
+
+        memcpy(&d, &bits, sizeof(d));
+        memcpy(&f, &bits32, sizeof(f));
+        check_double(d, NULL);
+        check_float(f, NULL);
+        check_int((int)bits32);
+        check_long((s8)bits);
+        /* small exponents (subnormals) and integral values */
+        d = (double)(bits & 0xfffffffffffffull) * 4.9e-324;
+        check_double(d, NULL);
+        check_double((double)(s8)(bits >> 11), NULL);
+    }
+
+    if (failures) {
+        printf("num_format : %d of %d checks failed\n", failures, checks);
+        return 1;
+    }
+    printf("num_format : %d checks OK\n", checks);
+    return 0;
+}
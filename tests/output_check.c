@@ -0,0 +1,85 @@
+/*
+ * Simple Dalvik Virtual Machine Implementation
+ *
+ * Copyright (C) 2014 cycheng <createinfinite@yahoo.com.tw>
+ * Copyright (C) 2013 Chun-Yu Wang <wicanr2@gmail.com>
+ */
+
+#define _GNU_SOURCE
+#include <sys/wait.h>
+#include <unistd.h>
+#include "simple_dvm.h"
+
+/*  Check of output.c (make check)
+ *
+ *  With stdout on a file (stdio fully buffered, dvm's default mode is
+ *  then OUTPUT_FULL), what the VM printf's between two guest writes must
+ *  land between them, in every mode. Each mode runs in a child writing to
+ *  a temporary file, the parent reads it back.
+ */
+static const char check_expected[] =
+    "guest 1\n"
+    "Warning! from the VM\n"
+    "guest 2\n"
+    "guest 3 (no newline), Error! from the VM\n"
+    "guest 4\n";
+
+static void check_child(int mode)
+{
+    output_init(mode, 0);
+    output_write("guest 1\n", 8);
+    printf("Warning! from the VM\n");
+    output_write("guest 2\n", 8);
+    output_write("guest 3 (no newline)", 20);
+    printf(", Error! from the VM\n");
+    output_flush();
+    output_write("guest 4\n", 8);
+    exit(0);
+}
+
+static int check_mode(int mode, const char *name)
+{
+    char got[256];
+    FILE *f = tmpfile();
+    size_t n;
+    pid_t pid;
+    int status;
+
+    if (f == NULL)
+        return 1;
+    fflush(stdout);
+    pid = fork();
+    if (pid == 0) {
+        dup2(fileno(f), STDOUT_FILENO);
+        check_child(mode);
+    }
+    if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != 0) {
+        printf("Error! output mode %s : the child failed\n", name);
+        fclose(f);
+        return 1;
+    }
+    rewind(f);
+    n = fread(got, 1, sizeof(got) - 1, f);
+    got[n] = '\0';
+    fclose(f);
+    if (strcmp(got, check_expected) != 0) {
+        printf("Error! output mode %s, got :\n%s---\nwant :\n%s---\n", name, got,
+               check_expected);
+        return 1;
+    }
+    return 0;
+}
+
+int main(void)
+{
+    int failed = 0;
+
+    failed += check_mode(OUTPUT_LINE, "line");
+    failed += check_mode(OUTPUT_FULL, "full");
+    failed += check_mode(OUTPUT_ASYNC, "async");
+    if (failed)
+        return 1;
+    printf("output : VM and guest output in order, 3 modes OK\n");
+    return 0;
+}